@@ -0,0 +1,453 @@
+/*
+ * Copyright (c) 2016, 2017 Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of Micro Systems Marc Balmer nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/* Annotation raster cache for GraphicsMagick for Lua */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+#include <magick/api.h>
+#include <wand/magick_wand.h>
+
+#include "luagraphicsmagick.h"
+
+#define NBUCKETS	256
+
+/*
+ * Rendered annotations are kept as transparent layers cropped to the
+ * drawn pixels, or no layer when nothing is drawn, x and y are the offset
+ * of the layer from the text origin rounded down.  The subpixel part of
+ * the origin is part of the key, so the layer holds exactly the pixels
+ * MagickAnnotateImage() would draw.  Annotating composites a copy of the
+ * layer, which shares the pixels with the cached one, over the target.
+ */
+struct annotation {
+	char			*key;
+	size_t			 keylen;
+	MagickWand		*layer;
+	long			 x;
+	long			 y;
+	struct annotation	*hnext;
+	struct annotation	*prev;
+	struct annotation	*next;
+};
+
+static pthread_mutex_t annot_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct annotation *buckets[NBUCKETS];
+static struct annotation *lru_head, *lru_tail;
+static size_t annot_count, annot_limit;
+static uint64_t annot_hits, annot_misses;
+
+static char *
+colorname(DrawingWand *dw, int stroke)
+{
+	PixelWand *pw;
+	char *name;
+
+	if ((pw = NewPixelWand()) == NULL)
+		return NULL;
+	if (stroke)
+		DrawGetStrokeColor(dw, pw);
+	else
+		DrawGetFillColor(dw, pw);
+	name = PixelGetColorAsString(pw);
+	DestroyPixelWand(pw);
+	return name;
+}
+
+/* Concatenate the NUL terminated parts of a key, parts may be NULL */
+static char *
+joinkey(const char **parts, int nparts, size_t *keylen)
+{
+	char *key;
+	size_t len[8], n = 0;
+	int i;
+
+	for (i = 0; i < nparts; i++)
+		n += (len[i] = parts[i] ? strlen(parts[i]) : 0) + 1;
+	if ((key = malloc(n)) == NULL)
+		return NULL;
+	for (n = 0, i = 0; i < nparts; i++) {
+		memcpy(key + n, parts[i] ? parts[i] : "", len[i]);
+		n += len[i];
+		key[n++] = '\0';
+	}
+	*keylen = n;
+	return key;
+}
+
+static char *
+annotationkey(DrawingWand *dw, double fx, double fy, const char *text,
+    size_t *keylen)
+{
+	const char *parts[7];
+	char *font, *family, *fill, *stroke, *key = NULL;
+	char attrs[128], origin[64];
+
+	font = DrawGetFont(dw);
+	family = DrawGetFontFamily(dw);
+	fill = colorname(dw, 0);
+	stroke = colorname(dw, 1);
+
+	if (fill != NULL && stroke != NULL) {
+		snprintf(attrs, sizeof attrs, "%g %lu %d %d %g %g %g %d %d",
+		    DrawGetFontSize(dw), DrawGetFontWeight(dw),
+		    (int)DrawGetFontStyle(dw), (int)DrawGetFontStretch(dw),
+		    DrawGetFillOpacity(dw), DrawGetStrokeWidth(dw),
+		    DrawGetStrokeOpacity(dw), (int)DrawGetTextDecoration(dw),
+		    (int)DrawGetTextAntialias(dw));
+		snprintf(origin, sizeof origin, "%.17g %.17g", fx, fy);
+		parts[0] = font;
+		parts[1] = family;
+		parts[2] = fill;
+		parts[3] = stroke;
+		parts[4] = attrs;
+		parts[5] = origin;
+		parts[6] = text;
+		key = joinkey(parts, 7, keylen);
+	}
+	free(font);
+	free(family);
+	free(fill);
+	free(stroke);
+	return key;
+}
+
+static unsigned int
+bucket(const char *key, size_t keylen)
+{
+	uint64_t h[2] = { 0, 0 };
+
+	hashbytes((const unsigned char *)key, keylen, h);
+	return h[0] % NBUCKETS;
+}
+
+static void
+unlink_lru(struct annotation *a)
+{
+	if (a->prev)
+		a->prev->next = a->next;
+	else
+		lru_head = a->next;
+	if (a->next)
+		a->next->prev = a->prev;
+	else
+		lru_tail = a->prev;
+	a->prev = a->next = NULL;
+}
+
+static void
+push_lru(struct annotation *a)
+{
+	a->prev = NULL;
+	a->next = lru_head;
+	if (lru_head)
+		lru_head->prev = a;
+	lru_head = a;
+	if (lru_tail == NULL)
+		lru_tail = a;
+}
+
+static void
+evict(struct annotation *a)
+{
+	struct annotation **p;
+
+	for (p = &buckets[bucket(a->key, a->keylen)]; *p != a;
+	    p = &(*p)->hnext)
+		;
+	*p = a->hnext;
+	unlink_lru(a);
+	annot_count--;
+	if (a->layer != NULL)
+		DestroyMagickWand(a->layer);
+	free(a->key);
+	free(a);
+}
+
+static void
+trim(void)
+{
+	while (lru_tail != NULL && annot_count > annot_limit)
+		evict(lru_tail);
+}
+
+/*
+ * Settings the key does not cover, the cache is bypassed when any of them
+ * differs from its default.
+ */
+static int
+uncacheable(DrawingWand *dw)
+{
+	DrawInfo *di;
+	const AffineMatrix *am;
+	int rv;
+
+	if ((di = DrawPeekGraphicContext(dw)) == NULL)
+		return 1;
+	am = &di->affine;
+	rv = am->sx != 1 || am->rx != 0 || am->ry != 0 || am->sy != 1 ||
+	    am->tx != 0 || am->ty != 0 ||
+	    di->undercolor.opacity != TransparentOpacity ||
+	    di->clip_path != NULL || di->fill_pattern != NULL ||
+	    di->stroke_pattern != NULL || di->density != NULL;
+	DestroyDrawInfo(di);
+	return rv;
+}
+
+/* Find the bounding box of the drawn pixels of layer */
+static int
+drawnbounds(MagickWand *layer, unsigned long width, unsigned long height,
+    unsigned long box[4])
+{
+	unsigned char *alpha;
+	unsigned long x, y;
+
+	if ((alpha = malloc(width * height)) == NULL)
+		return -1;
+	if (!MagickGetImagePixels(layer, 0, 0, width, height, "A", CharPixel,
+	    alpha)) {
+		free(alpha);
+		return -1;
+	}
+	box[0] = width;
+	box[1] = height;
+	box[2] = box[3] = 0;
+	for (y = 0; y < height; y++)
+		for (x = 0; x < width; x++)
+			if (alpha[y * width + x]) {
+				if (x < box[0])
+					box[0] = x;
+				if (x >= box[2])
+					box[2] = x + 1;
+				if (y < box[1])
+					box[1] = y;
+				box[3] = y + 1;
+			}
+	free(alpha);
+	return 0;
+}
+
+/*
+ * Render text with its origin at (fx, fy) onto a new transparent layer.
+ * The layer is made large enough for any overhang, italic or stroked,
+ * and then cropped to what was drawn.
+ */
+static struct annotation *
+render(MagickWand *mw, DrawingWand *dw, double fx, double fy,
+    const char *text)
+{
+	struct annotation *a;
+	PixelWand *none;
+	double m[NMETRICS], pad, ascent;
+	unsigned long width, height, box[4];
+	int ok;
+
+	if (fontmetrics(mw, dw, text, m))
+		return NULL;
+	if ((a = calloc(1, sizeof(struct annotation))) == NULL)
+		return NULL;
+	pad = ceil(DrawGetStrokeWidth(dw)) + ceil(DrawGetFontSize(dw));
+	ascent = ceil(m[2]);
+	width = ceil(m[4] + 2 * pad) + 1;
+	height = ceil(ascent - m[3] + 2 * pad) + 1;
+
+	none = NewPixelWand();
+	PixelSetColor(none, "none");
+	a->layer = NewMagickWand();
+	ok = MagickNewImage(a->layer, width, height, none) &&
+	    MagickAnnotateImage(a->layer, dw, pad + fx, pad + ascent + fy, 0,
+	    text) && drawnbounds(a->layer, width, height, box) == 0;
+	DestroyPixelWand(none);
+	if (ok && box[2] == 0) {
+		DestroyMagickWand(a->layer);
+		a->layer = NULL;
+	} else if (ok) {
+		ok = MagickCropImage(a->layer, box[2] - box[0],
+		    box[3] - box[1], box[0], box[1]) &&
+		    MagickSetImagePage(a->layer, 0, 0, 0, 0);
+		a->x = (long)box[0] - (long)pad;
+		a->y = (long)box[1] - (long)pad - (long)ascent;
+	}
+	if (!ok) {
+		DestroyMagickWand(a->layer);
+		free(a);
+		a = NULL;
+	}
+	return a;
+}
+
+/*
+ * Annotate through the cache.  Returns -1 when the cache is disabled or
+ * the annotation can not be cached: rotated text, text with line breaks
+ * or gravity, which positions text relative to the image, and settings
+ * the key does not cover, see uncacheable().
+ */
+int
+annotatecached(MagickWand *mw, DrawingWand *dw, double x, double y,
+    double angle, const char *text)
+{
+	struct annotation *a, *na;
+	MagickWand *layer = NULL;
+	double ix, iy;
+	long ox = 0, oy = 0;
+	char *key;
+	size_t keylen, limit;
+	unsigned int b, status;
+	int hit = 0, empty = 0;
+
+	pthread_mutex_lock(&annot_mtx);
+	limit = annot_limit;
+	pthread_mutex_unlock(&annot_mtx);
+	if (limit == 0 || angle != 0 || strchr(text, '\n') != NULL ||
+	    DrawGetGravity(dw) != ForgetGravity || uncacheable(dw))
+		return -1;
+
+	ix = floor(x);
+	iy = floor(y);
+	if ((key = annotationkey(dw, x - ix, y - iy, text, &keylen)) == NULL)
+		return -1;
+	b = bucket(key, keylen);
+
+	pthread_mutex_lock(&annot_mtx);
+	for (a = buckets[b]; a != NULL; a = a->hnext)
+		if (a->keylen == keylen && !memcmp(a->key, key, keylen))
+			break;
+	if (a != NULL) {
+		unlink_lru(a);
+		push_lru(a);
+		if (a->layer != NULL)
+			layer = CloneMagickWand(a->layer);
+		empty = a->layer == NULL;
+		ox = a->x;
+		oy = a->y;
+		hit = 1;
+		annot_hits++;
+	} else
+		annot_misses++;
+	pthread_mutex_unlock(&annot_mtx);
+
+	if (!hit) {
+		if ((na = render(mw, dw, x - ix, y - iy, text)) == NULL) {
+			free(key);
+			return -1;
+		}
+		if (na->layer != NULL)
+			layer = CloneMagickWand(na->layer);
+		empty = na->layer == NULL;
+		ox = na->x;
+		oy = na->y;
+		na->key = key;
+		na->keylen = keylen;
+		key = NULL;
+
+		pthread_mutex_lock(&annot_mtx);
+		for (a = buckets[b]; a != NULL; a = a->hnext)
+			if (a->keylen == keylen &&
+			    !memcmp(a->key, na->key, keylen))
+				break;
+		if (a == NULL) {
+			na->hnext = buckets[b];
+			buckets[b] = na;
+			push_lru(na);
+			annot_count++;
+			trim();
+			na = NULL;
+		}
+		pthread_mutex_unlock(&annot_mtx);
+		if (na != NULL) {
+			if (na->layer != NULL)
+				DestroyMagickWand(na->layer);
+			free(na->key);
+			free(na);
+		}
+	}
+	free(key);
+
+	/* Nothing to draw, e.g. only blanks */
+	if (empty)
+		return 1;
+	if (layer == NULL)
+		return -1;
+	status = MagickCompositeImage(mw, layer, OverCompositeOp,
+	    (long)ix + ox, (long)iy + oy);
+	DestroyMagickWand(layer);
+	return status;
+}
+
+static int
+setAnnotationCacheSize(lua_State *L)
+{
+	lua_Integer limit;
+
+	limit = luaL_checkinteger(L, 1);
+	luaL_argcheck(L, limit >= 0, 1, "size must not be negative");
+
+	pthread_mutex_lock(&annot_mtx);
+	annot_limit = limit;
+	trim();
+	pthread_mutex_unlock(&annot_mtx);
+	return 0;
+}
+
+static int
+annotationCacheStats(lua_State *L)
+{
+	lua_Integer entries, limit, hits, misses;
+
+	pthread_mutex_lock(&annot_mtx);
+	entries = annot_count;
+	limit = annot_limit;
+	hits = annot_hits;
+	misses = annot_misses;
+	pthread_mutex_unlock(&annot_mtx);
+
+	lua_createtable(L, 0, 4);
+	lua_pushinteger(L, entries);
+	lua_setfield(L, -2, "entries");
+	lua_pushinteger(L, limit);
+	lua_setfield(L, -2, "limit");
+	lua_pushinteger(L, hits);
+	lua_setfield(L, -2, "hits");
+	lua_pushinteger(L, misses);
+	lua_setfield(L, -2, "misses");
+	return 1;
+}
+
+struct luaL_Reg annotcache_functions[] = {
+	{ "setAnnotationCacheSize",	setAnnotationCacheSize },
+	{ "annotationCacheStats",	annotationCacheStats },
+	{ NULL, NULL }
+};
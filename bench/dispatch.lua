@@ -0,0 +1,123 @@
+-- Measure the binding overhead of MagickWand, DrawingWand and PixelWand
+-- methods
+--
+-- usage: lua bench/dispatch.lua [-t seconds]
+--
+-- Every case calls a method that does next to no work on a 1x1 image, so
+-- what remains is the cost of the call through the binding: the dispatch
+-- closure, the userdata check and the argument conversion.  Times are
+-- nanoseconds per call, less the cost of calling an empty Lua function.
+-- Enum arguments are timed as the first and the last name of their list
+-- and as the integer constant exported by the module.
+
+local gm = require 'graphicsmagick'
+
+local mintime = 0.2
+
+if arg[1] == '-t' then
+	mintime = assert(tonumber(arg[2]), 'bad time')
+elseif arg[1] ~= nil then
+	io.stderr:write('usage: lua bench/dispatch.lua [-t seconds]\n')
+	os.exit(2)
+end
+
+local wand = gm.newMagickWand()
+wand:setSize(1, 1)
+assert(wand:readImage('xc:white') == 1, 'can not create an image')
+
+local drawing = gm.newDrawingWand()
+local pixel = gm.newPixelWand()
+pixel:setColor('white')
+
+local function empty()
+end
+
+local cases = {
+	{ 'empty Lua function', function (n)
+		for i = 1, n do
+			empty(wand)
+		end
+	end },
+	{ 'getImageWidth', function (n)
+		for i = 1, n do
+			wand:getImageWidth()
+		end
+	end },
+	{ 'getImageChannelDepth UndefinedChannel', function (n)
+		for i = 1, n do
+			wand:getImageChannelDepth('UndefinedChannel')
+		end
+	end },
+	{ 'getImageChannelDepth GreyChannel', function (n)
+		for i = 1, n do
+			wand:getImageChannelDepth('GreyChannel')
+		end
+	end },
+	{ 'getImageChannelDepth gm.GreyChannel', function (n)
+		local channel = gm.GreyChannel
+
+		for i = 1, n do
+			wand:getImageChannelDepth(channel)
+		end
+	end },
+	{ 'PixelWand getRed', function (n)
+		for i = 1, n do
+			pixel:getRed()
+		end
+	end },
+	{ 'DrawingWand setGravity ForgetGravity', function (n)
+		for i = 1, n do
+			drawing:setGravity('ForgetGravity')
+		end
+	end },
+	{ 'DrawingWand setGravity StaticGravity', function (n)
+		for i = 1, n do
+			drawing:setGravity('StaticGravity')
+		end
+	end },
+	{ 'DrawingWand setGravity gm.StaticGravity', function (n)
+		local gravity = gm.StaticGravity
+
+		for i = 1, n do
+			drawing:setGravity(gravity)
+		end
+	end }
+}
+
+-- Nanoseconds per call, the loop is grown until it runs long enough
+local function measure(fn)
+	local n = 1000
+
+	while true do
+		local start = os.clock()
+		fn(n)
+		local time = os.clock() - start
+		if time >= mintime then
+			return time / n * 1e9
+		end
+		n = n * (time > 0 and math.min(10, math.ceil(mintime / time * 1.2))
+		    or 10)
+	end
+end
+
+local function run(title)
+	local base
+
+	print(title)
+	for _, case in ipairs(cases) do
+		local ns = measure(case[2])
+
+		if base == nil then
+			base = ns
+			print(string.format('  %-42s %8.1f ns', case[1], ns))
+		else
+			print(string.format('  %-42s %8.1f ns', case[1], ns - base))
+		end
+	end
+end
+
+gm.enableStats(true)
+run('statistics enabled')
+gm.enableStats(false)
+run('statistics disabled')
+gm.enableStats(true)
@@ -0,0 +1,61 @@
+-- Compare resizeImage with fastResize
+--
+-- usage: OMP_NUM_THREADS=1 lua bench/resize.lua [image] [iterations]
+--
+-- Times are CPU times, which would charge resizeImage for every core
+-- OpenMP runs it on while fastResize runs on one, so the benchmark only
+-- runs single threaded.
+
+if os.getenv('OMP_NUM_THREADS') ~= '1' then
+	io.stderr:write('run with OMP_NUM_THREADS=1\n')
+	os.exit(2)
+end
+
+local gm = require 'graphicsmagick'
+
+local source = arg[1]
+local iterations = tonumber(arg[2]) or 20
+
+local function load()
+	local wand = gm.newMagickWand()
+
+	if source then
+		assert(wand:readImage(source) == 1, 'can not read ' .. source)
+	else
+		wand:setSize(4000, 3000)
+		assert(wand:readImage('plasma:fractal') == 1)
+	end
+	return wand
+end
+
+local function bench(name, fn)
+	local image = load()
+	local width, height = image:getImageWidth(), image:getImageHeight()
+	local time = 0
+
+	for i = 1, iterations do
+		local wand = image:clone()
+		local start = os.clock()
+
+		fn(wand, width // 10, height // 10)
+		time = time + os.clock() - start
+		wand:destroy()
+	end
+	print(string.format('%-28s %8.2f ms %10.1f Mpixel/s', name,
+	    time / iterations * 1000,
+	    width * height * iterations / time / 1e6))
+end
+
+for _, filter in ipairs({ 'LanczosFilter', 'MitchellFilter',
+    'TriangleFilter' }) do
+	bench('resizeImage ' .. filter, function (wand, w, h)
+		wand:resizeImage(w, h, filter, 1.0)
+	end)
+	bench('fastResize ' .. filter, function (wand, w, h)
+		wand:fastResize(w, h, filter, 1.0)
+	end)
+end
+
+local stats = gm.resizeCacheStats()
+print(string.format('contribution tables: %d, hits %d, misses %d',
+    stats.entries, stats.hits, stats.misses))
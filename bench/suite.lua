@@ -0,0 +1,1138 @@
+-- Benchmark every MagickWand, DrawingWand and PixelWand method
+--
+-- usage: lua bench/suite.lua [-o report.json] [-b baseline.json]
+--     [-t seconds] [-s sizes] [-m pattern] [-r tolerance] [-n]
+--
+--   -o  write the JSON report to a file instead of stdout
+--   -b  compare with a saved report, regressions are listed on stderr
+--       and make the suite exit with status 1
+--   -t  minimum CPU time per case, default 0.2 seconds
+--   -s  comma separated sizes to run, default small,medium; the sizes
+--       are small, medium and large
+--   -m  only run methods whose name matches the Lua pattern
+--   -r  tolerated slowdown against the baseline, default 0.1 (10%)
+--   -n  normalize baseline comparisons by the calibration score, for
+--       baselines taken on another machine
+--
+-- 'make bench' runs the suite on the module just built and writes
+-- bench.json, options are passed in BENCHFLAGS, for example
+-- make bench BENCHFLAGS='-b baseline.json'.
+--
+-- All images are synthesized from gradients and shapes, no input files
+-- are needed and every run works on the same pixels.  Times are CPU
+-- times, run with OMP_NUM_THREADS=1, as 'make bench' does, for numbers
+-- that do not depend on the number of cores.
+
+local gm = require 'graphicsmagick'
+
+local sizes = {
+	small = { 320, 240 },
+	medium = { 1280, 960 },
+	large = { 3200, 2400 }
+}
+local formats = { 'JPEG', 'PNG', 'GIF', 'TIFF' }
+local nframes = 8
+
+local options = {
+	time = 0.2,
+	sizes = 'small,medium',
+	tolerance = 0.1
+}
+
+local i = 1
+while i <= #arg do
+	local opt, val = arg[i], arg[i + 1]
+
+	if opt == '-n' then
+		options.normalize = true
+		i = i + 1
+	else
+		if val == nil then
+			io.stderr:write('missing value for ', opt, '\n')
+			os.exit(2)
+		end
+		if opt == '-o' then
+			options.output = val
+		elseif opt == '-b' then
+			options.baseline = val
+		elseif opt == '-t' then
+			options.time = assert(tonumber(val), 'bad time')
+		elseif opt == '-s' then
+			options.sizes = val
+		elseif opt == '-m' then
+			options.pattern = val
+		elseif opt == '-r' then
+			options.tolerance = assert(tonumber(val),
+			    'bad tolerance')
+		else
+			io.stderr:write('unknown option ', opt, '\n')
+			os.exit(2)
+		end
+		i = i + 2
+	end
+end
+
+-- JSON
+
+local function encode(v, out)
+	local t = type(v)
+
+	if t == 'table' then
+		if #v > 0 or next(v) == nil and getmetatable(v) == 'array' then
+			out[#out + 1] = '['
+			for n, e in ipairs(v) do
+				if n > 1 then
+					out[#out + 1] = ','
+				end
+				encode(e, out)
+			end
+			out[#out + 1] = ']'
+		else
+			-- Sorted keys keep reports of the same run diffable
+			local keys = {}
+
+			for k in pairs(v) do
+				keys[#keys + 1] = k
+			end
+			table.sort(keys)
+			out[#out + 1] = '{'
+			for n, k in ipairs(keys) do
+				if n > 1 then
+					out[#out + 1] = ','
+				end
+				encode(k, out)
+				out[#out + 1] = ':'
+				encode(v[k], out)
+			end
+			out[#out + 1] = '}'
+		end
+	elseif t == 'string' then
+		out[#out + 1] = '"' .. v:gsub('[%c"\\]', function (c)
+			return string.format('\\u%04x', c:byte())
+		end) .. '"'
+	elseif t == 'number' then
+		if math.type(v) == 'integer' then
+			out[#out + 1] = tostring(v)
+		elseif v ~= v or v == math.huge or v == -math.huge then
+			out[#out + 1] = 'null'
+		else
+			out[#out + 1] = string.format('%.6g', v)
+		end
+	elseif t == 'boolean' then
+		out[#out + 1] = tostring(v)
+	else
+		out[#out + 1] = 'null'
+	end
+	return out
+end
+
+local function decode(s)
+	local pos = 1
+	local value
+
+	local function fail(what)
+		error(string.format('JSON: %s at offset %d', what, pos))
+	end
+
+	local function skip()
+		pos = s:find('[^ \t\r\n]', pos) or #s + 1
+	end
+
+	local function str()
+		local out = {}
+
+		pos = pos + 1
+		while true do
+			local c = s:sub(pos, pos)
+
+			if c == '' then
+				fail('unterminated string')
+			elseif c == '"' then
+				pos = pos + 1
+				return table.concat(out)
+			elseif c == '\\' then
+				c = s:sub(pos + 1, pos + 1)
+				if c == 'u' then
+					out[#out + 1] = utf8.char(tonumber(
+					    s:sub(pos + 2, pos + 5), 16))
+					pos = pos + 6
+				else
+					out[#out + 1] = ({ b = '\b', f = '\f',
+					    n = '\n', r = '\r', t = '\t' })[c]
+					    or c
+					pos = pos + 2
+				end
+			else
+				out[#out + 1] = c
+				pos = pos + 1
+			end
+		end
+	end
+
+	function value()
+		skip()
+		local c = s:sub(pos, pos)
+
+		if c == '{' then
+			local t = {}
+
+			pos = pos + 1
+			skip()
+			if s:sub(pos, pos) == '}' then
+				pos = pos + 1
+				return t
+			end
+			repeat
+				skip()
+				if s:sub(pos, pos) ~= '"' then
+					fail('key expected')
+				end
+				local k = str()
+				skip()
+				if s:sub(pos, pos) ~= ':' then
+					fail('colon expected')
+				end
+				pos = pos + 1
+				t[k] = value()
+				skip()
+				c = s:sub(pos, pos)
+				pos = pos + 1
+			until c ~= ','
+			if c ~= '}' then
+				fail('end of object expected')
+			end
+			return t
+		elseif c == '[' then
+			local t = {}
+
+			pos = pos + 1
+			skip()
+			if s:sub(pos, pos) == ']' then
+				pos = pos + 1
+				return t
+			end
+			repeat
+				t[#t + 1] = value()
+				skip()
+				c = s:sub(pos, pos)
+				pos = pos + 1
+			until c ~= ','
+			if c ~= ']' then
+				fail('end of array expected')
+			end
+			return t
+		elseif c == '"' then
+			return str()
+		end
+		for word, v in pairs({ ['true'] = true, ['false'] = false,
+		    null = false }) do
+			if s:sub(pos, pos + #word - 1) == word then
+				pos = pos + #word
+				if word == 'null' then
+					return nil
+				end
+				return v
+			end
+		end
+		local num = s:match('^-?%d+%.?%d*[eE]?[-+]?%d*', pos)
+		if num == nil or num == '' then
+			fail('value expected')
+		end
+		pos = pos + #num
+		return math.tointeger(tonumber(num)) or tonumber(num)
+	end
+
+	return value()
+end
+
+-- Peak resident set size, only available on Linux
+
+local function resetpeak()
+	local f = io.open('/proc/self/clear_refs', 'w')
+
+	if f then
+		f:write('5')
+		f:close()
+	end
+end
+
+local function peakrss()
+	local f = io.open('/proc/self/status')
+
+	if f == nil then
+		return nil
+	end
+	for line in f:lines() do
+		local kb = line:match('^VmHWM:%s*(%d+)')
+
+		if kb then
+			f:close()
+			return tonumber(kb) * 1024
+		end
+	end
+	f:close()
+	return nil
+end
+
+-- Synthetic images
+
+local function synthesize(width, height, shift)
+	local wand = gm.newMagickWand()
+	local dw = gm.newDrawingWand()
+	local pw = gm.newPixelWand()
+
+	wand:setSize(width, height)
+	assert(wand:readImage('gradient:#1e3c72-#f7b733') == 1,
+	    'can not synthesize an image')
+	for n = 0, 15 do
+		local x = (n % 4 + 0.5) * width / 4 + shift
+		local y = (n // 4 + 0.5) * height / 4
+
+		pw:setColor(string.format('#%02x%02x%02x', n * 16,
+		    255 - n * 16, n * 64 % 256))
+		dw:setFillColor(pw)
+		dw:circle(x, y, x + width / 10, y)
+	end
+	dw:rectangle(width / 8, height / 8, width / 4, height / 4)
+	wand:drawImage(dw)
+	dw:destroy()
+	pw:destroy()
+	return wand
+end
+
+local function fromblob(blob)
+	local wand = gm.newMagickWand()
+
+	assert(wand:readImageBlob(blob) == 1, 'can not decode an image')
+	return wand
+end
+
+-- Everything the cases work on, for one image size
+local function fixtures(width, height)
+	local fx = {
+		width = width,
+		height = height,
+		blobs = {},
+		paths = {},
+		pw = gm.newPixelWand(),
+		red = gm.newPixelWand(),
+		white = gm.newPixelWand(),
+		half = gm.newPixelWand(),
+		dw = gm.newDrawingWand(),
+		affine = gm.newDrawingWand(),
+		template = gm.newDrawingTemplate({
+			{ 'rectangle', 0, 0, '$w', 20 }
+		}),
+		profiles = {
+			gm.newEncoderProfile({ format = 'JPEG', quality = 85 }),
+			gm.newEncoderProfile({ format = 'PNG' })
+		},
+		output = os.tmpname()
+	}
+	local source = synthesize(width, height, 0)
+
+	fx.red:setColor('red')
+	fx.white:setColor('white')
+	fx.half:setColor('rgb(50%,50%,50%)')
+	fx.pw:setColor('#336699')
+	fx.dw:setFillColor(fx.red)
+	fx.dw:rectangle(10, 10, width / 2, height / 2)
+	fx.dw:circle(width / 2, height / 2, width / 2 + 20, height / 2)
+	fx.affine:affine({ sx = 0.9, rx = 0.1, ry = 0.1, sy = 0.9, tx = 0,
+	    ty = 0 })
+
+	for _, format in ipairs(formats) do
+		local blob = source:writeImageBlob({ format = format })
+		local path = os.tmpname()
+		local f = assert(io.open(path, 'wb'))
+
+		f:write(blob)
+		f:close()
+		fx.blobs[format] = blob
+		fx.paths[format] = path
+	end
+	source:destroy()
+
+	-- The images to work on are decoded, as they would be in use
+	fx.image = fromblob(fx.blobs.JPEG)
+	fx.gif = fromblob(fx.blobs.GIF)
+
+	fx.frames = gm.newMagickWand()
+	for n = 1, nframes do
+		local frame = synthesize(width // 2, height // 2, n * 8)
+
+		frame:setImageFormat('GIF')
+		fx.frames:addImage(frame)
+		frame:destroy()
+	end
+	return fx
+end
+
+local function release(fx)
+	for _, path in pairs(fx.paths) do
+		os.remove(path)
+	end
+	os.remove(fx.output)
+end
+
+--[[
+Each case is { setup, function (object, fx, format) }.  The setup names
+what the function works on and whether it gets a fresh object for every
+call or shares one:
+
+  image    a fresh copy of the decoded JPEG image
+  gif      a fresh copy of the decoded GIF image, which has a colormap
+  frames   a fresh copy of an animation of nframes frames
+  empty    a new MagickWand
+  shared   the decoded JPEG image, for methods that do not modify it
+  palette  the decoded GIF image, shared
+  drawing  a new DrawingWand
+  pen      a shared DrawingWand
+  pixel    a new PixelWand
+  color    a shared PixelWand
+
+Cases with a formats field run once for every format, batch overrides
+the number of calls per object and area the part of the image that is
+processed.  Getters without arguments need no case, they run on the
+shared object.
+]]
+
+local magick = {
+	adaptiveThresholdImage = { 'image', function (w)
+		return w:adaptiveThresholdImage(8, 8, 0)
+	end },
+	addImage = { 'image', function (w, fx)
+		return w:addImage(fx.gif)
+	end },
+	addNoiseImage = { 'image', function (w)
+		return w:addNoiseImage('GaussianNoise')
+	end },
+	affineTransformImage = { 'image', function (w, fx)
+		return w:affineTransformImage(fx.affine)
+	end },
+	annotateImage = { 'image', function (w, fx)
+		return w:annotateImage(fx.dw, 10, 40, 0, 'Benchmark')
+	end },
+	animateImages = { skip = 'needs an X display' },
+	appendImages = { 'frames', function (w)
+		return w:appendImages(0)
+	end },
+	autoOrient = { 'image', function (w)
+		return w:autoOrient()
+	end },
+	averageImages = { 'frames', function (w)
+		return w:averageImages()
+	end },
+	blackThresholdImage = { 'image', function (w)
+		return w:blackThresholdImage(32)
+	end },
+	blurImage = { 'image', function (w)
+		return w:blurImage(0, 2)
+	end },
+	borderImage = { 'image', function (w, fx)
+		return w:borderImage(fx.red, 10, 10)
+	end },
+	cancel = { 'image', function (w)
+		return w:cancel()
+	end },
+	cdlImage = { 'image', function (w)
+		return w:cdlImage('1.1,0.0,1.0:1.0,0.0,1.0:0.9,0.0,1.0:1.0')
+	end },
+	charcoalImage = { 'image', function (w)
+		return w:charcoalImage(0, 1)
+	end },
+	chopImage = { 'image', function (w)
+		return w:chopImage(10, 10, 0, 0)
+	end },
+	clipImage = { 'image', function (w)
+		return w:clipImage()
+	end },
+	clipPathImage = { 'image', function (w)
+		return w:clipPathImage('#1', 1)
+	end },
+	clone = { 'shared', function (w)
+		return w:clone():destroy()
+	end },
+	coalesceImages = { 'frames', function (w)
+		return w:coalesceImages()
+	end },
+	colorFloodfillImage = { 'image', function (w, fx)
+		return w:colorFloodfillImage(fx.red, 10, fx.white, 0, 0)
+	end },
+	colorizeImage = { 'image', function (w, fx)
+		return w:colorizeImage(fx.red, fx.half)
+	end },
+	commentImage = { 'image', function (w)
+		return w:commentImage('benchmark')
+	end },
+	contrastImage = { 'image', function (w)
+		return w:contrastImage(1)
+	end },
+	cropImage = { 'image', function (w, fx)
+		return w:cropImage(fx.width // 2, fx.height // 2,
+		    fx.width // 4, fx.height // 4)
+	end },
+	cycleColormapImage = { 'gif', function (w)
+		return w:cycleColormapImage(3)
+	end },
+	deconstructImages = { 'frames', function (w)
+		return w:deconstructImages()
+	end },
+	describeImage = { 'shared', function (w)
+		return w:describeImage()
+	end },
+	despeckleImage = { 'image', function (w)
+		return w:despeckleImage()
+	end },
+	destroy = { 'image', function (w)
+		return w:destroy()
+	end },
+	displayImage = { skip = 'needs an X display' },
+	displayImages = { skip = 'needs an X display' },
+	drawImage = { 'image', function (w, fx)
+		return w:drawImage(fx.dw)
+	end },
+	edgeImage = { 'image', function (w)
+		return w:edgeImage(1)
+	end },
+	embossImage = { 'image', function (w)
+		return w:embossImage(0, 1)
+	end },
+	encodeMany = { 'shared', function (w, fx)
+		return w:encodeMany(fx.profiles)
+	end },
+	encodeToSize = { 'shared', function (w, fx)
+		return w:encodeToSize('JPEG', fx.width * fx.height // 20)
+	end },
+	enhanceImage = { 'image', function (w)
+		return w:enhanceImage()
+	end },
+	equalizeImage = { 'image', function (w)
+		return w:equalizeImage()
+	end },
+	extentImage = { 'image', function (w, fx)
+		return w:extentImage(fx.width + 20, fx.height + 20, 0, 0)
+	end },
+	fastResize = { 'image', function (w, fx)
+		return w:fastResize(fx.width // 4, fx.height // 4)
+	end },
+	flattenImages = { 'frames', function (w)
+		return w:flattenImages()
+	end },
+	flipImage = { 'image', function (w)
+		return w:flipImage()
+	end },
+	flopImage = { 'image', function (w)
+		return w:flopImage()
+	end },
+	frameImage = { 'image', function (w, fx)
+		return w:frameImage(fx.red, 10, 10, 3, 3)
+	end },
+	fxImage = { 'image', function (w)
+		return w:fxImage('u*0.5')
+	end },
+	gammaImage = { 'image', function (w)
+		return w:gammaImage(1.2)
+	end },
+	gammaImageChannel = { 'image', function (w)
+		return w:gammaImageChannel('RedChannel', 1.2)
+	end },
+	getConfigureInfo = { 'shared', function (w)
+		return w:getConfigureInfo('Version')
+	end },
+	getImageAttribute = { 'shared', function (w)
+		return w:getImageAttribute('comment')
+	end },
+	getImageBackgroundColor = { 'shared', function (w, fx)
+		return w:getImageBackgroundColor(fx.pw)
+	end },
+	getImageBluePrimary = { 'shared', function (w, fx)
+		return w:getImageBluePrimary(fx.pw)
+	end },
+	getImageBorderColor = { 'shared', function (w, fx)
+		return w:getImageBorderColor(fx.pw)
+	end },
+	getImageBoundingBox = { 'shared', function (w)
+		return w:getImageBoundingBox(0)
+	end },
+	getImageChannelDepth = { 'shared', function (w)
+		return w:getImageChannelDepth('RedChannel')
+	end },
+	getImageChannelExtrema = { 'shared', function (w)
+		return w:getImageChannelExtrema('RedChannel')
+	end },
+	getImageChannelMean = { 'shared', function (w)
+		return w:getImageChannelMean('RedChannel')
+	end },
+	getImageColormapColor = { 'palette', function (w, fx)
+		return w:getImageColormapColor(0, fx.pw)
+	end },
+	getImageGreenPrimary = { 'shared', function (w, fx)
+		return w:getImageGreenPrimary(fx.pw)
+	end },
+	getImageMatteColor = { 'shared', function (w, fx)
+		return w:getImageMatteColor(fx.pw)
+	end },
+	getImageRedPrimary = { 'shared', function (w, fx)
+		return w:getImageRedPrimary(fx.pw)
+	end },
+	processFrames = { 'frames', function (w, fx)
+		return w:processFrames({
+			{ 'resize', fx.width // 4, fx.height // 4 },
+			{ 'gamma', 1.2 }
+		})
+	end },
+	queryFontMetrics = { 'shared', function (w, fx)
+		return w:queryFontMetrics(fx.dw, 'Benchmark')
+	end },
+	readImage = { 'empty', formats = formats, function (w, fx, format)
+		return w:readImage(fx.paths[format])
+	end },
+	readImageBlob = { 'empty', formats = formats,
+	    function (w, fx, format)
+		return w:readImageBlob(fx.blobs[format])
+	end },
+	readImageRegion = { 'empty', formats = { 'JPEG', 'PNG' }, area = 0.25,
+	    function (w, fx, format)
+		return w:readImageRegion(fx.blobs[format], fx.width // 4,
+		    fx.height // 4, fx.width // 2, fx.height // 2)
+	end },
+	resizeAnimation = { 'frames', function (w, fx)
+		return w:resizeAnimation(fx.width // 4, fx.height // 4)
+	end },
+	resizeImage = { 'image', function (w, fx)
+		return w:resizeImage(fx.width // 4, fx.height // 4,
+		    'LanczosFilter', 1.0)
+	end },
+	rotateImage = { 'image', function (w, fx)
+		return w:rotateImage(fx.white, 30)
+	end },
+	sampleImage = { 'image', function (w, fx)
+		return w:sampleImage(fx.width // 4, fx.height // 4)
+	end },
+	scaleImage = { 'image', function (w, fx)
+		return w:scaleImage(fx.width // 4, fx.height // 4)
+	end },
+	setDeadline = { 'image', function (w)
+		return w:setDeadline(60)
+	end },
+	setImageBackgroundColor = { 'image', function (w, fx)
+		return w:setImageBackgroundColor(fx.red)
+	end },
+	setImageFormat = { 'image', function (w)
+		return w:setImageFormat('PNG')
+	end },
+	setLazy = { 'image', function (w)
+		return w:setLazy(true)
+	end },
+	setSize = { 'empty', function (w)
+		return w:setSize(640, 480)
+	end },
+	thumbnailFromCamera = { 'image', function (w)
+		return w:thumbnailFromCamera(160, 120, { fit = true })
+	end },
+	toLinear = { 'image', function (w)
+		return w:toLinear()
+	end },
+	toSRGB = { 'image', function (w)
+		return w:toSRGB()
+	end },
+	transformColorspace = { 'image', function (w)
+		return w:transformColorspace('Rec601YCbCrColorspace')
+	end },
+	trimImage = { 'image', function (w)
+		return w:trimImage(0)
+	end },
+	writeImage = { 'shared', formats = formats,
+	    function (w, fx, format)
+		return w:writeImage(fx.output, { format = format })
+	end },
+	writeImageBlob = { 'shared', formats = formats,
+	    function (w, fx, format)
+		return w:writeImageBlob({ format = format })
+	end },
+	__gc = { 'image', function (w)
+		return w:__gc()
+	end }
+}
+
+local points = { 0, 0, 40, 10, 80, 60, 10, 90 }
+local boxes = { 0, 0, 20, 20, 30, 30, 60, 50, 70, 10, 90, 40 }
+
+local drawing = {
+	affine = { 'drawing', function (dw)
+		return dw:affine({ sx = 1, rx = 0, ry = 0, sy = 1, tx = 5,
+		    ty = 5 })
+	end },
+	annotation = { 'drawing', function (dw)
+		return dw:annotation(10, 20, 'Benchmark')
+	end },
+	arc = { 'drawing', function (dw)
+		return dw:arc(0, 0, 100, 100, 0, 90)
+	end },
+	bezier = { 'drawing', function (dw)
+		return dw:bezier(points)
+	end },
+	circle = { 'drawing', function (dw)
+		return dw:circle(50, 50, 50, 60)
+	end },
+	circles = { 'drawing', function (dw)
+		return dw:circles(boxes)
+	end },
+	clearException = { 'pen', function (dw)
+		return dw:clearException()
+	end },
+	color = { 'drawing', function (dw)
+		return dw:color(10, 10, 'PointMethod')
+	end },
+	comment = { 'drawing', function (dw)
+		return dw:comment('benchmark')
+	end },
+	destroy = { 'drawing', batch = 1, function (dw)
+		return dw:destroy()
+	end },
+	drawTemplate = { 'drawing', function (dw, fx)
+		return dw:drawTemplate(fx.template, { w = 100 })
+	end },
+	ellipse = { 'drawing', function (dw)
+		return dw:ellipse(50, 50, 20, 10, 0, 360)
+	end },
+	line = { 'drawing', function (dw)
+		return dw:line(0, 0, 100, 100)
+	end },
+	lines = { 'drawing', function (dw)
+		return dw:lines(boxes)
+	end },
+	loadMVG = { 'drawing', function (dw)
+		return dw:loadMVG('rectangle 0,0 10,10 circle 5,5 5,8')
+	end },
+	matte = { 'drawing', function (dw)
+		return dw:matte(10, 10, 'PointMethod')
+	end },
+	pathClose = { 'drawing', function (dw)
+		return dw:pathClose()
+	end },
+	pathCurveToAbsolute = { 'drawing', function (dw)
+		return dw:pathCurveToAbsolute(0, 0, 10, 20, 30, 40)
+	end },
+	pathCurveToRelative = { 'drawing', function (dw)
+		return dw:pathCurveToRelative(0, 0, 10, 20, 30, 40)
+	end },
+	pathCurveToQuadraticBezierAbsolute = { 'drawing', function (dw)
+		return dw:pathCurveToQuadraticBezierAbsolute(0, 0, 10, 20)
+	end },
+	pathCurveToQuadraticBezierRelative = { 'drawing', function (dw)
+		return dw:pathCurveToQuadraticBezierRelative(0, 0, 10, 20)
+	end },
+	pathCurveToQuadraticBezierSmoothAbsolute = { 'drawing',
+	    function (dw)
+		return dw:pathCurveToQuadraticBezierSmoothAbsolute(10, 20)
+	end },
+	pathCurveToQuadraticBezierSmoothRelative = { 'drawing',
+	    function (dw)
+		return dw:pathCurveToQuadraticBezierSmoothRelative(10, 20)
+	end },
+	pathCurveToSmoothAbsolute = { 'drawing', function (dw)
+		return dw:pathCurveToSmoothAbsolute(0, 0, 10, 20)
+	end },
+	pathCurveToSmoothRelative = { 'drawing', function (dw)
+		return dw:pathCurveToSmoothRelative(0, 0, 10, 20)
+	end },
+	pathEllipticArcAbsolute = { 'drawing', function (dw)
+		return dw:pathEllipticArcAbsolute(10, 10, 0, 0, 1, 20, 20)
+	end },
+	pathEllipticArcRelative = { 'drawing', function (dw)
+		return dw:pathEllipticArcRelative(10, 10, 0, 0, 1, 20, 20)
+	end },
+	pathFinish = { 'drawing', function (dw)
+		return dw:pathFinish()
+	end },
+	pathLineToAbsolute = { 'drawing', function (dw)
+		return dw:pathLineToAbsolute(10, 20)
+	end },
+	pathLineToHorizontalAbsolute = { 'drawing', function (dw)
+		return dw:pathLineToHorizontalAbsolute(10)
+	end },
+	pathLineToHorizontalRelative = { 'drawing', function (dw)
+		return dw:pathLineToHorizontalRelative(10)
+	end },
+	pathLineToVerticalAbsolute = { 'drawing', function (dw)
+		return dw:pathLineToVerticalAbsolute(10)
+	end },
+	pathLineToVerticalRelative = { 'drawing', function (dw)
+		return dw:pathLineToVerticalRelative(10)
+	end },
+	pathMoveToAbsolute = { 'drawing', function (dw)
+		return dw:pathMoveToAbsolute(10, 20)
+	end },
+	pathMoveToRelative = { 'drawing', function (dw)
+		return dw:pathMoveToRelative(10, 20)
+	end },
+	pathStart = { 'drawing', function (dw)
+		return dw:pathStart()
+	end },
+	point = { 'drawing', function (dw)
+		return dw:point(10, 10)
+	end },
+	points = { 'drawing', function (dw)
+		return dw:points(points)
+	end },
+	polygon = { 'drawing', function (dw)
+		return dw:polygon(points)
+	end },
+	polyline = { 'drawing', function (dw)
+		return dw:polyline(points)
+	end },
+	popClipPath = { 'drawing', function (dw)
+		return dw:popClipPath()
+	end },
+	popDefs = { 'drawing', function (dw)
+		return dw:popDefs()
+	end },
+	popGraphicContext = { 'drawing', function (dw)
+		return dw:popGraphicContext()
+	end },
+	popPattern = { 'drawing', function (dw)
+		return dw:popPattern()
+	end },
+	pushClipPath = { 'drawing', function (dw)
+		return dw:pushClipPath('clip')
+	end },
+	pushDefs = { 'drawing', function (dw)
+		return dw:pushDefs()
+	end },
+	pushGraphicContext = { 'drawing', function (dw)
+		return dw:pushGraphicContext()
+	end },
+	pushPattern = { 'drawing', function (dw)
+		return dw:pushPattern('pattern', 0, 0, 10, 10)
+	end },
+	rectangle = { 'drawing', function (dw)
+		return dw:rectangle(0, 0, 10, 10)
+	end },
+	rectangles = { 'drawing', function (dw)
+		return dw:rectangles(boxes)
+	end },
+	rotate = { 'drawing', function (dw)
+		return dw:rotate(10)
+	end },
+	roundRectangle = { 'drawing', function (dw)
+		return dw:roundRectangle(0, 0, 100, 100, 5, 5)
+	end },
+	scale = { 'drawing', function (dw)
+		return dw:scale(1.1, 1.1)
+	end },
+	setClipPath = { 'drawing', function (dw)
+		return dw:setClipPath('clip')
+	end },
+	setClipRule = { 'drawing', function (dw)
+		return dw:setClipRule('EvenOddRule')
+	end },
+	setClipUnits = { 'drawing', function (dw)
+		return dw:setClipUnits('UserSpaceOnUse')
+	end },
+	setFillColor = { 'drawing', function (dw, fx)
+		return dw:setFillColor(fx.pw)
+	end },
+	setFillOpacity = { 'drawing', function (dw)
+		return dw:setFillOpacity(0.5)
+	end },
+	setFillRule = { 'drawing', function (dw)
+		return dw:setFillRule('EvenOddRule')
+	end },
+	setFont = { 'drawing', function (dw)
+		return dw:setFont('Helvetica')
+	end },
+	setFontFamily = { 'drawing', function (dw)
+		return dw:setFontFamily('Helvetica')
+	end },
+	setFontSize = { 'drawing', function (dw)
+		return dw:setFontSize(12)
+	end },
+	setFontStretch = { 'drawing', function (dw)
+		return dw:setFontStretch('NormalStretch')
+	end },
+	setFontStyle = { 'drawing', function (dw)
+		return dw:setFontStyle('ItalicStyle')
+	end },
+	setFontWeight = { 'drawing', function (dw)
+		return dw:setFontWeight(700)
+	end },
+	setGravity = { 'drawing', function (dw)
+		return dw:setGravity('NorthWestGravity')
+	end },
+	setStrokeColor = { 'drawing', function (dw, fx)
+		return dw:setStrokeColor(fx.pw)
+	end },
+	setTextDecoration = { 'drawing', function (dw)
+		return dw:setTextDecoration('UnderlineDecoration')
+	end },
+	skewX = { 'drawing', function (dw)
+		return dw:skewX(5)
+	end },
+	skewY = { 'drawing', function (dw)
+		return dw:skewY(5)
+	end },
+	__gc = { 'drawing', batch = 1, function (dw)
+		return dw:__gc()
+	end }
+}
+
+local pixel = {
+	clone = { 'color', function (pw)
+		return pw:clone():destroy()
+	end },
+	destroy = { 'pixel', batch = 1, function (pw)
+		return pw:destroy()
+	end },
+	setColor = { 'pixel', function (pw)
+		return pw:setColor('#336699')
+	end },
+	setColorCount = { 'pixel', function (pw)
+		return pw:setColorCount(1)
+	end },
+	__gc = { 'pixel', batch = 1, function (pw)
+		return pw:__gc()
+	end }
+}
+for _, channel in ipairs({ 'Black', 'Blue', 'Cyan', 'Green', 'Magenta',
+    'Opacity', 'Red', 'Yellow' }) do
+	local set, setq = 'set' .. channel, 'set' .. channel .. 'Quantum'
+
+	pixel[set] = { 'pixel', function (pw)
+		return pw[set](pw, 0.5)
+	end }
+	pixel[setq] = { 'pixel', function (pw)
+		return pw[setq](pw, 1000)
+	end }
+end
+
+local setups = {
+	image = function (fx) return fx.image:clone() end,
+	gif = function (fx) return fx.gif:clone() end,
+	frames = function (fx) return fx.frames:clone() end,
+	empty = function () return gm.newMagickWand() end,
+	shared = function (fx) return fx.image end,
+	palette = function (fx) return fx.gif end,
+	drawing = function () return gm.newDrawingWand() end,
+	pen = function (fx) return fx.dw end,
+	pixel = function (fx) return fx.pw:clone() end,
+	color = function (fx) return fx.pw end
+}
+
+-- Setups that share their object, all others are destroyed after use
+local shared = { shared = true, palette = true, pen = true, color = true }
+
+-- Calls per fresh object, image operations get a new image every call
+local batches = { drawing = 50, pixel = 50 }
+
+-- The methods of a class, as registered in its metatable
+local function methods(metatable)
+	local mt = debug.getregistry()[metatable]
+	local names = {}
+
+	for name, fn in pairs(mt) do
+		if type(fn) == 'function' then
+			names[#names + 1] = name
+		end
+	end
+	table.sort(names)
+	return names
+end
+
+local function measure(case, fx, format)
+	local setup, fn = case[1], case[2]
+	local batch = case.batch or shared[setup] and 50 or batches[setup] or 1
+	local calls, time, status = 0, 0, nil
+	local object = setups[setup](fx)
+
+	-- The first call checks that the case works, it is not timed
+	local ok, result = pcall(fn, object, fx, format)
+	if not shared[setup] then
+		object:destroy()
+	end
+	if not ok then
+		return { error = tostring(result) }
+	end
+	status = result
+
+	collectgarbage()
+	resetpeak()
+	repeat
+		object = setups[setup](fx)
+		local start = os.clock()
+		for n = 1, batch do
+			fn(object, fx, format)
+		end
+		time = time + os.clock() - start
+		calls = calls + batch
+		if not shared[setup] then
+			object:destroy()
+		end
+	until time >= options.time
+	collectgarbage()
+
+	local r = {
+		calls = calls,
+		time = time,
+		opsPerSec = calls / time,
+		peakRSS = peakrss()
+	}
+	if setup == 'image' or setup == 'gif' or setup == 'shared' or
+	    setup == 'palette' or setup == 'empty' and format then
+		r.megapixelsPerSec = calls * fx.width * fx.height *
+		    (case.area or 1) / time / 1e6
+	elseif setup == 'frames' then
+		r.megapixelsPerSec = calls * nframes * (fx.width // 2) *
+		    (fx.height // 2) / time / 1e6
+	end
+	if status == 0 then
+		r.failed = true
+	end
+	return r
+end
+
+-- A fixed amount of Lua work, to relate results of different machines
+local function calibrate()
+	local calls, time = 0, 0
+
+	while time < 0.5 do
+		local start = os.clock()
+		local t = {}
+
+		for n = 1, 100000 do
+			t[n % 1000 + 1] = math.sin(n) * n
+		end
+		time = time + os.clock() - start
+		calls = calls + 1
+	end
+	return calls / time
+end
+
+local classes = {
+	{ 'MagickWand', 'GraphicsMagick MagickWand', magick },
+	{ 'DrawingWand', 'GraphicsMagick DrawingWand', drawing },
+	{ 'PixelWand', 'GraphicsMagick PixelWand', pixel }
+}
+
+local report = {
+	suite = 'luagraphicsmagick',
+	version = 1,
+	environment = {
+		lua = _VERSION,
+		graphicsmagick = gm.getCopyright(),
+		threads = os.getenv('OMP_NUM_THREADS') or 'default'
+	},
+	minTime = options.time,
+	calibration = calibrate(),
+	results = setmetatable({}, { __metatable = 'array' })
+}
+
+local function key(r)
+	return table.concat({ r.class, r.method, r.size or '',
+	    r.format or '' }, '/')
+end
+
+for size in options.sizes:gmatch('[^,]+') do
+	local dim = sizes[size]
+
+	if dim == nil then
+		io.stderr:write('unknown size ', size, '\n')
+		os.exit(2)
+	end
+	local fx = fixtures(dim[1], dim[2])
+
+	for _, class in ipairs(classes) do
+		local name, metatable, cases = class[1], class[2], class[3]
+
+		for _, method in ipairs(methods(metatable)) do
+			local case = cases[method]
+
+			if options.pattern and not method:find(options.pattern)
+			    then
+				goto continue
+			end
+			if case == nil and method:find('^get') then
+				case = { name == 'MagickWand' and 'shared' or
+				    name == 'DrawingWand' and 'pen' or 'color',
+				    function (object)
+					return object[method](object)
+				end }
+			end
+
+			local entries = {}
+			if case == nil then
+				io.stderr:write('no benchmark case for ', name,
+				    ':', method, '\n')
+				entries[1] = { skipped = 'no benchmark case' }
+			elseif case.skip then
+				entries[1] = { skipped = case.skip }
+			else
+				for _, format in ipairs(case.formats or
+				    { false }) do
+					local r = measure(case, fx, format or nil)
+
+					r.format = format or nil
+					entries[#entries + 1] = r
+				end
+			end
+			for _, r in ipairs(entries) do
+				r.class = name
+				r.method = method
+				r.size = size
+				report.results[#report.results + 1] = r
+			end
+			::continue::
+		end
+	end
+	release(fx)
+end
+report.peakRSS = peakrss()
+
+local status = 0
+if options.baseline then
+	local f = assert(io.open(options.baseline))
+	local baseline = decode(f:read('a'))
+	local previous, scale = {}, 1
+	local count, logsum = 0, 0
+
+	f:close()
+	for _, r in ipairs(baseline.results or {}) do
+		previous[key(r)] = r
+	end
+	if options.normalize and baseline.calibration then
+		scale = baseline.calibration / report.calibration
+	end
+	for _, r in ipairs(report.results) do
+		local b = previous[key(r)]
+
+		if b and b.opsPerSec and r.opsPerSec then
+			r.ratio = r.opsPerSec / b.opsPerSec * scale
+			count = count + 1
+			logsum = logsum + math.log(r.ratio)
+			if r.ratio < 1 - options.tolerance then
+				io.stderr:write(string.format(
+				    '%-40s %6.1f%% slower\n', key(r),
+				    (1 - r.ratio) * 100))
+				status = 1
+			end
+		end
+	end
+	if count > 0 then
+		report.geometricMeanRatio = math.exp(logsum / count)
+		io.stderr:write(string.format(
+		    '%d cases compared, geometric mean ratio %.3f\n', count,
+		    report.geometricMeanRatio))
+	end
+end
+
+local json = table.concat(encode(report, {})) .. '\n'
+if options.output then
+	local f = assert(io.open(options.output, 'w'))
+
+	f:write(json)
+	f:close()
+else
+	io.write(json)
+end
+os.exit(status)
@@ -0,0 +1,196 @@
+/*
+ * Copyright (c) 2016, 2017 Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of Micro Systems Marc Balmer nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Linear light conversions for GraphicsMagick for Lua */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+#include <magick/api.h>
+#include <wand/magick_wand.h>
+
+#include "luagraphicsmagick.h"
+
+#define ROWS		64
+
+/*
+ * Decoding looks up each sRGB sample in a table of linear values scaled
+ * to the sample range, 0-255 or 0-65535.  Encoding quantizes linear
+ * values to 16 bits and looks up the sRGB sample of that; with the steep
+ * slope of the sRGB curve near black a 16-bit index is what keeps 16-bit
+ * output within a few levels.
+ */
+static float linear8[256];
+static float linear16[65536];
+static unsigned char srgb8[65536];
+static unsigned short srgb16[65536];
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+static double
+decode(double v)
+{
+	return v <= 0.04045 ? v / 12.92 : pow((v + 0.055) / 1.055, 2.4);
+}
+
+static double
+encode(double v)
+{
+	return v <= 0.0031308 ? v * 12.92 : 1.055 * pow(v, 1.0 / 2.4) - 0.055;
+}
+
+static void
+buildtables(void)
+{
+	double v;
+	int n;
+
+	for (n = 0; n < 256; n++)
+		linear8[n] = decode(n / 255.0) * 255.0;
+	for (n = 0; n < 65536; n++) {
+		linear16[n] = decode(n / 65535.0) * 65535.0;
+		v = encode(n / 65535.0);
+		srgb8[n] = v * 255.0 + 0.5;
+		srgb16[n] = v * 65535.0 + 0.5;
+	}
+}
+
+void
+lineartables(void)
+{
+	pthread_once(&tables_once, buildtables);
+}
+
+/*
+ * Convert n RGB or, with alpha, RGBA pixels of sRGB samples to linear
+ * floats in the same range, alpha is copied.
+ */
+SIMD_CLONES void
+decodelinear(float *out, const void *in, size_t n, int wide, int alpha)
+{
+	const unsigned short *sp = in;
+	const unsigned char *cp = in;
+	size_t i;
+
+	n *= alpha ? 4 : 3;
+	if (wide)
+		for (i = 0; i < n; i++)
+			out[i] = alpha && (i & 3) == 3 ? sp[i] :
+			    linear16[sp[i]];
+	else
+		for (i = 0; i < n; i++)
+			out[i] = alpha && (i & 3) == 3 ? cp[i] :
+			    linear8[cp[i]];
+}
+
+/* Convert n pixels of linear floats back to sRGB samples */
+SIMD_CLONES void
+encodelinear(void *out, const float *in, size_t n, int wide, int alpha)
+{
+	unsigned short *sp = out;
+	unsigned char *cp = out;
+	float v, maxval, scale;
+	size_t i;
+
+	maxval = wide ? 65535.0f : 255.0f;
+	scale = 65535.0f / maxval;
+	n *= alpha ? 4 : 3;
+	for (i = 0; i < n; i++) {
+		v = in[i] < 0.0f ? 0.0f : in[i] > maxval ? maxval : in[i];
+		if (alpha && (i & 3) == 3) {
+			if (wide)
+				sp[i] = v + 0.5f;
+			else
+				cp[i] = v + 0.5f;
+		} else if (wide)
+			sp[i] = srgb16[(int)(v * scale + 0.5f)];
+		else
+			cp[i] = srgb8[(int)(v * scale + 0.5f)];
+	}
+}
+
+/*
+ * Convert the current image between sRGB and linear light in strips of
+ * ROWS rows, at 16 bits per sample.  Linear light needs more than 8 bits
+ * to avoid banding in the dark tones, so converting to linear raises the
+ * image depth to 16.  That only adds precision with a quantum depth of
+ * 16 or more, toLinear() refuses to run with less.
+ */
+int
+convertlinear(MagickWand *wand, int tolinear)
+{
+	unsigned long width, height, y, rows;
+	unsigned short *pixels;
+	float *tmp;
+	const char *map;
+	size_t i, n;
+	int status = 0, alpha;
+
+	if (MagickGetNumberImages(wand) == 0)
+		return 0;
+	lineartables();
+	width = MagickGetImageWidth(wand);
+	height = MagickGetImageHeight(wand);
+	alpha = MagickGetImageMatte(wand);
+	map = alpha ? "RGBA" : "RGB";
+	pixels = malloc((size_t)width * ROWS * 4 * sizeof(unsigned short));
+	tmp = malloc((size_t)width * ROWS * 4 * sizeof(float));
+	if (pixels == NULL || tmp == NULL)
+		goto done;
+
+	for (y = 0; y < height; y += rows) {
+		rows = height - y < ROWS ? height - y : ROWS;
+		n = (size_t)width * rows;
+		if (!MagickGetImagePixels(wand, 0, y, width, rows, map,
+		    ShortPixel, (unsigned char *)pixels))
+			goto done;
+		if (tolinear) {
+			decodelinear(tmp, pixels, n, 1, alpha);
+			for (i = 0; i < n * (alpha ? 4 : 3); i++)
+				pixels[i] = tmp[i] + 0.5f;
+		} else {
+			for (i = 0; i < n * (alpha ? 4 : 3); i++)
+				tmp[i] = pixels[i];
+			encodelinear(pixels, tmp, n, 1, alpha);
+		}
+		if (!MagickSetImagePixels(wand, 0, y, width, rows, map,
+		    ShortPixel, (unsigned char *)pixels))
+			goto done;
+	}
+	status = 1;
+	if (tolinear && MagickGetImageDepth(wand) < 16)
+		MagickSetImageDepth(wand, 16);
+done:
+	free(pixels);
+	free(tmp);
+	return status;
+}
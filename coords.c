@@ -0,0 +1,184 @@
+/*
+ * Copyright (c) 2016, 2017 Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of Micro Systems Marc Balmer nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/* Packed coordinate buffers for GraphicsMagick for Lua */
+
+#include <stddef.h>
+#include <string.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+#include <wand/magick_wand.h>
+
+#include "luagraphicsmagick.h"
+
+/*
+ * graphicsmagick.newCoordinateBuffer(n | { v1, v2, ... }) returns a buffer
+ * of n doubles, either zeroed or copied from a flat array.
+ */
+static int
+newCoordinateBuffer(lua_State *L)
+{
+	struct coordinate_buffer *buf;
+	lua_Integer n;
+	size_t len, i;
+	int isnum;
+
+	if (lua_istable(L, 1))
+		len = lua_rawlen(L, 1);
+	else {
+		n = luaL_checkinteger(L, 1);
+		luaL_argcheck(L, n >= 0, 1, "size must not be negative");
+		len = n;
+	}
+
+	buf = lua_newuserdata(L, offsetof(struct coordinate_buffer, v) +
+	    len * sizeof(double));
+	buf->n = len;
+	if (lua_istable(L, 1))
+		for (i = 0; i < len; i++) {
+			lua_rawgeti(L, 1, i + 1);
+			buf->v[i] = lua_tonumberx(L, -1, &isnum);
+			if (!isnum)
+				return luaL_argerror(L, 1,
+				    "array must only contain numbers");
+			lua_pop(L, 1);
+		}
+	else
+		memset(buf->v, 0, len * sizeof(double));
+	luaL_setmetatable(L, COORDINATE_BUFFER_METATABLE);
+	return 1;
+}
+
+/* buf:set(index, v1, v2, ...) stores values starting at index */
+static int
+set(lua_State *L)
+{
+	struct coordinate_buffer *buf;
+	lua_Integer index;
+	int n, top;
+
+	buf = checkudata(L, 1, COORDINATE_BUFFER_METATABLE);
+	index = luaL_checkinteger(L, 2);
+	top = lua_gettop(L);
+	luaL_argcheck(L, index >= 1 && index - 1 + (top - 2) <=
+	    (lua_Integer)buf->n, 2,
+	    "index out of range");
+
+	for (n = 3; n <= top; n++)
+		buf->v[index - 1 + n - 3] = luaL_checknumber(L, n);
+	return 0;
+}
+
+/* buf:get(index[, count]) returns count values starting at index */
+static int
+get(lua_State *L)
+{
+	struct coordinate_buffer *buf;
+	lua_Integer index, count, n;
+
+	buf = checkudata(L, 1, COORDINATE_BUFFER_METATABLE);
+	index = luaL_checkinteger(L, 2);
+	count = luaL_optinteger(L, 3, 1);
+	luaL_argcheck(L, count >= 0, 3, "count must not be negative");
+	luaL_argcheck(L, index >= 1 && index - 1 + count <=
+	    (lua_Integer)buf->n, 2,
+	    "index out of range");
+
+	luaL_checkstack(L, count, "too many values");
+	for (n = 0; n < count; n++)
+		lua_pushnumber(L, buf->v[index - 1 + n]);
+	return count;
+}
+
+static int
+len(lua_State *L)
+{
+	struct coordinate_buffer *buf;
+
+	buf = checkudata(L, 1, COORDINATE_BUFFER_METATABLE);
+	lua_pushinteger(L, buf->n);
+	return 1;
+}
+
+/*
+ * Return the numbers at index as a packed array of doubles.  Buffers are
+ * used in place.  Flat arrays and binary strings from string.pack('d', ...)
+ * are copied to a scratch userdata that is pushed onto the stack.
+ */
+const double *
+checkcoordinates(lua_State *L, int index, size_t *n)
+{
+	struct coordinate_buffer *buf;
+	const char *s;
+	double *v;
+	size_t len, i;
+	int isnum;
+
+	index = lua_absindex(L, index);
+	if ((buf = luaL_testudata(L, index, COORDINATE_BUFFER_METATABLE))
+	    != NULL) {
+		*n = buf->n;
+		return buf->v;
+	}
+	if (lua_type(L, index) == LUA_TSTRING) {
+		s = lua_tolstring(L, index, &len);
+		if (len % sizeof(double))
+			luaL_argerror(L, index, "packed doubles expected");
+		*n = len / sizeof(double);
+		v = lua_newuserdata(L, len);
+		memcpy(v, s, len);
+		return v;
+	}
+	luaL_checktype(L, index, LUA_TTABLE);
+	*n = lua_rawlen(L, index);
+	v = lua_newuserdata(L, *n * sizeof(double));
+	for (i = 0; i < *n; i++) {
+		lua_rawgeti(L, index, i + 1);
+		v[i] = lua_tonumberx(L, -1, &isnum);
+		if (!isnum)
+			luaL_argerror(L, index, "array must only contain "
+			    "numbers");
+		lua_pop(L, 1);
+	}
+	return v;
+}
+
+struct luaL_Reg coordinate_buffer_methods[] = {
+	{ "set",		set },
+	{ "get",		get },
+	{ "__len",		len },
+	{ NULL, NULL }
+};
+
+struct luaL_Reg coords_functions[] = {
+	{ "newCoordinateBuffer",	newCoordinateBuffer },
+	{ NULL, NULL }
+};
@@ -27,6 +27,8 @@
 
 /* GraphicsMagick DrawingWand for Lua */
 
+#include <string.h>
+
 #include <lua.h>
 #include <lauxlib.h>
 #include <lualib.h>
@@ -40,7 +42,7 @@ annotation(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	DrawAnnotation(*dw, luaL_checknumber(L, 2), luaL_checknumber(L, 3),
 	    luaL_checkstring(L, 4));
 	return 0;
@@ -61,13 +63,147 @@ getdouble(lua_State *L, int index, const char *k)
 	return val;
 }
 
+/*
+ * Points are passed as { x = x, y = y } tables, one argument per point,
+ * or as a single flat array { x1, y1, x2, y2, ... }, coordinate buffer or
+ * string of packed doubles.  The returned array is owned by the stack.
+ */
+static PointInfo *
+checkpoints(lua_State *L, unsigned long *npoints)
+{
+	PointInfo *points;
+	const double *v;
+	const char *s;
+	size_t n, len;
+	int legacy, top;
+
+	top = lua_gettop(L);
+	if (lua_type(L, 2) == LUA_TSTRING) {
+		s = lua_tolstring(L, 2, &len);
+		if (len % sizeof(PointInfo))
+			luaL_argerror(L, 2, "packed point pairs expected");
+		*npoints = len / sizeof(PointInfo);
+		points = lua_newuserdata(L, len);
+		memcpy(points, s, len);
+		return points;
+	}
+
+	/* A table with an x field or without a number first is a point */
+	if (lua_type(L, 2) == LUA_TTABLE) {
+		legacy = lua_getfield(L, 2, "x") != LUA_TNIL ||
+		    lua_rawgeti(L, 2, 1) != LUA_TNUMBER;
+		lua_settop(L, top);
+	} else
+		legacy = 0;
+	if (legacy) {
+		*npoints = top - 1;
+		points = lua_newuserdata(L, *npoints * sizeof(PointInfo));
+		for (n = 0; n < *npoints; n++) {
+			points[n].x = getdouble(L, n + 2, "x");
+			points[n].y = getdouble(L, n + 2, "y");
+		}
+		return points;
+	}
+
+	v = checkcoordinates(L, 2, &n);
+	if (n % 2)
+		luaL_argerror(L, 2, "odd number of coordinates");
+	*npoints = n / 2;
+	points = lua_newuserdata(L, *npoints * sizeof(PointInfo));
+	memcpy(points, v, n * sizeof(double));
+	return points;
+}
+
+/*
+ * Queue a batch of primitives of stride coordinates each.  Colors are
+ * given as one color name or an array with one name per primitive,
+ * the fill (or stroke) color is only changed where it differs from the
+ * previous primitive.
+ */
+static void
+batch(lua_State *L, int stride, int stroke,
+    void (*draw)(DrawingWand *, const double *))
+{
+	DrawingWand **dw;
+	PixelWand *pw = NULL;
+	const double *v;
+	const char *color, *prev = NULL;
+	size_t n, count;
+
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
+	v = checkcoordinates(L, 2, &n);
+	if (n % stride)
+		luaL_argerror(L, 2, "incomplete primitive");
+	count = n / stride;
+
+	if (!lua_isnoneornil(L, 3)) {
+		/* Validate all colors before anything needs to be undone */
+		if (!lua_isstring(L, 3)) {
+			luaL_checktype(L, 3, LUA_TTABLE);
+			luaL_argcheck(L, lua_rawlen(L, 3) >= count, 3,
+			    "not enough colors");
+			for (n = 0; n < count; n++) {
+				if (lua_rawgeti(L, 3, n + 1) != LUA_TSTRING)
+					luaL_argerror(L, 3, "color names "
+					    "expected");
+				lua_pop(L, 1);
+			}
+		}
+		if ((pw = NewPixelWand()) == NULL)
+			luaL_error(L, "memory error");
+		for (n = 0; n < (lua_istable(L, 3) ? count : 1); n++) {
+			if (lua_istable(L, 3))
+				lua_rawgeti(L, 3, n + 1);
+			else
+				lua_pushvalue(L, 3);
+			color = lua_tostring(L, -1);
+			if ((prev == NULL || strcmp(color, prev)) &&
+			    !PixelSetColor(pw, color)) {
+				DestroyPixelWand(pw);
+				luaL_argerror(L, 3, lua_pushfstring(L,
+				    "invalid color '%s'", color));
+			}
+			prev = color;
+			lua_pop(L, 1);
+		}
+		prev = NULL;
+		DrawPushGraphicContext(*dw);
+	}
+
+	for (n = 0; n < count; n++) {
+		if (pw != NULL) {
+			if (lua_istable(L, 3)) {
+				lua_rawgeti(L, 3, n + 1);
+				/* The string stays referenced by the array */
+				color = lua_tostring(L, -1);
+				lua_pop(L, 1);
+			} else
+				color = lua_tostring(L, 3);
+			if (prev == NULL || strcmp(color, prev)) {
+				PixelSetColor(pw, color);
+				if (stroke)
+					DrawSetStrokeColor(*dw, pw);
+				else
+					DrawSetFillColor(*dw, pw);
+				prev = color;
+			}
+		}
+		draw(*dw, v + n * stride);
+	}
+
+	if (pw != NULL) {
+		DrawPopGraphicContext(*dw);
+		DestroyPixelWand(pw);
+	}
+}
+
 static int
 affine(lua_State *L)
 {
 	DrawingWand **dw;
 	AffineMatrix am;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	if (!lua_istable(L, 2))
 		return luaL_argerror(L, 2, "table expected");
 	am.sx = getdouble(L, 2, "sx");
@@ -85,7 +221,7 @@ arc(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	DrawArc(*dw, luaL_checknumber(L, 2), luaL_checknumber(L, 3),
 	    luaL_checknumber(L, 4), luaL_checknumber(L, 5),
 	    luaL_checknumber(L, 6), luaL_checknumber(L, 7));
@@ -97,23 +233,11 @@ bezier(lua_State *L)
 {
 	DrawingWand **dw;
 	PointInfo *points;
-	unsigned long ncoord;
-	int n;
-
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
-	if (!lua_istable(L, 2))
-		return luaL_argerror(L, 2, "table expected");
-
-	ncoord = lua_gettop(L) - 1;
-	points = malloc(ncoord * sizeof(PointInfo));
-
-	for (n = 2; n < ncoord + 2; n++) {
-		points[n - 2].x = getdouble(L, n, "x");
-		points[n - 2].y = getdouble(L, n, "y");
-	}
+	unsigned long npoints;
 
-	DrawBezier(*dw, ncoord, points);
-	free(points);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
+	points = checkpoints(L, &npoints);
+	DrawBezier(*dw, npoints, points);
 	return 0;
 }
 
@@ -122,18 +246,32 @@ circle(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	DrawCircle(*dw, luaL_checknumber(L, 2), luaL_checknumber(L, 3),
 	    luaL_checknumber(L, 4), luaL_checknumber(L, 5));
 	return 0;	
 }
 
+static void
+drawcircle(DrawingWand *dw, const double *v)
+{
+	DrawCircle(dw, v[0], v[1], v[2], v[3]);
+}
+
+/* circles(buf[, colors]) with origin and perimeter point per circle */
+static int
+circles(lua_State *L)
+{
+	batch(L, 4, 0, drawcircle);
+	return 0;
+}
+
 static int
 clearException(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	lua_pushboolean(L, DrawClearException(*dw));
 	return 1;
 }
@@ -144,7 +282,7 @@ getClipPath(lua_State *L)
 	DrawingWand **dw;
 	char *clip_path;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	clip_path = DrawGetClipPath(*dw);
 	lua_pushstring(L, clip_path);
 	free(clip_path);
@@ -157,7 +295,7 @@ setClipPath(lua_State *L)
 	DrawingWand **dw;
 	char *clip_path;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	DrawSetClipPath(*dw, luaL_checkstring(L, 2));
 	return 0;
 }
@@ -174,7 +312,7 @@ getClipRule(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	lua_pushstring(L, fill_rules[DrawGetClipRule(*dw)]);
 	return 1;
 }
@@ -184,8 +322,8 @@ setClipRule(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
-	DrawSetClipRule(*dw, luaL_checkoption(L, 2, "UndefinedRule", 
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
+	DrawSetClipRule(*dw, checkoption(L, 2, "UndefinedRule", 
 	    fill_rules));
 	return 0;
 }
@@ -202,7 +340,7 @@ getClipUnits(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	lua_pushstring(L, clip_path_units[DrawGetClipUnits(*dw)]);
 	return 1;
 }
@@ -214,7 +352,7 @@ getException(lua_State *L)
 	ExceptionType severity;
 	char *text;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	text = DrawGetException(*dw, &severity);
 	lua_pushstring(L, text);
 	lua_pushinteger(L, severity);
@@ -227,8 +365,8 @@ setClipUnits(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
-	DrawSetClipUnits(*dw, luaL_checkoption(L, 2, "UserSpace",
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
+	DrawSetClipUnits(*dw, checkoption(L, 2, "UserSpace",
 	    clip_path_units));
 	return 0;
 }
@@ -238,7 +376,7 @@ clone(lua_State *L)
 {
 	DrawingWand **dw, **dw2;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	dw2 = lua_newuserdata(L, sizeof(DrawingWand *));
 	*dw2 = CloneDrawingWand(*dw);
 	luaL_setmetatable(L, DRAWING_WAND_METATABLE);
@@ -260,9 +398,9 @@ color(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	DrawColor(*dw, luaL_checknumber(L, 2), luaL_checknumber(L, 3),
-	    luaL_checkoption(L, 4, "PointMethod", paint_methods));
+	    checkoption(L, 4, "PointMethod", paint_methods));
 	return 0;
 }
 
@@ -271,17 +409,27 @@ comment(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	DrawComment(*dw, luaL_checkstring(L, 2));
 	return 0;	
 }
 
+static int
+drawTemplate(lua_State *L)
+{
+	DrawingWand **dw;
+
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
+	replaytemplate(L, 2, 3, *dw);
+	return 0;
+}
+
 static int
 ellipse(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	DrawEllipse(*dw, luaL_checknumber(L, 2), luaL_checknumber(L, 3),
 	    luaL_checknumber(L, 4), luaL_checknumber(L, 5),
 	    luaL_checknumber(L, 6), luaL_checknumber(L, 7));
@@ -293,7 +441,7 @@ destroy(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	if (*dw) {
 		DestroyDrawingWand(*dw);
 		*dw = NULL;
@@ -307,7 +455,7 @@ getFillColor(lua_State *L)
 	DrawingWand **dw;
 	PixelWand **pw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	pw = lua_newuserdata(L, sizeof(PixelWand *));
 	DrawGetFillColor(*dw, *pw);
 	luaL_setmetatable(L, PIXEL_WAND_METATABLE);
@@ -320,8 +468,8 @@ setFillColor(lua_State *L)
 	DrawingWand **dw;
 	PixelWand **pw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
-	pw = luaL_checkudata(L, 2, PIXEL_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
+	pw = checkudata(L, 2, PIXEL_WAND_METATABLE);
 	DrawSetFillColor(*dw, *pw);
 	return 0;
 }
@@ -331,7 +479,7 @@ setFillPatternURL(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	DrawSetFillPatternURL(*dw, luaL_checkstring(L, 2));
 	return 0;
 }
@@ -341,7 +489,7 @@ getFillOpacity(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	lua_pushnumber(L, DrawGetFillOpacity(*dw));
 	return 1;
 }
@@ -351,7 +499,7 @@ setFillOpacity(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	DrawSetFillOpacity(*dw, luaL_checknumber(L, 2));
 	return 0;
 }
@@ -361,7 +509,7 @@ getFillRule(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	lua_pushstring(L, fill_rules[DrawGetFillRule(*dw)]);
 	return 1;
 }
@@ -371,8 +519,8 @@ setFillRule(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
-	DrawSetFillRule(*dw, luaL_checkoption(L, 2, "UndefinedRule", 
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
+	DrawSetFillRule(*dw, checkoption(L, 2, "UndefinedRule", 
 	    fill_rules));
 	return 0;
 }
@@ -382,7 +530,7 @@ getFont(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	lua_pushstring(L, DrawGetFont(*dw));
 	return 1;
 }
@@ -392,7 +540,7 @@ setFont(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	DrawSetFont(*dw, luaL_checkstring(L, 2));
 	return 0;
 }
@@ -402,7 +550,7 @@ getFontFamily(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	lua_pushstring(L, DrawGetFontFamily(*dw));
 	return 1;
 }
@@ -412,7 +560,7 @@ setFontFamily(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	DrawSetFontFamily(*dw, luaL_checkstring(L, 2));
 	return 0;
 }
@@ -422,7 +570,7 @@ getFontSize(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	lua_pushnumber(L, DrawGetFontSize(*dw));
 	return 1;
 }
@@ -432,7 +580,7 @@ setFontSize(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	DrawSetFontSize(*dw, luaL_checknumber(L, 2));
 	return 0;
 }
@@ -456,7 +604,7 @@ getFontStretch(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	lua_pushstring(L, stretch_types[DrawGetFontStretch(*dw)]);
 	return 1;
 }
@@ -466,8 +614,8 @@ setFontStretch(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
-	DrawSetFontStretch(*dw, luaL_checkoption(L, 2, "NormalStretch", 
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
+	DrawSetFontStretch(*dw, checkoption(L, 2, "NormalStretch", 
 	    stretch_types));
 	return 0;
 }
@@ -485,7 +633,7 @@ getFontStyle(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	lua_pushstring(L, styles[DrawGetFontStyle(*dw)]);
 	return 1;
 }
@@ -495,8 +643,8 @@ setFontStyle(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
-	DrawSetFontStyle(*dw, luaL_checkoption(L, 2, "AnyStyle", styles));
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
+	DrawSetFontStyle(*dw, checkoption(L, 2, "AnyStyle", styles));
 	return 0;
 }
 
@@ -505,7 +653,7 @@ getFontWeight(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	lua_pushinteger(L, DrawGetFontWeight(*dw));
 	return 1;
 }
@@ -515,7 +663,7 @@ setFontWeight(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	DrawSetFontWeight(*dw, luaL_checkinteger(L, 2));
 	return 0;
 }
@@ -540,7 +688,7 @@ getGravity(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	lua_pushstring(L, gravity[DrawGetGravity(*dw)]);
 	return 1;
 }
@@ -550,8 +698,8 @@ setGravity(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
-	DrawSetGravity(*dw, luaL_checkoption(L, 2, "ForgetGravity", gravity));
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
+	DrawSetGravity(*dw, checkoption(L, 2, "ForgetGravity", gravity));
 	return 0;
 }
 
@@ -560,20 +708,44 @@ line(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	DrawLine(*dw, luaL_checknumber(L, 2), luaL_checknumber(L, 3),
 	    luaL_checknumber(L, 4), luaL_checknumber(L, 5));
 	return 0;
 }
 
+static void
+drawline(DrawingWand *dw, const double *v)
+{
+	DrawLine(dw, v[0], v[1], v[2], v[3]);
+}
+
+/* lines(buf[, colors]), colors set the stroke color */
+static int
+lines(lua_State *L)
+{
+	batch(L, 4, 1, drawline);
+	return 0;
+}
+
+static int
+loadMVG(lua_State *L)
+{
+	DrawingWand **dw;
+
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
+	loadmvg(L, *dw, luaL_checkstring(L, 2));
+	return 0;
+}
+
 static int
 matte(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	DrawMatte(*dw, luaL_checknumber(L, 2), luaL_checknumber(L, 3),
-	    luaL_checkoption(L, 4, "PointMethod", paint_methods));
+	    checkoption(L, 4, "PointMethod", paint_methods));
 	return 0;
 }
 
@@ -582,7 +754,7 @@ pathClose(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	DrawPathClose(*dw);
 	return 0;
 }
@@ -592,7 +764,7 @@ pathCurveToAbsolute(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	DrawPathCurveToAbsolute(*dw, luaL_checknumber(L, 2),
 	    luaL_checknumber(L, 3), luaL_checknumber(L, 4),
 	    luaL_checknumber(L, 5), luaL_checknumber(L, 6),
@@ -605,7 +777,7 @@ pathCurveToRelative(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	DrawPathCurveToRelative(*dw, luaL_checknumber(L, 2),
 	    luaL_checknumber(L, 3), luaL_checknumber(L, 4),
 	    luaL_checknumber(L, 5), luaL_checknumber(L, 6),
@@ -618,7 +790,7 @@ pathCurveToQuadraticBezierAbsolute(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	DrawPathCurveToQuadraticBezierAbsolute(*dw, luaL_checknumber(L, 2),
 	    luaL_checknumber(L, 3), luaL_checknumber(L, 4),
 	    luaL_checknumber(L, 5));
@@ -630,7 +802,7 @@ pathCurveToQuadraticBezierRelative(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	DrawPathCurveToQuadraticBezierRelative(*dw, luaL_checknumber(L, 2),
 	    luaL_checknumber(L, 3), luaL_checknumber(L, 4),
 	    luaL_checknumber(L, 5));
@@ -642,7 +814,7 @@ pathCurveToQuadraticBezierSmoothAbsolute(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	DrawPathCurveToQuadraticBezierSmoothAbsolute(*dw,
 	    luaL_checknumber(L, 2), luaL_checknumber(L, 3));
 	return 0;
@@ -653,7 +825,7 @@ pathCurveToQuadraticBezierSmoothRelative(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	DrawPathCurveToQuadraticBezierSmoothRelative(*dw,
 	    luaL_checknumber(L, 2), luaL_checknumber(L, 3));
 	return 0;
@@ -664,7 +836,7 @@ pathCurveToSmoothAbsolute(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	DrawPathCurveToSmoothAbsolute(*dw,
 	    luaL_checknumber(L, 2), luaL_checknumber(L, 3),
 	    luaL_checknumber(L, 4), luaL_checknumber(L, 5));
@@ -676,7 +848,7 @@ pathCurveToSmoothRelative(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	DrawPathCurveToSmoothRelative(*dw,
 	    luaL_checknumber(L, 2), luaL_checknumber(L, 3),
 	    luaL_checknumber(L, 4), luaL_checknumber(L, 5));
@@ -688,7 +860,7 @@ pathEllipticArcAbsolute(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	DrawPathEllipticArcAbsolute(*dw,
 	    luaL_checknumber(L, 2), luaL_checknumber(L, 3),
 	    luaL_checknumber(L, 4), luaL_checkinteger(L, 5),
@@ -702,7 +874,7 @@ pathEllipticArcRelative(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	DrawPathEllipticArcRelative(*dw,
 	    luaL_checknumber(L, 2), luaL_checknumber(L, 3),
 	    luaL_checknumber(L, 4), luaL_checkinteger(L, 5),
@@ -716,7 +888,7 @@ pathFinish(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	DrawPathFinish(*dw);
 	return 0;
 }
@@ -726,7 +898,7 @@ pathLineToAbsolute(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	DrawPathLineToAbsolute(*dw,
 	    luaL_checknumber(L, 2), luaL_checknumber(L, 3));
 	return 0;
@@ -737,7 +909,7 @@ pathLineToRelative(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	DrawPathLineToRelative(*dw,
 	    luaL_checknumber(L, 2), luaL_checknumber(L, 3));
 	return 0;
@@ -748,7 +920,7 @@ pathLineToHorizontalAbsolute(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	DrawPathLineToHorizontalAbsolute(*dw, luaL_checknumber(L, 2));
 	return 0;
 }
@@ -758,7 +930,7 @@ pathLineToHorizontalRelative(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	DrawPathLineToHorizontalRelative(*dw, luaL_checknumber(L, 2));
 	return 0;
 }
@@ -768,7 +940,7 @@ pathLineToVerticalAbsolute(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	DrawPathLineToVerticalAbsolute(*dw, luaL_checknumber(L, 2));
 	return 0;
 }
@@ -778,7 +950,7 @@ pathLineToVerticalRelative(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	DrawPathLineToVerticalRelative(*dw, luaL_checknumber(L, 2));
 	return 0;
 }
@@ -788,7 +960,7 @@ pathMoveToAbsolute(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	DrawPathMoveToAbsolute(*dw, luaL_checknumber(L, 2),
 	    luaL_checknumber(L, 3));
 	return 0;
@@ -799,7 +971,7 @@ pathMoveToRelative(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	DrawPathMoveToRelative(*dw, luaL_checknumber(L, 2),
 	    luaL_checknumber(L, 3));
 	return 0;
@@ -810,7 +982,7 @@ pathStart(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	DrawPathStart(*dw);
 	return 0;
 }
@@ -820,33 +992,34 @@ point(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	DrawPoint(*dw, luaL_checknumber(L, 2), luaL_checknumber(L, 3));
 	return 0;
 }
 
+static void
+drawpoint(DrawingWand *dw, const double *v)
+{
+	DrawPoint(dw, v[0], v[1]);
+}
+
+static int
+points(lua_State *L)
+{
+	batch(L, 2, 0, drawpoint);
+	return 0;
+}
+
 static int
 polygon(lua_State *L)
 {
 	DrawingWand **dw;
 	PointInfo *points;
-	unsigned long ncoord;
-	int n;
+	unsigned long npoints;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
-	if (!lua_istable(L, 2))
-		return luaL_argerror(L, 2, "table expected");
-
-	ncoord = lua_gettop(L) - 1;
-	points = malloc(ncoord * sizeof(PointInfo));
-
-	for (n = 2; n < ncoord + 2; n++) {
-		points[n - 2].x = getdouble(L, n, "x");
-		points[n - 2].y = getdouble(L, n, "y");
-	}
-
-	DrawPolygon(*dw, ncoord, points);
-	free(points);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
+	points = checkpoints(L, &npoints);
+	DrawPolygon(*dw, npoints, points);
 	return 0;
 }
 
@@ -855,23 +1028,11 @@ polyline(lua_State *L)
 {
 	DrawingWand **dw;
 	PointInfo *points;
-	unsigned long ncoord;
-	int n;
+	unsigned long npoints;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
-	if (!lua_istable(L, 2))
-		return luaL_argerror(L, 2, "table expected");
-
-	ncoord = lua_gettop(L) - 1;
-	points = malloc(ncoord * sizeof(PointInfo));
-
-	for (n = 2; n < ncoord + 2; n++) {
-		points[n - 2].x = getdouble(L, n, "x");
-		points[n - 2].y = getdouble(L, n, "y");
-	}
-
-	DrawPolyline(*dw, ncoord, points);
-	free(points);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
+	points = checkpoints(L, &npoints);
+	DrawPolyline(*dw, npoints, points);
 	return 0;
 }
 
@@ -880,7 +1041,7 @@ popClipPath(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	DrawPopClipPath(*dw);
 	return 0;
 }
@@ -890,7 +1051,7 @@ popDefs(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	DrawPopDefs(*dw);
 	return 0;
 }
@@ -900,7 +1061,7 @@ popGraphicContext(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	DrawPopGraphicContext(*dw);
 	return 0;
 }
@@ -910,7 +1071,7 @@ popPattern(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	DrawPopPattern(*dw);
 	return 0;
 }
@@ -920,7 +1081,7 @@ pushClipPath(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	DrawPushClipPath(*dw, luaL_checkstring(L, 2));
 	return 0;
 }
@@ -930,7 +1091,7 @@ pushDefs(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	DrawPushDefs(*dw);
 	return 0;
 }
@@ -940,7 +1101,7 @@ pushGraphicContext(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	DrawPushGraphicContext(*dw);
 	return 0;
 }
@@ -950,7 +1111,7 @@ pushPattern(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	DrawPushPattern(*dw, luaL_checkstring(L, 2), luaL_checknumber(L, 3),
 	    luaL_checknumber(L, 4), luaL_checknumber(L, 5),
 	    luaL_checknumber(L, 6));
@@ -962,18 +1123,32 @@ rectangle(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	DrawRectangle(*dw, luaL_checknumber(L, 2), luaL_checknumber(L, 3),
 	    luaL_checknumber(L, 4), luaL_checknumber(L, 5));
 	return 0;
 }
 
+static void
+drawrectangle(DrawingWand *dw, const double *v)
+{
+	DrawRectangle(dw, v[0], v[1], v[2], v[3]);
+}
+
+/* rectangles(buf[, colors]) with upper left and lower right corners */
+static int
+rectangles(lua_State *L)
+{
+	batch(L, 4, 0, drawrectangle);
+	return 0;
+}
+
 static int
 rotate(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	DrawRotate(*dw, luaL_checknumber(L, 2));
 	return 0;
 }
@@ -983,7 +1158,7 @@ roundRectangle(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	DrawRoundRectangle(*dw, luaL_checknumber(L, 2), luaL_checknumber(L, 3),
 	    luaL_checknumber(L, 4), luaL_checknumber(L, 5),
 	    luaL_checknumber(L, 6), luaL_checknumber(L, 7));
@@ -995,7 +1170,7 @@ scale(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	DrawScale(*dw, luaL_checknumber(L, 2), luaL_checknumber(L, 3));
 	return 0;
 }
@@ -1005,7 +1180,7 @@ skewX(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	DrawSkewX(*dw, luaL_checknumber(L, 2));
 	return 0;
 }
@@ -1015,7 +1190,7 @@ skewY(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	DrawSkewY(*dw, luaL_checknumber(L, 2));
 	return 0;
 }
@@ -1026,8 +1201,8 @@ setStrokeColor(lua_State *L)
 	DrawingWand **dw;
 	PixelWand **pw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
-	pw = luaL_checkudata(L, 2, PIXEL_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
+	pw = checkudata(L, 2, PIXEL_WAND_METATABLE);
 	DrawSetStrokeColor(*dw, *pw);
 	return 0;
 }
@@ -1045,18 +1220,30 @@ setTextDecoration(lua_State *L)
 {
 	DrawingWand **dw;
 
-	dw = luaL_checkudata(L, 1, DRAWING_WAND_METATABLE);
+	dw = checkudata(L, 1, DRAWING_WAND_METATABLE);
 	DrawSetTextDecoration(*dw,
-	    luaL_checkoption(L, 2, "NoDecoration", decorations));
+	    checkoption(L, 2, "NoDecoration", decorations));
 	return 0;
 }
 
+const char *const *const drawing_options[] = {
+	clip_path_units,
+	decorations,
+	fill_rules,
+	gravity,
+	paint_methods,
+	stretch_types,
+	styles,
+	NULL
+};
+
 struct luaL_Reg drawing_wand_methods[] = {
 	{ "annotation",		annotation },
 	{ "affine",		affine },
 	{ "arc",		arc },
 	{ "bezier",		bezier },
 	{ "circle",		circle },
+	{ "circles",		circles },
 	{ "clearException",	clearException },
 	{ "getClipPath",	getClipPath },
 	{ "setClipPath",	setClipPath },
@@ -1068,6 +1255,7 @@ struct luaL_Reg drawing_wand_methods[] = {
 	{ "color",		color },
 	{ "comment",		comment },
 	{ "destroy",		destroy },
+	{ "drawTemplate",	drawTemplate },
 	{ "ellipse",		ellipse },
 	{ "getFillColor",	getFillColor },
 	{ "setFillColor",	setFillColor },
@@ -1090,6 +1278,8 @@ struct luaL_Reg drawing_wand_methods[] = {
 	{ "getGravity",		getGravity },
 	{ "setGravity",		setGravity },
 	{ "line",		line },
+	{ "lines",		lines },
+	{ "loadMVG",		loadMVG },
 	{ "matte",		matte },
 	{ "pathClose",		pathClose },
 	{ "pathCurveToAbsolute",
@@ -1126,6 +1316,7 @@ struct luaL_Reg drawing_wand_methods[] = {
 	{ "pathMoveToRelative",	pathMoveToRelative },
 	{ "pathStart",		pathStart },
 	{ "point",		point },
+	{ "points",		points },
 	{ "polygon",		polygon },
 	{ "polyline",		polyline },
 	{ "popClipPath",	popClipPath },
@@ -1137,6 +1328,7 @@ struct luaL_Reg drawing_wand_methods[] = {
 	{ "pushGraphicContext",	pushGraphicContext },
 	{ "pushPattern",	pushPattern },
 	{ "rectangle",		rectangle },
+	{ "rectangles",		rectangles },
 	{ "rotate",		rotate },
 	{ "roundRectangle",	roundRectangle },
 	{ "scale",		scale },
@@ -0,0 +1,375 @@
+/*
+ * Copyright (c) 2016, 2017 Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of Micro Systems Marc Balmer nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Encoder profiles for GraphicsMagick for Lua */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+#include <wand/magick_wand.h>
+
+#include "luagraphicsmagick.h"
+
+static const char *const fields[] = {
+	"format",
+	"quality",
+	"subsampling",
+	"interlace",
+	"pngLevel",
+	"pngFilter",
+	"strip",
+	"options",
+	NULL
+};
+
+enum {
+	FORMAT,
+	QUALITY,
+	SUBSAMPLING,
+	INTERLACE,
+	PNGLEVEL,
+	PNGFILTER,
+	STRIP,
+	OPTIONS
+};
+
+/* The PNG coder takes the filter from the last digit of the quality */
+static const char *const pngfilters[] = {
+	"none",
+	"sub",
+	"up",
+	"average",
+	"paeth",
+	"adaptive",
+	NULL
+};
+
+static const struct {
+	const char	*name;
+	double		 h;
+	double		 v;
+} samplings[] = {
+	{ "4:4:4",	1.0,	1.0 },
+	{ "4:2:2",	2.0,	1.0 },
+	{ "4:2:0",	2.0,	2.0 },
+	{ "4:1:1",	4.0,	1.0 }
+};
+
+static lua_Integer
+intfield(lua_State *L, const char *name, lua_Integer min, lua_Integer max)
+{
+	lua_Integer v;
+	int isnum;
+
+	v = lua_tointegerx(L, -1, &isnum);
+	if (!isnum || v < min || v > max)
+		luaL_error(L, "%s must be an integer from %d to %d", name,
+		    (int)min, (int)max);
+	return v;
+}
+
+static const char *
+strfield(lua_State *L, const char *name)
+{
+	if (lua_type(L, -1) != LUA_TSTRING)
+		luaL_error(L, "%s must be a string", name);
+	return lua_tostring(L, -1);
+}
+
+static int
+optionfield(lua_State *L, const char *const list[], const char *name)
+{
+	const char *s;
+	int n;
+
+	s = strfield(L, name);
+	for (n = 0; list[n] != NULL; n++)
+		if (!strcmp(list[n], s))
+			return n;
+	return luaL_error(L, "invalid %s '%s'", name, s);
+}
+
+static void
+subsampling(lua_State *L, struct encoder_profile *p)
+{
+	const char *s;
+	size_t n;
+
+	s = strfield(L, "subsampling");
+	for (n = 0; n < sizeof samplings / sizeof samplings[0]; n++)
+		if (!strcmp(samplings[n].name, s)) {
+			p->factors[0] = samplings[n].h;
+			p->factors[1] = samplings[n].v;
+			p->nfactors = 2;
+			return;
+		}
+	if (sscanf(s, "%lfx%lf", &p->factors[0], &p->factors[1]) != 2 ||
+	    p->factors[0] < 1.0 || p->factors[1] < 1.0)
+		luaL_error(L, "invalid subsampling '%s'", s);
+	p->nfactors = 2;
+}
+
+/*
+ * Returns the option value at the top of the stack as a string.  Numbers
+ * are converted in place, which is safe as only the value is converted,
+ * never the key lua_next() needs.
+ */
+static const char *
+optionvalue(lua_State *L, const char *key, size_t *len)
+{
+	switch (lua_type(L, -1)) {
+	case LUA_TBOOLEAN:
+		*len = lua_toboolean(L, -1) ? 4 : 5;
+		return lua_toboolean(L, -1) ? "true" : "false";
+	case LUA_TNUMBER:
+	case LUA_TSTRING:
+		return lua_tolstring(L, -1, len);
+	default:
+		luaL_error(L, "option '%s' must be a string", key);
+		return NULL;
+	}
+}
+
+/* Returns the size needed to store all format specific options */
+static size_t
+optionsize(lua_State *L, int t, size_t *noptions)
+{
+	const char *key;
+	size_t size = 0, len;
+
+	for (lua_pushnil(L); lua_next(L, t); lua_pop(L, 1)) {
+		if (lua_type(L, -2) != LUA_TSTRING)
+			luaL_error(L, "option keys must be strings");
+		key = lua_tolstring(L, -2, &len);
+		if (strchr(key, ':') == NULL || len != strlen(key))
+			luaL_error(L, "option '%s' is not format:key", key);
+		size += len + 1;
+		optionvalue(L, key, &len);
+		size += len + 1;
+		(*noptions)++;
+	}
+	return size;
+}
+
+/* Store options as format, key and value, each NUL terminated */
+static void
+copyoptions(lua_State *L, int t, char *s)
+{
+	const char *key, *value;
+	size_t len;
+
+	for (lua_pushnil(L); lua_next(L, t); lua_pop(L, 1)) {
+		key = lua_tolstring(L, -2, &len);
+		memcpy(s, key, len + 1);
+		*strchr(s, ':') = '\0';
+		s += len + 1;
+		value = optionvalue(L, key, &len);
+		memcpy(s, value, len + 1);
+		s += len + 1;
+	}
+}
+
+/* Parse the option table at index t and push a new profile */
+static struct encoder_profile *
+newprofile(lua_State *L, int t)
+{
+	struct encoder_profile prof, *p;
+	lua_Integer level = -1, filter = -1;
+	size_t size = 0;
+	int field, options = 0;
+
+	memset(&prof, 0, sizeof prof);
+	prof.quality = prof.pngquality = prof.interlace = -1;
+
+	for (lua_pushnil(L); lua_next(L, t); lua_pop(L, 1)) {
+		if (lua_type(L, -2) != LUA_TSTRING)
+			luaL_error(L, "profile keys must be strings");
+		lua_pushvalue(L, -2);
+		field = optionfield(L, fields, "profile key");
+		lua_pop(L, 1);
+		switch (field) {
+		case FORMAT:
+			if (strlen(strfield(L, "format")) >=
+			    sizeof prof.format)
+				luaL_error(L, "format name too long");
+			strcpy(prof.format, lua_tostring(L, -1));
+			break;
+		case QUALITY:
+			prof.quality = intfield(L, "quality", 0, 100);
+			break;
+		case SUBSAMPLING:
+			subsampling(L, &prof);
+			break;
+		case INTERLACE:
+			prof.interlace = lua_toboolean(L, -1) ?
+			    LineInterlace : NoInterlace;
+			break;
+		case PNGLEVEL:
+			level = intfield(L, "pngLevel", 0, 9);
+			break;
+		case PNGFILTER:
+			filter = optionfield(L, pngfilters, "pngFilter");
+			break;
+		case STRIP:
+			prof.strip = lua_toboolean(L, -1);
+			break;
+		case OPTIONS:
+			if (!lua_istable(L, -1))
+				luaL_error(L, "options must be a table");
+			size = optionsize(L, lua_gettop(L), &prof.noptions);
+			options = 1;
+			break;
+		}
+	}
+
+	/* GraphicsMagick's default PNG quality 75 is level 7, adaptive */
+	if (level != -1 || filter != -1)
+		prof.pngquality = (level != -1 ? level : 7) * 10 +
+		    (filter != -1 ? filter : 5);
+
+	p = lua_newuserdata(L, sizeof(struct encoder_profile) + size);
+	*p = prof;
+	luaL_setmetatable(L, ENCODER_PROFILE_METATABLE);
+
+	if (options) {
+		lua_getfield(L, t, "options");
+		copyoptions(L, lua_gettop(L), p->options);
+		lua_pop(L, 1);
+	}
+	return p;
+}
+
+/*
+ * Returns the profile at index idx.  A table of options is parsed into
+ * a new profile, which is left on the stack.
+ */
+struct encoder_profile *
+checkprofile(lua_State *L, int idx)
+{
+	struct encoder_profile *p;
+
+	idx = lua_absindex(L, idx);
+	if (lua_istable(L, idx))
+		return newprofile(L, idx);
+	p = luaL_testudata(L, idx, ENCODER_PROFILE_METATABLE);
+	if (p == NULL)
+		luaL_error(L, "encoder profile or option table expected");
+	return p;
+}
+
+/*
+ * graphicsmagick.newEncoderProfile(options) parses a table of encoder
+ * settings once, the profile can then be passed to any number of
+ * writeImage(), writeImageBlob() and encodeMany() calls.
+ */
+static int
+newEncoderProfile(lua_State *L)
+{
+	luaL_checktype(L, 1, LUA_TTABLE);
+	newprofile(L, 1);
+	return 1;
+}
+
+/*
+ * Apply a profile to a wand before writing it.  Quality, interlace,
+ * sampling factors and options are wand settings, format and stripping
+ * are applied to every image.
+ */
+void
+applyprofile(MagickWand *wand, const struct encoder_profile *p)
+{
+	const char *prefix, *key, *value;
+	char *magick;
+	unsigned long n, nimages;
+	long index, quality;
+
+	nimages = MagickGetNumberImages(wand);
+	if (nimages > 0 && (p->format[0] || p->strip)) {
+		index = MagickGetImageIndex(wand);
+		for (n = 0; n < nimages; n++) {
+			MagickSetImageIndex(wand, n);
+			if (p->format[0])
+				MagickSetImageFormat(wand, p->format);
+			if (p->strip)
+				MagickStripImage(wand);
+		}
+		MagickSetImageIndex(wand, index);
+	}
+
+	quality = p->quality;
+	if (p->pngquality != -1 && nimages > 0) {
+		magick = MagickGetImageFormat(wand);
+		if (magick != NULL) {
+			if (!strncasecmp(magick, "PNG", 3))
+				quality = p->pngquality;
+			free(magick);
+		}
+	}
+	if (quality != -1)
+		MagickSetCompressionQuality(wand, quality);
+	if (p->interlace != -1)
+		MagickSetInterlaceScheme(wand, p->interlace);
+	if (p->nfactors)
+		MagickSetSamplingFactors(wand, p->nfactors, p->factors);
+
+	prefix = p->options;
+	for (n = 0; n < p->noptions; n++) {
+		key = prefix + strlen(prefix) + 1;
+		value = key + strlen(key) + 1;
+		MagickSetImageOption(wand, prefix, key, value);
+		prefix = value + strlen(value) + 1;
+	}
+}
+
+static int
+format(lua_State *L)
+{
+	struct encoder_profile *p;
+
+	p = checkudata(L, 1, ENCODER_PROFILE_METATABLE);
+	if (p->format[0])
+		lua_pushstring(L, p->format);
+	else
+		lua_pushnil(L);
+	return 1;
+}
+
+struct luaL_Reg encoder_profile_methods[] = {
+	{ "format",		format },
+	{ NULL, NULL }
+};
+
+struct luaL_Reg encoder_functions[] = {
+	{ "newEncoderProfile",	newEncoderProfile },
+	{ NULL, NULL }
+};
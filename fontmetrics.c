@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2016, 2017 Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of Micro Systems Marc Balmer nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/* Font metrics cache for GraphicsMagick for Lua */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+#include <wand/magick_wand.h>
+
+#include "luagraphicsmagick.h"
+
+#define NSLOTS		4096
+
+/*
+ * The cache is direct mapped, a new measurement simply replaces whatever
+ * was measured before in its slot.  Keys are the font attributes, the
+ * stroke width and the text encoding of the DrawingWand, the resolution
+ * of the current image and the text.
+ */
+struct metrics_slot {
+	char	*key;
+	size_t	 keylen;
+	double	 metrics[NMETRICS];
+};
+
+static pthread_mutex_t metrics_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct metrics_slot slots[NSLOTS];
+static uint64_t metrics_hits, metrics_misses;
+
+#define KEYFMT	"%s%c%s%c%s%c%g %lu %d %d %g %g %g%c"
+#define KEYARGS	font ? font : "", 0, family ? family : "", 0, \
+	encoding ? encoding : "", 0, DrawGetFontSize(dw), \
+	DrawGetFontWeight(dw), (int)DrawGetFontStyle(dw), \
+	(int)DrawGetFontStretch(dw), DrawGetStrokeWidth(dw), x, y, 0
+
+static char *
+metricskey(MagickWand *mw, DrawingWand *dw, const char *text,
+    size_t *keylen)
+{
+	char *font, *family, *encoding, *key;
+	double x = 0, y = 0;
+	size_t len;
+	int n;
+
+	if (MagickGetNumberImages(mw) > 0)
+		MagickGetImageResolution(mw, &x, &y);
+	font = DrawGetFont(dw);
+	family = DrawGetFontFamily(dw);
+	encoding = DrawGetTextEncoding(dw);
+	len = strlen(text);
+	n = snprintf(NULL, 0, KEYFMT, KEYARGS);
+	if ((key = malloc(n + len + 1)) != NULL) {
+		snprintf(key, n + 1, KEYFMT, KEYARGS);
+		memcpy(key + n, text, len + 1);
+		*keylen = n + len;
+	}
+	MagickRelinquishMemory(font);
+	MagickRelinquishMemory(family);
+	MagickRelinquishMemory(encoding);
+	return key;
+}
+
+/* Measure a single line of text, returns 0 on success */
+int
+fontmetrics(MagickWand *mw, DrawingWand *dw, const char *text,
+    double metrics[NMETRICS])
+{
+	struct metrics_slot *slot;
+	double *m;
+	uint64_t h[2] = { 0, 0 };
+	char *key;
+	size_t keylen;
+
+	if ((key = metricskey(mw, dw, text, &keylen)) == NULL)
+		return -1;
+	hashbytes((const unsigned char *)key, keylen, h);
+	slot = &slots[h[0] % NSLOTS];
+
+	pthread_mutex_lock(&metrics_mtx);
+	if (slot->key != NULL && slot->keylen == keylen &&
+	    !memcmp(slot->key, key, keylen)) {
+		memcpy(metrics, slot->metrics, sizeof slot->metrics);
+		metrics_hits++;
+		pthread_mutex_unlock(&metrics_mtx);
+		free(key);
+		return 0;
+	}
+	metrics_misses++;
+	pthread_mutex_unlock(&metrics_mtx);
+
+	if ((m = MagickQueryFontMetrics(mw, dw, text)) == NULL) {
+		free(key);
+		return -1;
+	}
+	memcpy(metrics, m, NMETRICS * sizeof(double));
+	MagickRelinquishMemory(m);
+
+	pthread_mutex_lock(&metrics_mtx);
+	free(slot->key);
+	slot->key = key;
+	slot->keylen = keylen;
+	memcpy(slot->metrics, metrics, sizeof slot->metrics);
+	pthread_mutex_unlock(&metrics_mtx);
+	return 0;
+}
+
+static int
+clearFontMetricsCache(lua_State *L)
+{
+	int n;
+
+	pthread_mutex_lock(&metrics_mtx);
+	for (n = 0; n < NSLOTS; n++) {
+		free(slots[n].key);
+		slots[n].key = NULL;
+	}
+	pthread_mutex_unlock(&metrics_mtx);
+	return 0;
+}
+
+static int
+fontMetricsCacheStats(lua_State *L)
+{
+	lua_Integer hits, misses;
+
+	pthread_mutex_lock(&metrics_mtx);
+	hits = metrics_hits;
+	misses = metrics_misses;
+	pthread_mutex_unlock(&metrics_mtx);
+
+	lua_createtable(L, 0, 2);
+	lua_pushinteger(L, hits);
+	lua_setfield(L, -2, "hits");
+	lua_pushinteger(L, misses);
+	lua_setfield(L, -2, "misses");
+	return 1;
+}
+
+struct luaL_Reg fontmetrics_functions[] = {
+	{ "clearFontMetricsCache",	clearFontMetricsCache },
+	{ "fontMetricsCacheStats",	fontMetricsCacheStats },
+	{ NULL, NULL }
+};
@@ -0,0 +1,369 @@
+/*
+ * Copyright (c) 2016, 2017 Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of Micro Systems Marc Balmer nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Decoded image cache for GraphicsMagick for Lua */
+
+#include <sys/stat.h>
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+#include <magick/api.h>
+#include <wand/magick_wand.h>
+
+#include "luagraphicsmagick.h"
+
+#define NBUCKETS	1024
+
+/*
+ * Decoded images are kept in private MagickWands.  GraphicsMagick
+ * reference counts pixel caches, so handing out a copy of a cached image
+ * with MagickAddImage() does not copy any pixels until one of the copies
+ * is modified.  Each entry also keeps a copy of the encoded bytes, or of
+ * the path, which is compared on every hit, so that a hash collision can
+ * never return another image.
+ */
+struct image_entry {
+	struct image_key	 key;
+	MagickWand		*wand;
+	size_t			 size;
+	struct image_entry	*hnext;		/* hash chain */
+	struct image_entry	*prev;		/* LRU list, head is newest */
+	struct image_entry	*next;
+};
+
+static pthread_mutex_t cache_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct image_entry *buckets[NBUCKETS];
+static struct image_entry *lru_head, *lru_tail;
+static size_t cache_size, cache_limit;
+static uint64_t cache_hits, cache_misses, cache_evictions;
+
+#define ROTL(x, r)	(((x) << (r)) | ((x) >> (64 - (r))))
+
+void
+hashbytes(const unsigned char *p, size_t len, uint64_t h[2])
+{
+	uint64_t a = 0x9e3779b97f4a7c15ULL ^ len;
+	uint64_t b = 0xc2b2ae3d27d4eb4fULL + len;
+	uint64_t w;
+
+	for (; len >= 8; p += 8, len -= 8) {
+		memcpy(&w, p, 8);
+		a = ROTL(a ^ w, 29) * 0xbf58476d1ce4e5b9ULL;
+		b = ROTL(b + w, 31) * 0x94d049bb133111ebULL;
+	}
+	w = 0;
+	memcpy(&w, p, len);
+	a = ROTL(a ^ w, 29) * 0xbf58476d1ce4e5b9ULL;
+	b = ROTL(b + w, 31) * 0x94d049bb133111ebULL;
+
+	a ^= a >> 31;
+	b ^= b >> 29;
+	h[0] ^= a * 0xff51afd7ed558ccdULL;
+	h[1] ^= b * 0xc4ceb9fe1a85ec53ULL;
+}
+
+static void
+sizehint(MagickWand *wand, struct image_key *key)
+{
+	unsigned long columns = 0, rows = 0;
+
+	MagickGetSize(wand, &columns, &rows);
+	key->columns = columns;
+	key->rows = rows;
+}
+
+void
+blobkey(MagickWand *wand, const void *blob, size_t len,
+    struct image_key *key)
+{
+	memset(key, 0, sizeof(struct image_key));
+	hashbytes(blob, len, key->hash);
+	key->length = len;
+	key->data = blob;
+	key->datalen = len;
+	sizehint(wand, key);
+}
+
+int
+filekey(MagickWand *wand, const char *path, struct image_key *key)
+{
+	struct stat sb;
+
+	if (stat(path, &sb) == -1 || !S_ISREG(sb.st_mode))
+		return -1;
+
+	memset(key, 0, sizeof(struct image_key));
+	key->hash[0] = sb.st_ino;
+	key->hash[1] = sb.st_mtime;
+	hashbytes((const unsigned char *)path, strlen(path), key->hash);
+	key->length = sb.st_size;
+	key->dev = sb.st_dev;
+	key->ino = sb.st_ino;
+	key->mtime[0] = sb.st_mtim.tv_sec;
+	key->mtime[1] = sb.st_mtim.tv_nsec;
+	key->ctime[0] = sb.st_ctim.tv_sec;
+	key->ctime[1] = sb.st_ctim.tv_nsec;
+	key->file = 1;
+	key->data = path;
+	key->datalen = strlen(path);
+	sizehint(wand, key);
+	return 0;
+}
+
+static unsigned int
+bucket(const struct image_key *key)
+{
+	return (key->hash[0] ^ key->hash[1] ^ key->length) % NBUCKETS;
+}
+
+static struct image_entry *
+lookup(const struct image_key *key)
+{
+	struct image_entry *e;
+
+	for (e = buckets[bucket(key)]; e != NULL; e = e->hnext)
+		if (!memcmp(&e->key, key, offsetof(struct image_key, data)) &&
+		    e->key.datalen == key->datalen &&
+		    !memcmp(e->key.data, key->data, key->datalen))
+			break;
+	return e;
+}
+
+/* Keys are only worth computing while the cache is enabled */
+int
+imagecacheenabled(void)
+{
+	size_t limit;
+
+	pthread_mutex_lock(&cache_mtx);
+	limit = cache_limit;
+	pthread_mutex_unlock(&cache_mtx);
+	return limit != 0;
+}
+
+static void
+unlink_lru(struct image_entry *e)
+{
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		lru_head = e->next;
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		lru_tail = e->prev;
+	e->prev = e->next = NULL;
+}
+
+static void
+push_lru(struct image_entry *e)
+{
+	e->prev = NULL;
+	e->next = lru_head;
+	if (lru_head)
+		lru_head->prev = e;
+	lru_head = e;
+	if (lru_tail == NULL)
+		lru_tail = e;
+}
+
+static void
+evict(struct image_entry *e)
+{
+	struct image_entry **p;
+
+	for (p = &buckets[bucket(&e->key)]; *p != e; p = &(*p)->hnext)
+		;
+	*p = e->hnext;
+	unlink_lru(e);
+	cache_size -= e->size;
+	cache_evictions++;
+	DestroyMagickWand(e->wand);
+	free(e);
+}
+
+static void
+trim(void)
+{
+	while (lru_tail != NULL && cache_size > cache_limit)
+		evict(lru_tail);
+}
+
+/* Append the cached images for key to wand, returns 0 on a miss */
+int
+imagecacheget(MagickWand *wand, const struct image_key *key)
+{
+	struct image_entry *e;
+	int hit = 0;
+
+	pthread_mutex_lock(&cache_mtx);
+	if (cache_limit == 0) {
+		pthread_mutex_unlock(&cache_mtx);
+		return 0;
+	}
+	e = lookup(key);
+	if (e != NULL && MagickAddImage(wand, e->wand)) {
+		unlink_lru(e);
+		push_lru(e);
+		cache_hits++;
+		hit = 1;
+	} else
+		cache_misses++;
+	pthread_mutex_unlock(&cache_mtx);
+	return hit;
+}
+
+/* Cache the images wand received after its first 'first' images */
+void
+imagecacheput(MagickWand *wand, unsigned long first,
+    const struct image_key *key)
+{
+	struct image_entry *e;
+	MagickWand *images, *image;
+	unsigned long n, nimages;
+	size_t size = 0;
+	long index;
+
+	pthread_mutex_lock(&cache_mtx);
+	n = cache_limit;
+	pthread_mutex_unlock(&cache_mtx);
+	if (n == 0)
+		return;
+
+	nimages = MagickGetNumberImages(wand);
+	if (nimages <= first)
+		return;
+
+	index = MagickGetImageIndex(wand);
+	images = NewMagickWand();
+	for (n = first; n < nimages; n++) {
+		MagickSetImageIndex(wand, n);
+		size += (size_t)MagickGetImageWidth(wand) *
+		    MagickGetImageHeight(wand) * sizeof(PixelPacket);
+		image = MagickGetImage(wand);
+		MagickAddImage(images, image);
+		DestroyMagickWand(image);
+	}
+	MagickSetImageIndex(wand, index);
+
+	size += key->datalen;
+	e = calloc(1, sizeof(struct image_entry) + key->datalen);
+	if (e == NULL) {
+		DestroyMagickWand(images);
+		return;
+	}
+	memcpy(&e->key, key, sizeof(struct image_key));
+	memcpy(e + 1, key->data, key->datalen);
+	e->key.data = e + 1;
+	e->wand = images;
+	e->size = size;
+
+	pthread_mutex_lock(&cache_mtx);
+	if (size > cache_limit || lookup(key) != NULL) {
+		pthread_mutex_unlock(&cache_mtx);
+		DestroyMagickWand(images);
+		free(e);
+		return;
+	}
+	e->hnext = buckets[bucket(key)];
+	buckets[bucket(key)] = e;
+	push_lru(e);
+	cache_size += size;
+	trim();
+	pthread_mutex_unlock(&cache_mtx);
+}
+
+static int
+setImageCacheSize(lua_State *L)
+{
+	lua_Integer limit;
+
+	limit = luaL_checkinteger(L, 1);
+	luaL_argcheck(L, limit >= 0, 1, "size must not be negative");
+
+	pthread_mutex_lock(&cache_mtx);
+	cache_limit = limit;
+	trim();
+	pthread_mutex_unlock(&cache_mtx);
+	return 0;
+}
+
+static int
+clearImageCache(lua_State *L)
+{
+	pthread_mutex_lock(&cache_mtx);
+	while (lru_tail != NULL)
+		evict(lru_tail);
+	pthread_mutex_unlock(&cache_mtx);
+	return 0;
+}
+
+static int
+imageCacheStats(lua_State *L)
+{
+	struct image_entry *e;
+	lua_Integer entries = 0, size, limit, hits, misses, evictions;
+
+	pthread_mutex_lock(&cache_mtx);
+	for (e = lru_head; e != NULL; e = e->next)
+		entries++;
+	size = cache_size;
+	limit = cache_limit;
+	hits = cache_hits;
+	misses = cache_misses;
+	evictions = cache_evictions;
+	pthread_mutex_unlock(&cache_mtx);
+
+	lua_createtable(L, 0, 6);
+	lua_pushinteger(L, entries);
+	lua_setfield(L, -2, "entries");
+	lua_pushinteger(L, size);
+	lua_setfield(L, -2, "size");
+	lua_pushinteger(L, limit);
+	lua_setfield(L, -2, "limit");
+	lua_pushinteger(L, hits);
+	lua_setfield(L, -2, "hits");
+	lua_pushinteger(L, misses);
+	lua_setfield(L, -2, "misses");
+	lua_pushinteger(L, evictions);
+	lua_setfield(L, -2, "evictions");
+	return 1;
+}
+
+struct luaL_Reg imagecache_functions[] = {
+	{ "setImageCacheSize",	setImageCacheSize },
+	{ "clearImageCache",	clearImageCache },
+	{ "imageCacheStats",	imageCacheStats },
+	{ NULL, NULL }
+};
@@ -0,0 +1,513 @@
+/*
+ * Copyright (c) 2016, 2017 Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of Micro Systems Marc Balmer nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/* Lossless JPEG transforms in the DCT domain for GraphicsMagick for Lua */
+
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <jpeglib.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+#include <wand/magick_wand.h>
+
+#include "luagraphicsmagick.h"
+
+struct jpeg_error {
+	struct jpeg_error_mgr	pub;
+	jmp_buf			jmp;
+	char			msg[JMSG_LENGTH_MAX];
+};
+
+/*
+ * Everything that changes between setjmp() and a longjmp() from libjpeg
+ * lives in this heap allocated context, so no automatic variable needs
+ * to be volatile.
+ */
+struct xform_ctx {
+	struct jpeg_decompress_struct	src;
+	struct jpeg_compress_struct	dst;
+	struct jpeg_error		err;
+	unsigned char			*outbuf;
+	unsigned long			outsize;
+};
+
+static void
+fatal(j_common_ptr cinfo)
+{
+	struct jpeg_error *err = (struct jpeg_error *)cinfo->err;
+
+	(*cinfo->err->format_message)(cinfo, err->msg);
+	longjmp(err->jmp, 1);
+}
+
+static void
+silent(j_common_ptr cinfo)
+{
+}
+
+static void
+transposeqtables(j_compress_ptr dst)
+{
+	JQUANT_TBL *q;
+	UINT16 tmp;
+	int n, i, j;
+
+	for (n = 0; n < NUM_QUANT_TBLS; n++) {
+		if ((q = dst->quant_tbl_ptrs[n]) == NULL)
+			continue;
+		for (i = 0; i < DCTSIZE; i++)
+			for (j = i + 1; j < DCTSIZE; j++) {
+				tmp = q->quantval[i * DCTSIZE + j];
+				q->quantval[i * DCTSIZE + j] =
+				    q->quantval[j * DCTSIZE + i];
+				q->quantval[j * DCTSIZE + i] = tmp;
+			}
+	}
+}
+
+/*
+ * Transform one 8x8 block.  With transpose set rows and columns are
+ * swapped, hmirror and vmirror negate the odd horizontal and vertical
+ * frequencies, which mirrors the block in the pixel domain.
+ */
+static void
+xformblock(JCOEFPTR dst, const JCOEF *src, int transpose, int hmirror,
+    int vmirror)
+{
+	JCOEF c;
+	int u, v;
+
+	for (v = 0; v < DCTSIZE; v++)
+		for (u = 0; u < DCTSIZE; u++) {
+			c = transpose ? src[u * DCTSIZE + v] :
+			    src[v * DCTSIZE + u];
+			if ((hmirror && (u & 1)) ^ (vmirror && (v & 1)))
+				c = -c;
+			dst[v * DCTSIZE + u] = c;
+		}
+}
+
+/*
+ * Losslessly transform a JPEG image.  Mirroring an axis is only possible
+ * when the image size along it is a multiple of the MCU size, with trim
+ * set a partial MCU at the edge is dropped, like jpegtran -trim does.
+ * Crop offsets must be MCU aligned.  Returns 0 and a buffer allocated
+ * with malloc() or -1 and an error message.
+ */
+int
+jpegtransform(const unsigned char *in, size_t inlen,
+    const struct jpeg_xform *xf, unsigned char **out, size_t *outlen,
+    char *errmsg, size_t errlen)
+{
+	struct xform_ctx *ctx;
+	jpeg_component_info *comp;
+	jvirt_barray_ptr *src_coef, dst_coef[MAX_COMPONENTS];
+	JBLOCKARRAY drow, srow;
+	JDIMENSION width, height, dwidth, dheight, bx, by, sx, sy, tx, ty;
+	JDIMENSION dw, dh, sw, shgt, mcuw, mcuh, xoff = 0, yoff = 0;
+	jpeg_saved_marker_ptr m;
+	int transpose = 0, hmirror = 0, vmirror = 0, needx = 0, needy = 0;
+	int ci, h, v, status = -1;
+
+	if ((ctx = calloc(1, sizeof(struct xform_ctx))) == NULL) {
+		snprintf(errmsg, errlen, "memory error");
+		return -1;
+	}
+	ctx->src.err = jpeg_std_error(&ctx->err.pub);
+	ctx->dst.err = &ctx->err.pub;
+	ctx->err.pub.error_exit = fatal;
+	ctx->err.pub.output_message = silent;
+	if (setjmp(ctx->err.jmp)) {
+		snprintf(errmsg, errlen, "%s", ctx->err.msg);
+		goto done;
+	}
+
+	jpeg_create_decompress(&ctx->src);
+	jpeg_mem_src(&ctx->src, (unsigned char *)in, inlen);
+	jpeg_save_markers(&ctx->src, JPEG_COM, 0xffff);
+	for (ci = 0; ci < 16; ci++)
+		jpeg_save_markers(&ctx->src, JPEG_APP0 + ci, 0xffff);
+	jpeg_read_header(&ctx->src, TRUE);
+
+	width = ctx->src.image_width;
+	height = ctx->src.image_height;
+	mcuw = ctx->src.max_h_samp_factor * DCTSIZE;
+	mcuh = ctx->src.max_v_samp_factor * DCTSIZE;
+
+	switch (xf->op) {
+	case JPEG_ROTATE90:
+		transpose = hmirror = needy = 1;
+		break;
+	case JPEG_ROTATE180:
+		hmirror = vmirror = needx = needy = 1;
+		break;
+	case JPEG_ROTATE270:
+		transpose = vmirror = needx = 1;
+		break;
+	case JPEG_FLIP:
+		vmirror = needy = 1;
+		break;
+	case JPEG_FLOP:
+		hmirror = needx = 1;
+		break;
+	case JPEG_TRANSPOSE:
+		transpose = 1;
+		break;
+	case JPEG_CROP:
+		if (xf->x % mcuw || xf->y % mcuh || xf->x >= width ||
+		    xf->y >= height || xf->width == 0 || xf->height == 0) {
+			snprintf(errmsg, errlen, "crop offset must be a "
+			    "multiple of %ux%u", mcuw, mcuh);
+			goto done;
+		}
+		xoff = xf->x / mcuw;
+		yoff = xf->y / mcuh;
+		width = xf->width < width - xf->x ? xf->width : width - xf->x;
+		height = xf->height < height - xf->y ? xf->height :
+		    height - xf->y;
+		break;
+	}
+	if ((needx && width % mcuw) || (needy && height % mcuh)) {
+		if (!xf->trim) {
+			snprintf(errmsg, errlen, "image size is not a multiple "
+			    "of %ux%u", mcuw, mcuh);
+			goto done;
+		}
+		if (needx)
+			width -= width % mcuw;
+		if (needy)
+			height -= height % mcuh;
+		if (width == 0 || height == 0) {
+			snprintf(errmsg, errlen, "image is smaller than an MCU");
+			goto done;
+		}
+	}
+	dwidth = transpose ? height : width;
+	dheight = transpose ? width : height;
+
+	/* The destination arrays must be requested before they are realized */
+	for (ci = 0; ci < ctx->src.num_components; ci++) {
+		comp = &ctx->src.comp_info[ci];
+		h = transpose ? comp->v_samp_factor : comp->h_samp_factor;
+		v = transpose ? comp->h_samp_factor : comp->v_samp_factor;
+		dw = (dwidth + (transpose ? mcuh : mcuw) - 1) /
+		    (transpose ? mcuh : mcuw) * h;
+		dh = (dheight + (transpose ? mcuw : mcuh) - 1) /
+		    (transpose ? mcuw : mcuh) * v;
+		dst_coef[ci] = (*ctx->src.mem->request_virt_barray)
+		    ((j_common_ptr)&ctx->src, JPOOL_IMAGE, TRUE, dw, dh, v);
+	}
+	src_coef = jpeg_read_coefficients(&ctx->src);
+
+	for (ci = 0; ci < ctx->src.num_components; ci++) {
+		comp = &ctx->src.comp_info[ci];
+		h = transpose ? comp->v_samp_factor : comp->h_samp_factor;
+		v = transpose ? comp->h_samp_factor : comp->v_samp_factor;
+		dw = (dwidth + (transpose ? mcuh : mcuw) - 1) /
+		    (transpose ? mcuh : mcuw) * h;
+		dh = (dheight + (transpose ? mcuw : mcuh) - 1) /
+		    (transpose ? mcuw : mcuh) * v;
+		/* Source arrays are padded to whole MCUs */
+		sw = (comp->width_in_blocks + comp->h_samp_factor - 1) /
+		    comp->h_samp_factor * comp->h_samp_factor;
+		shgt = (comp->height_in_blocks + comp->v_samp_factor - 1) /
+		    comp->v_samp_factor * comp->v_samp_factor;
+
+		for (by = 0; by < dh; by++) {
+			drow = (*ctx->src.mem->access_virt_barray)
+			    ((j_common_ptr)&ctx->src, dst_coef[ci], by, 1,
+			    TRUE);
+			for (bx = 0; bx < dw; bx++) {
+				tx = hmirror ? dw - 1 - bx : bx;
+				ty = vmirror ? dh - 1 - by : by;
+				sx = (transpose ? ty : tx) +
+				    xoff * comp->h_samp_factor;
+				sy = (transpose ? tx : ty) +
+				    yoff * comp->v_samp_factor;
+				if (sx >= sw || sy >= shgt) {
+					memset(drow[0][bx], 0, sizeof(JBLOCK));
+					continue;
+				}
+				srow = (*ctx->src.mem->access_virt_barray)
+				    ((j_common_ptr)&ctx->src, src_coef[ci], sy,
+				    1, FALSE);
+				xformblock(drow[0][bx], srow[0][sx], transpose,
+				    hmirror, vmirror);
+			}
+		}
+	}
+
+	jpeg_create_compress(&ctx->dst);
+	jpeg_mem_dest(&ctx->dst, &ctx->outbuf, &ctx->outsize);
+	jpeg_copy_critical_parameters(&ctx->src, &ctx->dst);
+	ctx->dst.image_width = dwidth;
+	ctx->dst.image_height = dheight;
+	if (transpose) {
+		for (ci = 0; ci < ctx->dst.num_components; ci++) {
+			comp = &ctx->dst.comp_info[ci];
+			h = comp->h_samp_factor;
+			comp->h_samp_factor = comp->v_samp_factor;
+			comp->v_samp_factor = h;
+		}
+		transposeqtables(&ctx->dst);
+	}
+	jpeg_write_coefficients(&ctx->dst, dst_coef);
+
+	/* The library writes its own JFIF and Adobe markers */
+	for (m = ctx->src.marker_list; m != NULL; m = m->next) {
+		if (ctx->dst.write_JFIF_header && m->marker == JPEG_APP0 &&
+		    m->data_length >= 5 && !memcmp(m->data, "JFIF", 5))
+			continue;
+		if (ctx->dst.write_Adobe_marker &&
+		    m->marker == JPEG_APP0 + 14 && m->data_length >= 5 &&
+		    !memcmp(m->data, "Adobe", 5))
+			continue;
+		/*
+		 * The pixels are transformed, so an EXIF orientation would
+		 * be applied a second time.  Cropping keeps it.
+		 */
+		if (xf->op != JPEG_CROP && m->marker == JPEG_APP0 + 1)
+			uprightexif(m->data, m->data_length);
+		jpeg_write_marker(&ctx->dst, m->marker, m->data,
+		    m->data_length);
+	}
+	jpeg_finish_compress(&ctx->dst);
+	jpeg_finish_decompress(&ctx->src);
+
+	*out = ctx->outbuf;
+	*outlen = ctx->outsize;
+	ctx->outbuf = NULL;
+	status = 0;
+done:
+	jpeg_destroy_compress(&ctx->dst);
+	jpeg_destroy_decompress(&ctx->src);
+	free(ctx->outbuf);
+	free(ctx);
+	return status;
+}
+
+/* Returns 1 if the blob starts with a JPEG SOI marker */
+int
+isjpeg(const unsigned char *blob, size_t len)
+{
+	return len > 3 && blob[0] == 0xff && blob[1] == 0xd8 &&
+	    blob[2] == 0xff;
+}
+
+#define MARGIN	16
+
+struct region_ctx {
+	struct jpeg_decompress_struct	src;
+	struct jpeg_error		err;
+	JSAMPROW			row;
+	unsigned char			*pixels;
+};
+
+/*
+ * Decode only the region r->x, r->y, r->width x r->height of a JPEG
+ * image, from blob or, if blob is NULL, from fp, scaled by r->scale / 8
+ * in the DCT domain.  Columns left of the region are cropped in the
+ * entropy decoder, rows above it are skipped and decoding stops after
+ * its last row.  The region is clipped to the image.  Returns 0 with the
+ * pixels in r->pixels, allocated with malloc(), 1 if the image should be
+ * decoded the normal way or -1 and an error message.
+ */
+int
+jpegregion(const unsigned char *blob, size_t len, FILE *fp,
+    struct jpeg_region *r, char *errmsg, size_t errlen)
+{
+#if defined(LIBJPEG_TURBO_VERSION_NUMBER) && \
+    LIBJPEG_TURBO_VERSION_NUMBER >= 1005000
+	struct region_ctx *ctx;
+	JDIMENSION sx, sy, ex, ey, xoff, cw, y;
+	int status = -1;
+
+	if ((ctx = calloc(1, sizeof(struct region_ctx))) == NULL) {
+		snprintf(errmsg, errlen, "memory error");
+		return -1;
+	}
+	ctx->src.err = jpeg_std_error(&ctx->err.pub);
+	ctx->err.pub.error_exit = fatal;
+	ctx->err.pub.output_message = silent;
+	if (setjmp(ctx->err.jmp)) {
+		snprintf(errmsg, errlen, "%s", ctx->err.msg);
+		goto done;
+	}
+
+	jpeg_create_decompress(&ctx->src);
+	if (blob != NULL)
+		jpeg_mem_src(&ctx->src, (unsigned char *)blob, len);
+	else
+		jpeg_stdio_src(&ctx->src, fp);
+	jpeg_read_header(&ctx->src, TRUE);
+	if (r->x >= ctx->src.image_width || r->y >= ctx->src.image_height) {
+		snprintf(errmsg, errlen, "region outside of the image");
+		goto done;
+	}
+	if (r->width > ctx->src.image_width - r->x)
+		r->width = ctx->src.image_width - r->x;
+	if (r->height > ctx->src.image_height - r->y)
+		r->height = ctx->src.image_height - r->y;
+
+	switch (ctx->src.jpeg_color_space) {
+	case JCS_GRAYSCALE:
+		ctx->src.out_color_space = JCS_GRAYSCALE;
+		break;
+	case JCS_YCbCr:
+	case JCS_RGB:
+		ctx->src.out_color_space = JCS_RGB;
+		break;
+	default:
+		status = 1;
+		goto done;
+	}
+	ctx->src.scale_num = r->scale;
+	ctx->src.scale_denom = 8;
+	jpeg_start_decompress(&ctx->src);
+	r->components = ctx->src.output_components;
+
+	sx = (unsigned long long)r->x * r->scale / 8;
+	sy = (unsigned long long)r->y * r->scale / 8;
+	ex = ((unsigned long long)(r->x + r->width) * r->scale + 7) / 8;
+	ey = ((unsigned long long)(r->y + r->height) * r->scale + 7) / 8;
+	if (ex > ctx->src.output_width)
+		ex = ctx->src.output_width;
+	if (ey > ctx->src.output_height)
+		ey = ctx->src.output_height;
+	if (sx >= ex || sy >= ey) {
+		snprintf(errmsg, errlen, "region outside of the image");
+		goto done;
+	}
+	r->columns = ex - sx;
+	r->rows = ey - sy;
+
+	/*
+	 * libjpeg widens the crop to iMCU boundaries.  A margin on either
+	 * side gives fancy upsampling the neighbours it would have had in
+	 * a full decode, so the edges of the region match it.
+	 */
+	xoff = sx > MARGIN ? sx - MARGIN : 0;
+	cw = (ex + MARGIN < ctx->src.output_width ? ex + MARGIN :
+	    ctx->src.output_width) - xoff;
+	jpeg_crop_scanline(&ctx->src, &xoff, &cw);
+	ctx->row = malloc((size_t)cw * r->components);
+	ctx->pixels = malloc((size_t)r->columns * r->rows * r->components);
+	if (ctx->row == NULL || ctx->pixels == NULL) {
+		snprintf(errmsg, errlen, "memory error");
+		goto done;
+	}
+	if (sy > 0 && jpeg_skip_scanlines(&ctx->src, sy) != sy) {
+		snprintf(errmsg, errlen, "premature end of JPEG data");
+		goto done;
+	}
+	for (y = 0; y < r->rows; y++) {
+		if (jpeg_read_scanlines(&ctx->src, &ctx->row, 1) != 1) {
+			snprintf(errmsg, errlen, "premature end of JPEG data");
+			goto done;
+		}
+		memcpy(ctx->pixels + (size_t)y * r->columns * r->components,
+		    ctx->row + (size_t)(sx - xoff) * r->components,
+		    (size_t)r->columns * r->components);
+	}
+
+	r->pixels = ctx->pixels;
+	ctx->pixels = NULL;
+	status = 0;
+done:
+	jpeg_abort_decompress(&ctx->src);
+	jpeg_destroy_decompress(&ctx->src);
+	free(ctx->row);
+	free(ctx->pixels);
+	free(ctx);
+	return status;
+#else
+	return 1;
+#endif
+}
+
+static const char *const jpeg_ops[] = {
+	"rotate90",
+	"rotate180",
+	"rotate270",
+	"flip",
+	"flop",
+	"transpose",
+	"crop",
+	NULL
+};
+
+/*
+ * graphicsmagick.transformJPEG(blob, op[, trim]) or
+ * graphicsmagick.transformJPEG(blob, 'crop', x, y, width, height)
+ */
+static int
+transformJPEG(lua_State *L)
+{
+	struct jpeg_xform xf;
+	const unsigned char *blob;
+	unsigned char *out;
+	char errmsg[JMSG_LENGTH_MAX];
+	size_t len, outlen;
+
+	blob = (const unsigned char *)luaL_checklstring(L, 1, &len);
+	memset(&xf, 0, sizeof xf);
+	xf.op = checkoption(L, 2, NULL, jpeg_ops);
+	if (xf.op == JPEG_CROP) {
+		xf.x = luaL_checkinteger(L, 3);
+		xf.y = luaL_checkinteger(L, 4);
+		xf.width = luaL_checkinteger(L, 5);
+		xf.height = luaL_checkinteger(L, 6);
+	} else
+		xf.trim = lua_toboolean(L, 3);
+
+	if (!isjpeg(blob, len)) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "not a JPEG image");
+		return 2;
+	}
+	if (jpegtransform(blob, len, &xf, &out, &outlen, errmsg,
+	    sizeof errmsg)) {
+		lua_pushnil(L);
+		lua_pushstring(L, errmsg);
+		return 2;
+	}
+	lua_pushlstring(L, (const char *)out, outlen);
+	free(out);
+	return 1;
+}
+
+struct luaL_Reg jpeg_functions[] = {
+	{ "transformJPEG",	transformJPEG },
+	{ NULL, NULL }
+};
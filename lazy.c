@@ -0,0 +1,433 @@
+/*
+ * Copyright (c) 2016, 2017 Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of Micro Systems Marc Balmer nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Lazy MagickWand transforms for GraphicsMagick for Lua */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+#include <magick/api.h>
+#include <wand/magick_wand.h>
+
+#include "luagraphicsmagick.h"
+
+/*
+ * Methods that leave the operations of a lazy wand pending: the methods
+ * that are recorded and those that do not look at the pixels.
+ */
+static const char *const keeppending[] = {
+	"blurImage",
+	"colorizeImage",
+	"cropImage",
+	"destroy",
+	"flipImage",
+	"flopImage",
+	"gammaImage",
+	"resizeImage",
+	"rotateImage",
+	"sampleImage",
+	"scaleImage",
+	"setLazy",
+	NULL
+};
+
+atomic_int lazy_used;
+
+int
+keepspending(const char *name)
+{
+	int n;
+
+	for (n = 0; keeppending[n] != NULL; n++)
+		if (!strcmp(keeppending[n], name))
+			return 1;
+	return 0;
+}
+
+static void
+freeop(struct frame_op *op)
+{
+	if (op->color[0] != NULL)
+		DestroyPixelWand((PixelWand *)op->color[0]);
+	if (op->color[1] != NULL)
+		DestroyPixelWand((PixelWand *)op->color[1]);
+}
+
+static void
+removeop(struct magick_wand *mw, size_t i)
+{
+	freeop(&mw->pending[i]);
+	memmove(&mw->pending[i], &mw->pending[i + 1],
+	    (mw->npending - i - 1) * sizeof(struct frame_op));
+	mw->npending--;
+}
+
+void
+clearpending(struct magick_wand *mw)
+{
+	size_t n;
+
+	for (n = 0; n < mw->npending; n++)
+		freeop(&mw->pending[n]);
+	free(mw->pending);
+	mw->pending = NULL;
+	mw->npending = mw->maxpending = 0;
+}
+
+/*
+ * Whether op can be recorded for a wand with nimages images.  Operations
+ * that are bound to fail run at once instead, so the failure is reported
+ * by the method that asked for them and not by some later call.
+ */
+int
+deferrable(const struct frame_op *op, unsigned long nimages)
+{
+	if (nimages == 0)
+		return 0;
+	switch (op->op) {
+	case FRAME_CROP:
+	case FRAME_RESIZE:
+	case FRAME_SAMPLE:
+	case FRAME_SCALE:
+		return op->arg[0] >= 1 && op->arg[1] >= 1;
+	case FRAME_GAMMA:
+		return op->arg[0] > 0.0;
+	}
+	return 1;
+}
+
+/*
+ * Record op for later execution.  The colors are cloned, the PixelWands
+ * passed by the caller may be gone when the operations are executed.
+ */
+int
+deferop(struct magick_wand *mw, const struct frame_op *op)
+{
+	struct frame_op *ops, *p;
+	size_t max;
+
+	if (mw->npending == mw->maxpending) {
+		max = mw->maxpending ? mw->maxpending * 2 : 8;
+		ops = realloc(mw->pending, max * sizeof(struct frame_op));
+		if (ops == NULL)
+			return -1;
+		mw->pending = ops;
+		mw->maxpending = max;
+	}
+	p = &mw->pending[mw->npending];
+	*p = *op;
+	p->color[0] = p->color[1] = NULL;
+	if ((op->color[0] != NULL &&
+	    (p->color[0] = ClonePixelWand(op->color[0])) == NULL) ||
+	    (op->color[1] != NULL &&
+	    (p->color[1] = ClonePixelWand(op->color[1])) == NULL)) {
+		freeop(p);
+		return -1;
+	}
+	mw->npending++;
+	return 0;
+}
+
+static int
+pixelop(int op)
+{
+	return op == FRAME_COLORIZE || op == FRAME_GAMMA;
+}
+
+static int
+resizeop(int op)
+{
+	return op == FRAME_RESIZE || op == FRAME_SAMPLE || op == FRAME_SCALE;
+}
+
+/* Image size after op, 0 x 0 if it is not known in advance */
+static void
+outsize(const struct frame_op *op, unsigned long *w, unsigned long *h)
+{
+	switch (op->op) {
+	case FRAME_RESIZE:
+	case FRAME_SAMPLE:
+	case FRAME_SCALE:
+		*w = op->arg[0];
+		*h = op->arg[1];
+		break;
+	case FRAME_CROP:
+		if (op->arg[2] < 0 || op->arg[3] < 0 || op->arg[2] >= *w ||
+		    op->arg[3] >= *h) {
+			*w = *h = 0;
+			break;
+		}
+		if (op->arg[0] < *w - op->arg[2])
+			*w = op->arg[0];
+		else
+			*w -= op->arg[2];
+		if (op->arg[1] < *h - op->arg[3])
+			*h = op->arg[1];
+		else
+			*h -= op->arg[3];
+		break;
+	case FRAME_ROTATE:
+		*w = *h = 0;
+		break;
+	}
+}
+
+/*
+ * Apply one rewrite to the pending operations of mw, returns 0 if none
+ * applies.  Crops are moved ahead of color operations, flips, flops and
+ * resizes, where they become a crop of the source; consecutive crops and
+ * gammas are merged and double flips and flops removed.  These are
+ * exact.  Only for wands set to approximate a crop is also moved ahead
+ * of a resize; it is widened to whole source pixels, so the scale and
+ * phase of the resize change by up to one source pixel over the crop.
+ */
+static int
+rewrite(struct magick_wand *mw, unsigned long width, unsigned long height)
+{
+	struct frame_op *ops = mw->pending, *a, *b, crop;
+	unsigned long w = width, h = height, cw, ch;
+	double x0, y0, x1, y1;
+	size_t i;
+
+	for (i = 0; i + 1 < mw->npending; i++, outsize(a, &w, &h)) {
+		a = &ops[i];
+		b = &ops[i + 1];
+
+		if (a->op == b->op && (a->op == FRAME_FLIP ||
+		    a->op == FRAME_FLOP)) {
+			removeop(mw, i + 1);
+			removeop(mw, i);
+			return 1;
+		}
+		if (a->op == b->op && a->op == FRAME_GAMMA) {
+			b->arg[0] *= a->arg[0];
+			removeop(mw, i);
+			return 1;
+		}
+
+		/* The remaining rewrites move a crop b ahead of a */
+		if (b->op != FRAME_CROP || w == 0)
+			continue;
+		cw = w;
+		ch = h;
+		outsize(a, &cw, &ch);
+		crop = *b;
+		outsize(&crop, &cw, &ch);
+		if (cw == 0)
+			continue;
+		crop.arg[0] = cw;
+		crop.arg[1] = ch;
+
+		if (a->op == FRAME_CROP) {
+			a->arg[2] += crop.arg[2];
+			a->arg[3] += crop.arg[3];
+			a->arg[0] = cw;
+			a->arg[1] = ch;
+			removeop(mw, i + 1);
+			return 1;
+		}
+		if (pixelop(a->op)) {
+			/* crop is unchanged */
+		} else if (a->op == FRAME_FLIP)
+			crop.arg[3] = h - crop.arg[3] - ch;
+		else if (a->op == FRAME_FLOP)
+			crop.arg[2] = w - crop.arg[2] - cw;
+		else if (resizeop(a->op) && mw->approximate) {
+			x0 = floor(crop.arg[2] * w / a->arg[0]);
+			y0 = floor(crop.arg[3] * h / a->arg[1]);
+			x1 = ceil((crop.arg[2] + cw) * w / a->arg[0]);
+			y1 = ceil((crop.arg[3] + ch) * h / a->arg[1]);
+			if (x1 > w)
+				x1 = w;
+			if (y1 > h)
+				y1 = h;
+			crop.arg[0] = x1 - x0;
+			crop.arg[1] = y1 - y0;
+			crop.arg[2] = x0;
+			crop.arg[3] = y0;
+			*b = *a;
+			b->arg[0] = cw;
+			b->arg[1] = ch;
+			*a = crop;
+			return 1;
+		} else
+			continue;
+		*b = *a;
+		*a = crop;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Colorize and gamma change each channel on its own, so a run of them
+ * is fused into one lookup table per channel and one pass over the
+ * pixels.  Only used for images without matte in an RGB colorspace.
+ */
+static int
+colorpass(MagickWand *wand, const struct frame_op *ops, size_t nops)
+{
+	unsigned long width, height;
+	unsigned short *lut, *sp;
+	unsigned char *pixels;
+	StorageType storage;
+	size_t i, n, npixels, levels;
+	double v, color[3], opacity[3];
+	int c, wide, status = 0;
+
+	width = MagickGetImageWidth(wand);
+	height = MagickGetImageHeight(wand);
+	npixels = (size_t)width * height;
+	/* 16-bit pixels on Q16 builds, 8-bit ones would lose precision */
+	wide = QuantumDepth > 8;
+	levels = wide ? 65536 : 256;
+	storage = wide ? ShortPixel : CharPixel;
+
+	lut = malloc(3 * levels * sizeof(unsigned short));
+	pixels = malloc(npixels * 3 * (wide ? 2 : 1));
+	if (lut == NULL || pixels == NULL)
+		goto done;
+
+	for (n = 0; n < levels; n++) {
+		for (c = 0; c < 3; c++)
+			color[c] = (double)n / (levels - 1);
+		for (i = 0; i < nops; i++) {
+			if (ops[i].op == FRAME_GAMMA) {
+				for (c = 0; c < 3; c++)
+					color[c] = pow(color[c],
+					    1.0 / ops[i].arg[0]);
+				continue;
+			}
+			opacity[0] = PixelGetRed(ops[i].color[1]);
+			opacity[1] = PixelGetGreen(ops[i].color[1]);
+			opacity[2] = PixelGetBlue(ops[i].color[1]);
+			color[0] = color[0] * (1.0 - opacity[0]) +
+			    PixelGetRed(ops[i].color[0]) * opacity[0];
+			color[1] = color[1] * (1.0 - opacity[1]) +
+			    PixelGetGreen(ops[i].color[0]) * opacity[1];
+			color[2] = color[2] * (1.0 - opacity[2]) +
+			    PixelGetBlue(ops[i].color[0]) * opacity[2];
+		}
+		for (c = 0; c < 3; c++) {
+			v = color[c] * (levels - 1) + 0.5;
+			lut[c * levels + n] = v < 0 ? 0 :
+			    v > levels - 1 ? levels - 1 : v;
+		}
+	}
+
+	if (!MagickGetImagePixels(wand, 0, 0, width, height, "RGB", storage,
+	    pixels))
+		goto done;
+	sp = (unsigned short *)pixels;
+	for (n = 0; n < npixels * 3; n++)
+		if (wide)
+			sp[n] = lut[(n % 3) * levels + sp[n]];
+		else
+			pixels[n] = lut[(n % 3) * levels + pixels[n]];
+	status = MagickSetImagePixels(wand, 0, 0, width, height, "RGB",
+	    storage, pixels);
+done:
+	free(lut);
+	free(pixels);
+	return status;
+}
+
+static int
+fusable(MagickWand *wand, size_t nops)
+{
+	ColorspaceType colorspace;
+
+	if (nops < 2 || MagickGetImageMatte(wand))
+		return 0;
+	colorspace = MagickGetImageColorspace(wand);
+	return colorspace == RGBColorspace || colorspace == sRGBColorspace;
+}
+
+/*
+ * Optimize and run the pending operations of mw on its current image.
+ * The operations are dropped in any case.  Returns 0 on success.
+ */
+static int
+runpending(struct magick_wand *mw, char *error, size_t len)
+{
+	struct frame_op *ops;
+	ExceptionType severity;
+	char *description;
+	size_t i, j;
+	int status = 1;
+
+	if (MagickGetNumberImages(mw->wand) > 0)
+		while (rewrite(mw, MagickGetImageWidth(mw->wand),
+		    MagickGetImageHeight(mw->wand)))
+			;
+
+	ops = mw->pending;
+	for (i = 0; status && i < mw->npending; i = j) {
+		for (j = i; j < mw->npending && pixelop(ops[j].op); j++)
+			if (ops[j].op == FRAME_GAMMA && ops[j].arg[0] <= 0.0)
+				break;
+		if (fusable(mw->wand, j - i))
+			status = colorpass(mw->wand, &ops[i], j - i);
+		else {
+			j = i + 1;
+			status = applyframeop(mw->wand, &ops[i]);
+		}
+	}
+	clearpending(mw);
+	if (status)
+		return 0;
+
+	description = MagickGetException(mw->wand, &severity);
+	snprintf(error, len, "%s", description != NULL ? description :
+	    "pending operation failed");
+	if (description != NULL)
+		MagickRelinquishMemory(description);
+	return -1;
+}
+
+/* Run the pending operations of mw, raise an error if they fail */
+void
+flushpending(lua_State *L, struct magick_wand *mw)
+{
+	struct magick_wand *prev;
+	char error[128];
+	int status;
+
+	prev = running_wand;
+	running_wand = mw;
+	mw->deadline = mw->timeout ? nanotime() + mw->timeout : 0;
+	status = runpending(mw, error, sizeof error);
+	running_wand = prev;
+	if (status)
+		luaL_error(L, "%s", error);
+}
@@ -27,14 +27,378 @@
 
 /* GraphicsMagick for Lua */
 
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
 #include <lua.h>
 #include <lauxlib.h>
 #include <lualib.h>
 
+#include <magick/api.h>
 #include <wand/magick_wand.h>
 
 #include "luagraphicsmagick.h"
 
+__thread struct magick_wand *running_wand;
+
+static MonitorHandler chained_monitor;
+
+const char coordinate_buffer_metatable[] = "GraphicsMagick CoordinateBuffer";
+const char drawing_template_metatable[] = "GraphicsMagick DrawingTemplate";
+const char drawing_wand_metatable[] = "GraphicsMagick DrawingWand";
+const char encoder_profile_metatable[] = "GraphicsMagick EncoderProfile";
+const char magick_wand_metatable[] = "GraphicsMagick MagickWand";
+const char pixel_wand_metatable[] = "GraphicsMagick PixelWand";
+const char result_cache_metatable[] = "GraphicsMagick ResultCache";
+
+static const char *const metatables[] = {
+	coordinate_buffer_metatable,
+	drawing_template_metatable,
+	drawing_wand_metatable,
+	encoder_profile_metatable,
+	magick_wand_metatable,
+	pixel_wand_metatable,
+	result_cache_metatable,
+	NULL
+};
+
+uint64_t
+nanotime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Like luaL_checkudata(), but the metatable is looked up in the registry
+ * by the address of its name, which spares hashing the name on every
+ * call.  Mismatches are left to luaL_checkudata() for the error message.
+ */
+void *
+checkudata(lua_State *L, int arg, const char *tname)
+{
+	void *p;
+	int same;
+
+	p = lua_touserdata(L, arg);
+	if (p != NULL && lua_getmetatable(L, arg)) {
+		lua_rawgetp(L, LUA_REGISTRYINDEX, tname);
+		same = lua_rawequal(L, -1, -2);
+		lua_pop(L, 2);
+		if (same)
+			return p;
+	}
+	return luaL_checkudata(L, arg, tname);
+}
+
+/* Push the name to index table of an option list, built on first use */
+static void
+optiontable(lua_State *L, const char *const lst[])
+{
+	int n;
+
+	if (lua_rawgetp(L, LUA_REGISTRYINDEX, lst) == LUA_TTABLE)
+		return;
+	lua_pop(L, 1);
+
+	lua_newtable(L);
+	for (n = 0; lst[n] != NULL; n++) {
+		lua_pushinteger(L, n);
+		lua_setfield(L, -2, lst[n]);
+	}
+	lua_pushinteger(L, n);
+	lua_rawseti(L, -2, 0);
+	lua_pushvalue(L, -1);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, lst);
+}
+
+/*
+ * Like luaL_checkoption(), but names are resolved with a table lookup
+ * instead of a linear scan and the integer constants exported by the
+ * module are accepted as well.
+ */
+int
+checkoption(lua_State *L, int arg, const char *def, const char *const lst[])
+{
+	lua_Integer n, count;
+	int isnum;
+
+	arg = lua_absindex(L, arg);
+	switch (lua_type(L, arg)) {
+	case LUA_TNUMBER:
+		optiontable(L, lst);
+		lua_rawgeti(L, -1, 0);
+		count = lua_tointeger(L, -1);
+		lua_pop(L, 2);
+		n = lua_tointegerx(L, arg, &isnum);
+		luaL_argcheck(L, isnum && n >= 0 && n < count, arg,
+		    "invalid option");
+		return n;
+	case LUA_TSTRING:
+		optiontable(L, lst);
+		lua_pushvalue(L, arg);
+		lua_rawget(L, -2);
+		n = lua_tointegerx(L, -1, &isnum);
+		lua_pop(L, 2);
+		if (isnum)
+			return n;
+		break;
+	}
+	return luaL_checkoption(L, arg, def, lst);
+}
+
+/* Export the entries of option lists as integer constants */
+static void
+setconstants(lua_State *L, const char *const *const lists[])
+{
+	const char *const *lst;
+	int n;
+
+	for (; *lists != NULL; lists++)
+		for (lst = *lists, n = 0; lst[n] != NULL; n++) {
+			lua_pushinteger(L, n);
+			lua_setfield(L, -2, lst[n]);
+		}
+}
+
+/*
+ * GraphicsMagick reports progress of long running operations through a
+ * single process wide monitor handler.  The MagickWand method running on
+ * the current thread is tracked in running_wand so that its deadline and
+ * cancellation flag can be enforced from here.  Progress reported from
+ * the OpenMP worker threads of GraphicsMagick does not see running_wand,
+ * deadlines and cancellation only take effect when the calling thread
+ * reports progress.
+ */
+static MagickPassFail
+monitor(const char *text, const magick_int64_t quantum,
+    const magick_uint64_t span, ExceptionInfo *exception)
+{
+	struct magick_wand *mw = running_wand;
+
+	if (mw != NULL) {
+		if (atomic_load(&mw->cancelled)) {
+			ThrowException(exception, MonitorError,
+			    "operation cancelled", text);
+			return MagickFail;
+		}
+		if (mw->deadline && nanotime() > mw->deadline) {
+			ThrowException(exception, MonitorError,
+			    "deadline exceeded", text);
+			return MagickFail;
+		}
+	}
+	if (chained_monitor != NULL)
+		return chained_monitor(text, quantum, span, exception);
+	return MagickPass;
+}
+
+/*
+ * Loops that do not report progress to GraphicsMagick call this instead,
+ * it returns 1 when the running method is cancelled or past its deadline.
+ */
+int
+interrupted(void)
+{
+	struct magick_wand *mw = running_wand;
+
+	return mw != NULL && (atomic_load(&mw->cancelled) ||
+	    (mw->deadline && nanotime() > mw->deadline));
+}
+
+/*
+ * Cancel tokens are integers that name a wand across Lua states, a state
+ * running on another thread passes one to graphicsmagick.cancel() to stop
+ * an operation on the wand.  Wands that have a token are kept on a list
+ * until they are destroyed, the tokens of destroyed wands are ignored.
+ */
+static pthread_mutex_t tokens_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct magick_wand *tokens;
+static lua_Integer lasttoken;
+
+lua_Integer
+canceltoken(struct magick_wand *mw)
+{
+	pthread_mutex_lock(&tokens_mutex);
+	if (mw->token == 0) {
+		mw->token = ++lasttoken;
+		mw->nexttoken = tokens;
+		tokens = mw;
+	}
+	pthread_mutex_unlock(&tokens_mutex);
+	return mw->token;
+}
+
+void
+droptoken(struct magick_wand *mw)
+{
+	struct magick_wand **p;
+
+	if (mw->token == 0)
+		return;
+	pthread_mutex_lock(&tokens_mutex);
+	for (p = &tokens; *p != NULL; p = &(*p)->nexttoken)
+		if (*p == mw) {
+			*p = mw->nexttoken;
+			break;
+		}
+	pthread_mutex_unlock(&tokens_mutex);
+	mw->token = 0;
+}
+
+/*
+ * graphicsmagick.cancel(token[, false]) cancels the wand of a token, as
+ * wand:cancel() does.  Returns false if the wand is gone.
+ */
+static int
+canceltokened(lua_State *L)
+{
+	struct magick_wand *mw;
+	lua_Integer token;
+	int on;
+
+	token = luaL_checkinteger(L, 1);
+	on = lua_isnoneornil(L, 2) || lua_toboolean(L, 2);
+	pthread_mutex_lock(&tokens_mutex);
+	for (mw = tokens; mw != NULL; mw = mw->nexttoken)
+		if (mw->token == token) {
+			atomic_store(&mw->cancelled, on);
+			break;
+		}
+	pthread_mutex_unlock(&tokens_mutex);
+	lua_pushboolean(L, mw != NULL);
+	return 1;
+}
+
+/* Run the pending operations of lazy wands passed as arguments */
+static void
+flusharguments(lua_State *L)
+{
+	struct magick_wand *mw;
+	int n, top;
+
+	top = lua_gettop(L);
+	for (n = 2; n <= top; n++) {
+		if (lua_type(L, n) != LUA_TUSERDATA || !lua_getmetatable(L, n))
+			continue;
+		mw = lua_touserdata(L, n);
+		if (lua_rawequal(L, -1, lua_upvalueindex(2)) && mw->npending)
+			flushpending(L, mw);
+		lua_pop(L, 1);
+	}
+}
+
+/*
+ * MagickWand methods are called through this closure.  Upvalue 1 is the
+ * method itself, upvalue 2 the MagickWand metatable, upvalue 3 the
+ * statistics slot of the method and upvalue 4 is true for methods that
+ * leave the operations of lazy wands pending.
+ */
+static int
+magickdispatch(lua_State *L)
+{
+	struct magick_wand *mw, *prev;
+	struct method_stats *st;
+	lua_CFunction method;
+	uint64_t start, end, pixels_in;
+	int nresults, status, timed, traced;
+
+	method = lua_tocfunction(L, lua_upvalueindex(1));
+	mw = lua_touserdata(L, 1);
+	if (mw == NULL || !lua_getmetatable(L, 1))
+		return method(L);
+	if (!lua_rawequal(L, -1, lua_upvalueindex(2))) {
+		lua_pop(L, 1);
+		return method(L);
+	}
+	lua_pop(L, 1);
+
+	if (atomic_load_explicit(&lazy_used, memory_order_relaxed)) {
+		if (mw->npending && !lua_toboolean(L, lua_upvalueindex(4)))
+			flushpending(L, mw);
+		flusharguments(L);
+	}
+
+	st = lua_touserdata(L, lua_upvalueindex(3));
+	timed = st != NULL && atomic_load_explicit(&stats_enabled,
+	    memory_order_relaxed);
+	traced = st != NULL && atomic_load_explicit(&tracing,
+	    memory_order_relaxed);
+	pixels_in = timed ? imagepixels(mw->wand) : 0;
+	start = timed || traced ? nanotime() : 0;
+
+	/*
+	 * The method runs in protected mode, so that running_wand is
+	 * restored even when it raises an error.
+	 */
+	prev = running_wand;
+	running_wand = mw;
+	mw->deadline = mw->timeout ? nanotime() + mw->timeout : 0;
+	lua_pushcfunction(L, method);
+	lua_insert(L, 1);
+	status = lua_pcall(L, lua_gettop(L) - 1, LUA_MULTRET, 0);
+	running_wand = prev;
+	if (status != LUA_OK)
+		return lua_error(L);
+	nresults = lua_gettop(L);
+
+	if (timed || traced) {
+		end = nanotime();
+		if (timed)
+			recordcall(st, end - start, pixels_in,
+			    imagepixels(mw->wand));
+		if (traced)
+			tracespan(st->category, st->name, start, end,
+			    mw->wand);
+	}
+	return nresults;
+}
+
+/*
+ * DrawingWand methods only pay for a span when tracing is on.  Upvalue 3
+ * is the method name.
+ */
+static int
+drawingdispatch(lua_State *L)
+{
+	lua_CFunction method;
+	uint64_t start;
+	int nresults;
+
+	method = lua_tocfunction(L, lua_upvalueindex(1));
+	if (!atomic_load_explicit(&tracing, memory_order_relaxed))
+		return method(L);
+
+	start = nanotime();
+	nresults = method(L);
+	tracespan("DrawingWand", lua_touserdata(L, lua_upvalueindex(3)),
+	    start, nanotime(), NULL);
+	return nresults;
+}
+
+static void
+setmethods(lua_State *L, const struct luaL_Reg *l, lua_CFunction dispatch)
+{
+	for (; l->name != NULL; l++) {
+		lua_pushcfunction(L, l->func);
+		if (strcmp(l->name, "__gc")) {
+			lua_pushvalue(L, -2);
+			if (dispatch == magickdispatch) {
+				lua_pushlightuserdata(L, magickstats(l->name));
+				lua_pushboolean(L, keepspending(l->name));
+				lua_pushcclosure(L, dispatch, 4);
+			} else {
+				lua_pushlightuserdata(L, (void *)l->name);
+				lua_pushcclosure(L, dispatch, 3);
+			}
+		}
+		lua_setfield(L, -2, l->name);
+	}
+}
+
 static int
 getCopyright(lua_State *L)
 {
@@ -63,11 +427,7 @@ newDrawingWand(lua_State *L)
 static int
 newMagickWand(lua_State *L)
 {
-	MagickWand **mw;
-
-	mw = lua_newuserdata(L, sizeof(MagickWand *));
-	*mw = NewMagickWand();
-	luaL_setmetatable(L, MAGICK_WAND_METATABLE);
+	pushmagickwand(L, NewMagickWand());
 	return 1;
 }
 
@@ -91,11 +451,16 @@ static const char *const resources[] = {
 	NULL
 };
 
+static const char *const *const resource_options[] = {
+	resources,
+	NULL
+};
+
 static int
 setResourceLimit(lua_State *L)
 {
 	lua_pushinteger(L, MagickSetResourceLimit(
-	    luaL_checkoption(L, 1, "UndefinedResource", resources),
+	    checkoption(L, 1, "UndefinedResource", resources),
 	    luaL_checkinteger(L, 2)));
 	return 1;
 }
@@ -104,6 +469,7 @@ int
 luaopen_graphicsmagick(lua_State *L)
 {
 	struct luaL_Reg luagraphicsmagick[] = {
+		{ "cancel",		canceltokened },
 		{ "getCopyright",	getCopyright },
 		{ "getHomeURL",		getHomeURL },
 		{ "newDrawingWand",	newDrawingWand },
@@ -112,10 +478,64 @@ luaopen_graphicsmagick(lua_State *L)
 		{ "setResourceLimit",	setResourceLimit },
 		{ NULL, NULL }
 	};
+	MonitorHandler handler;
+	int n;
+
 	luaL_newlib(L, luagraphicsmagick);
+	luaL_setfuncs(L, annotcache_functions, 0);
+	luaL_setfuncs(L, coords_functions, 0);
+	luaL_setfuncs(L, encoder_functions, 0);
+	luaL_setfuncs(L, fontmetrics_functions, 0);
+	luaL_setfuncs(L, imagecache_functions, 0);
+	luaL_setfuncs(L, jpeg_functions, 0);
+	luaL_setfuncs(L, mvg_functions, 0);
+	luaL_setfuncs(L, resample_functions, 0);
+	luaL_setfuncs(L, resultcache_functions, 0);
+	luaL_setfuncs(L, stats_functions, 0);
+	luaL_setfuncs(L, template_functions, 0);
+	luaL_setfuncs(L, trace_functions, 0);
+
+	if (luaL_newmetatable(L, COORDINATE_BUFFER_METATABLE)) {
+		luaL_setfuncs(L, coordinate_buffer_methods, 0);
+
+		lua_pushliteral(L, "__index");
+		lua_pushvalue(L, -2);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__metatable");
+		lua_pushliteral(L, "must not access this metatable");
+		lua_settable(L, -3);
+	}
+	lua_pop(L, 1);
+
+	if (luaL_newmetatable(L, DRAWING_TEMPLATE_METATABLE)) {
+		luaL_setfuncs(L, drawing_template_methods, 0);
+
+		lua_pushliteral(L, "__index");
+		lua_pushvalue(L, -2);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__metatable");
+		lua_pushliteral(L, "must not access this metatable");
+		lua_settable(L, -3);
+	}
+	lua_pop(L, 1);
 
 	if (luaL_newmetatable(L, DRAWING_WAND_METATABLE)) {
-		luaL_setfuncs(L, drawing_wand_methods, 0);
+		setmethods(L, drawing_wand_methods, drawingdispatch);
+
+		lua_pushliteral(L, "__index");
+		lua_pushvalue(L, -2);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__metatable");
+		lua_pushliteral(L, "must not access this metatable");
+		lua_settable(L, -3);
+	}
+	lua_pop(L, 1);
+
+	if (luaL_newmetatable(L, ENCODER_PROFILE_METATABLE)) {
+		luaL_setfuncs(L, encoder_profile_methods, 0);
 
 		lua_pushliteral(L, "__index");
 		lua_pushvalue(L, -2);
@@ -128,7 +548,7 @@ luaopen_graphicsmagick(lua_State *L)
 	lua_pop(L, 1);
 
 	if (luaL_newmetatable(L, MAGICK_WAND_METATABLE)) {
-		luaL_setfuncs(L, magick_wand_methods, 0);
+		setmethods(L, magick_wand_methods, magickdispatch);
 
 		lua_pushliteral(L, "__index");
 		lua_pushvalue(L, -2);
@@ -140,6 +560,7 @@ luaopen_graphicsmagick(lua_State *L)
 	}
 	lua_pop(L, 1);
 
+
 	if (luaL_newmetatable(L, PIXEL_WAND_METATABLE)) {
 		luaL_setfuncs(L, pixel_wand_methods, 0);
 
@@ -153,6 +574,32 @@ luaopen_graphicsmagick(lua_State *L)
 	}
 	lua_pop(L, 1);
 
+	if (luaL_newmetatable(L, RESULT_CACHE_METATABLE)) {
+		luaL_setfuncs(L, result_cache_methods, 0);
+
+		lua_pushliteral(L, "__index");
+		lua_pushvalue(L, -2);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__metatable");
+		lua_pushliteral(L, "must not access this metatable");
+		lua_settable(L, -3);
+	}
+	lua_pop(L, 1);
+
+	for (n = 0; metatables[n] != NULL; n++) {
+		luaL_getmetatable(L, metatables[n]);
+		lua_rawsetp(L, LUA_REGISTRYINDEX, metatables[n]);
+	}
+
+	setconstants(L, drawing_options);
+	setconstants(L, magick_options);
+	setconstants(L, resource_options);
+
+	handler = SetMonitorHandler(monitor);
+	if (handler != monitor)
+		chained_monitor = handler;
+
 	lua_pushliteral(L, "_COPYRIGHT");
 	lua_pushliteral(L, "Copyright (C) 2016, 2017 by "
 	    "micro systems marc balmer");
@@ -30,12 +30,283 @@
 #ifndef __LUAGRAPHICSMAGICK_H__
 #define __LUAGRAPHICSMAGICK_H__
 
-#define DRAWING_WAND_METATABLE		"GraphicsMagick DrawingWand"
-#define MAGICK_WAND_METATABLE		"GraphicsMagick MagickWand"
-#define PIXEL_WAND_METATABLE		"GraphicsMagick PixelWand"
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
 
+/*
+ * The metatable names are arrays, so that each has one address that
+ * checkudata() can use as registry key.
+ */
+#define COORDINATE_BUFFER_METATABLE	coordinate_buffer_metatable
+#define DRAWING_TEMPLATE_METATABLE	drawing_template_metatable
+#define DRAWING_WAND_METATABLE		drawing_wand_metatable
+#define ENCODER_PROFILE_METATABLE	encoder_profile_metatable
+#define MAGICK_WAND_METATABLE		magick_wand_metatable
+#define PIXEL_WAND_METATABLE		pixel_wand_metatable
+#define RESULT_CACHE_METATABLE		result_cache_metatable
+
+extern const char coordinate_buffer_metatable[];
+extern const char drawing_template_metatable[];
+extern const char drawing_wand_metatable[];
+extern const char encoder_profile_metatable[];
+extern const char magick_wand_metatable[];
+extern const char pixel_wand_metatable[];
+extern const char result_cache_metatable[];
+
+/*
+ * Number of values returned by MagickQueryFontMetrics(): character width
+ * and height, ascender, descender, text width and height and maximum
+ * horizontal advance.
+ */
+#define NMETRICS			7
+
+/* Largest blur accepted by resample(), wider filters would not fit */
+#define MAXBLUR				100.0
+
+/*
+ * Pixel kernels are plain loops written for the vectorizer.  On x86_64
+ * Linux they are compiled for AVX2 and for the baseline, SSE2, and the
+ * dynamic linker picks one for the running CPU.  On arm64 the baseline
+ * already vectorizes to NEON.
+ */
+#if defined(__GNUC__) && defined(__x86_64__) && defined(__linux__)
+#define SIMD_CLONES	__attribute__((target_clones("avx2", "default")))
+#else
+#define SIMD_CLONES
+#endif
+
+/* Packed array of doubles, usually x/y pairs */
+struct coordinate_buffer {
+	size_t	 n;
+	double	 v[];
+};
+
+/* Lossless JPEG transform, see jpegtransform() */
+enum {
+	JPEG_ROTATE90,
+	JPEG_ROTATE180,
+	JPEG_ROTATE270,
+	JPEG_FLIP,
+	JPEG_FLOP,
+	JPEG_TRANSPOSE,
+	JPEG_CROP
+};
+
+struct jpeg_xform {
+	int		 op;
+	int		 trim;
+	unsigned long	 x;
+	unsigned long	 y;
+	unsigned long	 width;
+	unsigned long	 height;
+};
+
+/* Region to decode, see jpegregion() */
+struct jpeg_region {
+	unsigned long	 x;
+	unsigned long	 y;
+	unsigned long	 width;
+	unsigned long	 height;
+	int		 scale;		/* in eighths */
+	unsigned long	 columns;	/* size of the decoded region */
+	unsigned long	 rows;
+	int		 components;
+	unsigned char	*pixels;
+};
+
+/* Encoder settings, parsed once by newEncoderProfile() */
+struct encoder_profile {
+	char		 format[16];
+	long		 quality;	/* -1 if not set */
+	long		 pngquality;
+	int		 interlace;
+	int		 strip;
+	unsigned long	 nfactors;
+	double		 factors[2];
+	size_t		 noptions;
+	char		 options[];	/* format, key and value triples */
+};
+
+/* One output of encodeMany(), see encodemany() */
+struct encode_job {
+	const struct encoder_profile	*profile;
+	MagickWand			*wand;
+	unsigned char			*blob;
+	size_t				 length;
+	char				*error;
+};
+
+/* Per-frame operations of processFrames(), see processframes() */
+enum {
+	FRAME_BLUR,
+	FRAME_COLORIZE,
+	FRAME_CROP,
+	FRAME_FLIP,
+	FRAME_FLOP,
+	FRAME_GAMMA,
+	FRAME_MODULATE,
+	FRAME_RESIZE,
+	FRAME_ROTATE,
+	FRAME_SAMPLE,
+	FRAME_SCALE,
+	FRAME_SHARPEN,
+	FRAME_THRESHOLD
+};
+
+struct frame_op {
+	int		 op;
+	int		 filter;
+	double		 arg[4];
+	const PixelWand	*color[2];
+};
+
+/* Parameters and result of encodeToSize(), see encodetosize() */
+struct size_search {
+	const char	*format;
+	size_t		 max_bytes;
+	long		 min_quality;
+	long		 max_quality;
+	double		 min_psnr;	/* stop early at this PSNR, 0 if not */
+	unsigned char	*blob;
+	size_t		 length;
+	long		 quality;
+	double		 psnr;
+	char		 error[128];
+};
+
+/* MagickWand userdata, the wand pointer must remain the first member */
+struct magick_wand {
+	MagickWand	*wand;
+	atomic_int	 cancelled;
+	lua_Integer	 token;		/* cancel token, 0 if none */
+	struct magick_wand *nexttoken;	/* list of wands with tokens */
+	uint64_t	 timeout;
+	uint64_t	 deadline;
+	int		 lazy;
+	int		 approximate;	/* allow inexact rewrites */
+	struct frame_op	*pending;	/* recorded by lazy wands */
+	size_t		 npending;
+	size_t		 maxpending;
+};
+
+struct method_stats {
+	const char		*name;
+	const char		*category;
+	atomic_uint_fast64_t	 calls;
+	atomic_uint_fast64_t	 nsec;
+	atomic_uint_fast64_t	 max_nsec;
+	atomic_uint_fast64_t	 pixels_in;
+	atomic_uint_fast64_t	 pixels_out;
+};
+
+/*
+ * Identifies an encoded image in the decoded image cache.  data points to
+ * the encoded bytes, or to the path of a file, and is compared on hits.
+ */
+struct image_key {
+	uint64_t	 hash[2];
+	uint64_t	 length;
+	uint64_t	 dev;
+	uint64_t	 ino;
+	int64_t		 mtime[2];	/* seconds, nanoseconds */
+	int64_t		 ctime[2];
+	unsigned long	 columns;
+	unsigned long	 rows;
+	int		 file;
+	const void	*data;
+	size_t		 datalen;
+};
+
+extern __thread struct magick_wand *running_wand;
+extern atomic_int stats_enabled;
+extern atomic_int tracing;
+extern atomic_int lazy_used;
+
+extern struct magick_wand *pushmagickwand(lua_State *, MagickWand *);
+extern uint64_t nanotime(void);
+extern int interrupted(void);
+extern lua_Integer canceltoken(struct magick_wand *);
+extern void droptoken(struct magick_wand *);
+extern void *checkudata(lua_State *, int, const char *);
+extern int checkoption(lua_State *, int, const char *, const char *const []);
+
+extern struct method_stats *magickstats(const char *);
+extern uint64_t imagepixels(MagickWand *);
+extern void recordcall(struct method_stats *, uint64_t, uint64_t, uint64_t);
+extern void recordformat(MagickWand *, uint64_t, uint64_t);
+extern void hashbytes(const unsigned char *, size_t, uint64_t [2]);
+extern void blobkey(MagickWand *, const void *, size_t, struct image_key *);
+extern int filekey(MagickWand *, const char *, struct image_key *);
+extern int imagecacheenabled(void);
+extern int imagecacheget(MagickWand *, const struct image_key *);
+extern void imagecacheput(MagickWand *, unsigned long,
+    const struct image_key *);
+extern int annotatecached(MagickWand *, DrawingWand *, double, double,
+    double, const char *);
+extern void applyprofile(MagickWand *, const struct encoder_profile *);
+extern void loadmvg(lua_State *, DrawingWand *, const char *);
+extern unsigned int applyframeop(MagickWand *, const struct frame_op *);
+extern struct encoder_profile *checkprofile(lua_State *, int);
+extern const double *checkcoordinates(lua_State *, int, size_t *);
+extern void encodemany(struct magick_wand *, MagickWand *,
+    struct encode_job *, size_t);
+extern int convertlinear(MagickWand *, int);
+extern void decodelinear(float *, const void *, size_t, int, int);
+extern void encodelinear(void *, const float *, size_t, int, int);
+extern void lineartables(void);
+extern int deferrable(const struct frame_op *, unsigned long);
+extern int deferop(struct magick_wand *, const struct frame_op *);
+extern void clearpending(struct magick_wand *);
+extern void flushpending(lua_State *, struct magick_wand *);
+extern int keepspending(const char *);
+extern int exiforientation(MagickWand *);
+extern int encodetosize(struct magick_wand *, MagickWand *,
+    struct size_search *);
+extern int processframes(struct magick_wand *, MagickWand *,
+    const struct frame_op *, size_t, long, char *, size_t);
+extern int fastsample(MagickWand *, unsigned long, unsigned long);
+extern int fastscale(MagickWand *, unsigned long, unsigned long);
+extern int fontmetrics(MagickWand *, DrawingWand *, const char *,
+    double [NMETRICS]);
+extern int isjpeg(const unsigned char *, size_t);
+extern int jpegregion(const unsigned char *, size_t, FILE *,
+    struct jpeg_region *, char *, size_t);
+extern int jpegtransform(const unsigned char *, size_t,
+    const struct jpeg_xform *, unsigned char **, size_t *, char *, size_t);
+extern int orientimage(MagickWand *, int);
+extern int uprightexif(unsigned char *, size_t);
+extern size_t orientpixel(int, unsigned long, unsigned long, unsigned long,
+    unsigned long);
+extern int resample(MagickWand *, unsigned long, unsigned long, FilterTypes,
+    double, int, int);
+extern void resetorientation(MagickWand *);
+extern struct drawing_template *compiletemplate(lua_State *, int);
+extern void replaytemplate(lua_State *, int, int, DrawingWand *);
+extern void tracespan(const char *, const char *, uint64_t, uint64_t,
+    MagickWand *);
+
+extern const char *const *const drawing_options[];
+extern const char *const *const magick_options[];
+
+extern struct luaL_Reg coordinate_buffer_methods[];
+extern struct luaL_Reg drawing_template_methods[];
 extern struct luaL_Reg drawing_wand_methods[];
+extern struct luaL_Reg encoder_profile_methods[];
 extern struct luaL_Reg magick_wand_methods[];
 extern struct luaL_Reg pixel_wand_methods[];
+extern struct luaL_Reg result_cache_methods[];
+extern struct luaL_Reg annotcache_functions[];
+extern struct luaL_Reg coords_functions[];
+extern struct luaL_Reg encoder_functions[];
+extern struct luaL_Reg fontmetrics_functions[];
+extern struct luaL_Reg imagecache_functions[];
+extern struct luaL_Reg jpeg_functions[];
+extern struct luaL_Reg mvg_functions[];
+extern struct luaL_Reg resample_functions[];
+extern struct luaL_Reg resultcache_functions[];
+extern struct luaL_Reg stats_functions[];
+extern struct luaL_Reg template_functions[];
+extern struct luaL_Reg trace_functions[];
 
 #endif /* __LUAGRAPHICSMAGICK_H__ */
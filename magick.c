@@ -27,6 +27,13 @@
 
 /* GraphicsMagick MagickWand for Lua */
 
+#include <sys/stat.h>
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include <lua.h>
 #include <lauxlib.h>
 #include <lualib.h>
@@ -35,15 +42,181 @@
 
 #include "luagraphicsmagick.h"
 
+struct magick_wand *
+pushmagickwand(lua_State *L, MagickWand *wand)
+{
+	struct magick_wand *mw;
+
+	mw = lua_newuserdata(L, sizeof(struct magick_wand));
+	memset(mw, 0, sizeof(struct magick_wand));
+	mw->wand = wand;
+	luaL_setmetatable(L, MAGICK_WAND_METATABLE);
+	return mw;
+}
+
+static const char *const filters[] = {
+	"UndefinedFilter",
+	"PointFilter",
+	"BoxFilter",
+	"TriangleFilter",
+	"HermiteFilter",
+	"HanningFilter",
+	"HammingFilter",
+	"BlackmanFilter",
+	"GaussianFilter",
+	"QuadraticFilter",
+	"CubicFilter",
+	"CatromFilter",
+	"MitchellFilter",
+	"LanczosFilter",
+	"BesselFilter",
+	"SincFilter",
+	NULL
+};
+
+static const char *const frameops[] = {
+	"blur",
+	"colorize",
+	"crop",
+	"flip",
+	"flop",
+	"gamma",
+	"modulate",
+	"resize",
+	"rotate",
+	"sample",
+	"scale",
+	"sharpen",
+	"threshold",
+	NULL
+};
+
+/* Number of numeric arguments of each frame operation */
+static const int frameargs[] = { 2, 0, 4, 0, 0, 1, 3, 2, 1, 2, 2, 2, 1 };
+
+static double
+framearg(lua_State *L, int idx, const struct frame_op *op, int n)
+{
+	double v;
+	int isnum;
+
+	v = lua_tonumberx(L, idx, &isnum);
+	if (!isnum)
+		luaL_error(L, "%s: argument %d must be a number",
+		    frameops[op->op], n);
+	return v;
+}
+
+static int
+frameoption(lua_State *L, int idx, const char *def,
+    const char *const list[])
+{
+	const char *name;
+	lua_Integer v;
+	int n, isint;
+
+	if (lua_type(L, idx) == LUA_TNUMBER) {
+		v = lua_tointegerx(L, idx, &isint);
+		for (n = 0; isint && list[n] != NULL; n++)
+			if (n == v)
+				return n;
+		return luaL_error(L, "invalid frame operation or filter %f",
+		    lua_tonumber(L, idx));
+	}
+	name = lua_isnoneornil(L, idx) ? def : lua_tostring(L, idx);
+	for (n = 0; name != NULL && list[n] != NULL; n++)
+		if (!strcmp(list[n], name))
+			return n;
+	return luaL_error(L, "invalid frame operation or filter '%s'",
+	    name != NULL ? name : "?");
+}
+
+static const PixelWand *
+framecolor(lua_State *L, int idx, const struct frame_op *op, int n)
+{
+	PixelWand **pw;
+
+	pw = luaL_testudata(L, idx, PIXEL_WAND_METATABLE);
+	if (pw == NULL)
+		luaL_error(L, "%s: argument %d must be a PixelWand",
+		    frameops[op->op], n);
+	return *pw;
+}
+
+/*
+ * Parse the arguments of op, which are on the stack from index first on
+ * in the order the method of the same name takes them.
+ */
+static void
+checkframeop(lua_State *L, int first, struct frame_op *op,
+    const char *filter)
+{
+	int k;
+
+	switch (op->op) {
+	case FRAME_COLORIZE:
+		op->color[0] = framecolor(L, first, op, 1);
+		op->color[1] = framecolor(L, first + 1, op, 2);
+		break;
+	case FRAME_ROTATE:
+		op->color[0] = framecolor(L, first, op, 1);
+		op->arg[0] = framearg(L, first + 1, op, 2);
+		break;
+	default:
+		for (k = 0; k < frameargs[op->op]; k++)
+			op->arg[k] = framearg(L, first + k, op, k + 1);
+	}
+	if (op->op == FRAME_RESIZE) {
+		op->filter = frameoption(L, first + 2, filter, filters);
+		op->arg[2] = lua_isnoneornil(L, first + 3) ? 1.0 :
+		    framearg(L, first + 3, op, 4);
+		if (!(op->arg[2] > 0.0 && op->arg[2] <= MAXBLUR))
+			luaL_error(L, "%s: blur out of range",
+			    frameops[op->op]);
+		/* arg[3] is set for resizing in linear light */
+		if (lua_istable(L, first + 4)) {
+			lua_getfield(L, first + 4, "linear");
+			op->arg[3] = lua_toboolean(L, -1);
+			lua_pop(L, 1);
+		}
+	}
+}
+
+/*
+ * Lazy wands record operations instead of running them, they run when a
+ * method needs the pixels.  Returns 1 if the operation was recorded, 0
+ * if the method has to run it at once, after the pending operations.
+ */
+static int
+deferred(lua_State *L, int opcode)
+{
+	struct magick_wand *mw;
+	struct frame_op op;
+
+	mw = lua_touserdata(L, 1);
+	if (!mw->lazy)
+		return 0;
+	memset(&op, 0, sizeof op);
+	op.op = opcode;
+	checkframeop(L, 2, &op, "UndefinedFilter");
+	if (!deferrable(&op, MagickGetNumberImages(mw->wand))) {
+		if (mw->npending)
+			flushpending(L, mw);
+		return 0;
+	}
+	if (deferop(mw, &op))
+		return luaL_error(L, "memory error");
+	lua_pushinteger(L, 1);
+	return 1;
+}
+
 static int
 clone(lua_State *L)
 {
-	MagickWand **mw, **mw2;
+	MagickWand **mw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
-	mw2 = lua_newuserdata(L, sizeof(MagickWand *));
-	*mw2 = CloneMagickWand(*mw);
-	luaL_setmetatable(L, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
+	pushmagickwand(L, CloneMagickWand(*mw));
 	return 1;
 }
 
@@ -52,7 +225,7 @@ adaptiveThresholdImage(lua_State *L)
 {
 	MagickWand **mw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
 
 	lua_pushinteger(L, MagickAdaptiveThresholdImage(*mw,
 	    luaL_checkinteger(L, 2), luaL_checkinteger(L, 3),
@@ -65,8 +238,8 @@ addImage(lua_State *L)
 {
 	MagickWand **mw, **add_wand;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
-	add_wand = luaL_checkudata(L, 2, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
+	add_wand = checkudata(L, 2, MAGICK_WAND_METATABLE);
 	lua_pushinteger(L, MagickAddImage(*mw, *add_wand));
 	return 1;
 }
@@ -86,9 +259,9 @@ addNoiseImage(lua_State *L)
 {
 	MagickWand **mw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
 	lua_pushinteger(L, MagickAddNoiseImage(*mw,
-	    luaL_checkoption(L, 2, "UniformNoise", noises)));
+	    checkoption(L, 2, "UniformNoise", noises)));
 	return 1;
 }
 
@@ -98,8 +271,8 @@ affineTransformImage(lua_State *L)
 	MagickWand **mw;
 	DrawingWand **dw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
-	dw = luaL_checkudata(L, 2, DRAWING_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
+	dw = checkudata(L, 2, DRAWING_WAND_METATABLE);
 	lua_pushinteger(L, MagickAffineTransformImage(*mw, *dw));
 	return 1;
 }
@@ -109,13 +282,21 @@ annotateImage(lua_State *L)
 {
 	DrawingWand **dw;
 	MagickWand **mw;
+	const char *text;
+	double x, y, angle;
+	int status;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
-	dw = luaL_checkudata(L, 2, DRAWING_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
+	dw = checkudata(L, 2, DRAWING_WAND_METATABLE);
+	x = luaL_checknumber(L, 3);
+	y = luaL_checknumber(L, 4);
+	angle = luaL_checknumber(L, 5);
+	text = luaL_checkstring(L, 6);
 
-	lua_pushinteger(L, MagickAnnotateImage(*mw, *dw, luaL_checknumber(L, 3),
-	    luaL_checknumber(L, 4), luaL_checknumber(L, 5),
-	    luaL_checkstring(L, 6)));
+	status = annotatecached(*mw, *dw, x, y, angle, text);
+	if (status == -1)
+		status = MagickAnnotateImage(*mw, *dw, x, y, angle, text);
+	lua_pushinteger(L, status);
 	return 1;
 }
 
@@ -124,7 +305,7 @@ animateImages(lua_State *L)
 {
 	MagickWand **mw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
 
 	lua_pushinteger(L, MagickAnimateImages(*mw, luaL_checkstring(L, 2)));
 	return 1;
@@ -133,14 +314,12 @@ animateImages(lua_State *L)
 static int
 appendImages(lua_State *L)
 {
-	MagickWand **mw, **mw2;
+	MagickWand **mw;
 	unsigned int stack;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
 	stack = luaL_checkinteger(L, 2);
-	mw2 = lua_newuserdata(L, sizeof(MagickWand *));
-	*mw2 = MagickAppendImages(*mw, stack);
-	luaL_setmetatable(L, MAGICK_WAND_METATABLE);
+	pushmagickwand(L, MagickAppendImages(*mw, stack));
 
 	return 1;
 }
@@ -148,12 +327,10 @@ appendImages(lua_State *L)
 static int
 averageImages(lua_State *L)
 {
-	MagickWand **mw, **mw2;
+	MagickWand **mw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
-	mw2 = lua_newuserdata(L, sizeof(MagickWand *));
-	*mw2 = MagickAverageImages(*mw);
-	luaL_setmetatable(L, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
+	pushmagickwand(L, MagickAverageImages(*mw));
 	return 1;
 }
 
@@ -162,7 +339,7 @@ blackThresholdImage(lua_State *L)
 {
 	MagickWand **mw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
 
 	lua_pushinteger(L, MagickThresholdImage(*mw, luaL_checknumber(L, 2)));
 	return 1;
@@ -173,7 +350,9 @@ blurImage(lua_State *L)
 {
 	MagickWand **mw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
+	if (deferred(L, FRAME_BLUR))
+		return 1;
 
 	lua_pushinteger(L, MagickBlurImage(*mw, luaL_checknumber(L, 2),
 	    luaL_checknumber(L, 3)));
@@ -186,8 +365,8 @@ borderImage(lua_State *L)
 	MagickWand **mw;
 	PixelWand **pw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
-	pw = luaL_checkudata(L, 2, PIXEL_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
+	pw = checkudata(L, 2, PIXEL_WAND_METATABLE);
 
 	lua_pushinteger(L, MagickBorderImage(*mw, *pw, luaL_checkinteger(L, 3),
 	    luaL_checkinteger(L, 4)));
@@ -199,7 +378,7 @@ cdlImage(lua_State *L)
 {
 	MagickWand **mw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
 
 	lua_pushboolean(L, MagickCdlImage(*mw, luaL_checkstring(L, 2)));
 	return 1;
@@ -210,19 +389,47 @@ charcoalImage(lua_State *L)
 {
 	MagickWand **mw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
 
 	lua_pushinteger(L, MagickCharcoalImage(*mw, luaL_checknumber(L, 2),
 	    luaL_checknumber(L, 3)));
 	return 1;
 }
 
+/*
+ * wand:cancel() makes the running and all following operations on the
+ * wand fail until wand:cancel(false) clears the flag again.  A Lua state
+ * runs one method at a time, so a running operation can only be stopped
+ * from another state, with graphicsmagick.cancel(wand:cancelToken()).
+ */
+static int
+cancel(lua_State *L)
+{
+	struct magick_wand *mw;
+
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
+	atomic_store(&mw->cancelled, lua_isnoneornil(L, 2) ||
+	    lua_toboolean(L, 2));
+	return 0;
+}
+
+/* wand:cancelToken() returns an integer that names the wand to cancel() */
+static int
+cancelToken(lua_State *L)
+{
+	struct magick_wand *mw;
+
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
+	lua_pushinteger(L, canceltoken(mw));
+	return 1;
+}
+
 static int
 chopImage(lua_State *L)
 {
 	MagickWand **mw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
 
 	lua_pushinteger(L, MagickChopImage(*mw, luaL_checkinteger(L, 2),
 	    luaL_checkinteger(L, 3), luaL_checkinteger(L, 4),
@@ -235,7 +442,7 @@ clipImage(lua_State *L)
 {
 	MagickWand **mw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
 
 	lua_pushinteger(L, MagickClipImage(*mw));
 	return 1;
@@ -246,7 +453,7 @@ clipPathImage(lua_State *L)
 {
 	MagickWand **mw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
 
 	lua_pushinteger(L, MagickClipPathImage(*mw, luaL_checkstring(L, 2),
 	    luaL_checkinteger(L, 3)));
@@ -256,12 +463,10 @@ clipPathImage(lua_State *L)
 static int
 coalesceImages(lua_State *L)
 {
-	MagickWand **mw, **mw2;
+	MagickWand **mw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
-	mw2 = lua_newuserdata(L, sizeof(MagickWand *));
-	*mw2 = MagickCoalesceImages(*mw);
-	luaL_setmetatable(L, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
+	pushmagickwand(L, MagickCoalesceImages(*mw));
 	return 1;
 }
 
@@ -271,9 +476,9 @@ colorFloodfillImage(lua_State *L)
 	MagickWand **mw;
 	PixelWand **fill, **border;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
-	fill = luaL_checkudata(L, 2, PIXEL_WAND_METATABLE);
-	border = luaL_checkudata(L, 4, PIXEL_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
+	fill = checkudata(L, 2, PIXEL_WAND_METATABLE);
+	border = checkudata(L, 4, PIXEL_WAND_METATABLE);
 	lua_pushinteger(L, MagickColorFloodfillImage(*mw, *fill,
 	    luaL_checknumber(L, 3), *border,  luaL_checkinteger(L, 5),
 	    luaL_checkinteger(L, 6)));
@@ -286,9 +491,11 @@ colorizeImage(lua_State *L)
 	MagickWand **wand;
 	PixelWand **colorize, **opacity;
 
-	wand = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
-	colorize = luaL_checkudata(L, 2, PIXEL_WAND_METATABLE);
-	opacity = luaL_checkudata(L, 3, PIXEL_WAND_METATABLE);
+	wand = checkudata(L, 1, MAGICK_WAND_METATABLE);
+	if (deferred(L, FRAME_COLORIZE))
+		return 1;
+	colorize = checkudata(L, 2, PIXEL_WAND_METATABLE);
+	opacity = checkudata(L, 3, PIXEL_WAND_METATABLE);
 	lua_pushinteger(L, MagickColorizeImage(*wand, *colorize, *opacity));
 	return 1;
 }
@@ -298,7 +505,7 @@ commentImage(lua_State *L)
 {
 	MagickWand **wand;
 
-	wand = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	wand = checkudata(L, 1, MAGICK_WAND_METATABLE);
 	lua_pushinteger(L, MagickCommentImage(*wand, luaL_checkstring(L, 2)));
 	return 1;
 }
@@ -308,7 +515,7 @@ contrastImage(lua_State *L)
 {
 	MagickWand **wand;
 
-	wand = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	wand = checkudata(L, 1, MAGICK_WAND_METATABLE);
 	lua_pushinteger(L, MagickContrastImage(*wand, luaL_checkinteger(L, 2)));
 	return 1;
 }
@@ -318,7 +525,9 @@ cropImage(lua_State *L)
 {
 	MagickWand **wand;
 
-	wand = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	wand = checkudata(L, 1, MAGICK_WAND_METATABLE);
+	if (deferred(L, FRAME_CROP))
+		return 1;
 	lua_pushinteger(L, MagickCropImage(*wand, luaL_checkinteger(L, 2),
 	    luaL_checkinteger(L, 3), luaL_checkinteger(L, 4),
 	    luaL_checkinteger(L, 5)));
@@ -330,7 +539,7 @@ cycleColormapImage(lua_State *L)
 {
 	MagickWand **wand;
 
-	wand = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	wand = checkudata(L, 1, MAGICK_WAND_METATABLE);
 	lua_pushinteger(L, MagickCycleColormapImage(*wand,
 	    luaL_checkinteger(L, 2)));
 	return 1;
@@ -339,12 +548,10 @@ cycleColormapImage(lua_State *L)
 static int
 deconstructImages(lua_State *L)
 {
-	MagickWand **mw, **mw2;
+	MagickWand **mw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
-	mw2 = lua_newuserdata(L, sizeof(MagickWand *));
-	*mw2 = MagickDeconstructImages(*mw);
-	luaL_setmetatable(L, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
+	pushmagickwand(L, MagickDeconstructImages(*mw));
 	return 1;
 }
 
@@ -354,7 +561,7 @@ describeImage(lua_State *L)
 	MagickWand **mw;
 	char *text;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
 	text = MagickDescribeImage(*mw);
 	lua_pushstring(L, text);
 	free(text);
@@ -366,7 +573,7 @@ despeckleImage(lua_State *L)
 {
 	MagickWand **mw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
 	lua_pushinteger(L, MagickDespeckleImage(*mw));
 	return 1;
 }
@@ -376,7 +583,7 @@ displayImage(lua_State *L)
 {
 	MagickWand **mw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
 	lua_pushinteger(L, MagickDisplayImage(*mw, luaL_checkstring(L, 2)));
 	return 1;
 }
@@ -386,19 +593,35 @@ displayImages(lua_State *L)
 {
 	MagickWand **mw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
 	lua_pushinteger(L, MagickDisplayImages(*mw, luaL_checkstring(L, 2)));
 	return 1;
 }
 
+/* drawImage(drawingWand) or drawImage(template, params) */
 static int
 drawImage(lua_State *L)
 {
 	DrawingWand **dw;
 	MagickWand **mw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
-	dw = luaL_checkudata(L, 2, DRAWING_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
+
+	if (luaL_testudata(L, 2, DRAWING_TEMPLATE_METATABLE)) {
+		/*
+		 * The scratch wand is left to __gc only if replay fails,
+		 * otherwise it is destroyed at once.
+		 */
+		dw = lua_newuserdata(L, sizeof(DrawingWand *));
+		*dw = NewDrawingWand();
+		luaL_setmetatable(L, DRAWING_WAND_METATABLE);
+		replaytemplate(L, 2, 3, *dw);
+		lua_pushinteger(L, MagickDrawImage(*mw, *dw));
+		DestroyDrawingWand(*dw);
+		*dw = NULL;
+		return 1;
+	}
+	dw = checkudata(L, 2, DRAWING_WAND_METATABLE);
 
 	lua_pushinteger(L, MagickDrawImage(*mw, *dw));
 	return 1;
@@ -409,7 +632,7 @@ edgeImage(lua_State *L)
 {
 	MagickWand **mw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
 
 	lua_pushinteger(L, MagickEdgeImage(*mw, luaL_checknumber(L, 2)));
 	return 1;
@@ -420,19 +643,140 @@ embossImage(lua_State *L)
 {
 	MagickWand **mw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
 
 	lua_pushinteger(L, MagickEmbossImage(*mw, luaL_checknumber(L, 2),
 	    luaL_checknumber(L, 3)));
 	return 1;
 }
 
+/*
+ * encodeMany(profiles) encodes the images once per encoder profile or
+ * option table, each on its own thread, and returns the blobs in the
+ * order of the profiles.  If an encoder fails, nil and the error of the
+ * first failing profile are returned.
+ */
+static int
+encodeMany(lua_State *L)
+{
+	struct magick_wand *mw;
+	struct encode_job *jobs;
+	size_t n, njobs;
+	int failed = 0;
+
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	njobs = lua_rawlen(L, 2);
+	luaL_argcheck(L, njobs > 0, 2, "no encoder profiles");
+
+	jobs = lua_newuserdata(L, njobs * sizeof(struct encode_job));
+	memset(jobs, 0, njobs * sizeof(struct encode_job));
+	for (n = 0; n < njobs; n++) {
+		luaL_checkstack(L, 2, NULL);
+		lua_rawgeti(L, 2, n + 1);
+		jobs[n].profile = checkprofile(L, -1);
+	}
+
+	encodemany(mw, mw->wand, jobs, njobs);
+
+	lua_createtable(L, njobs, 0);
+	for (n = 0; n < njobs; n++) {
+		if (jobs[n].blob != NULL) {
+			if (!failed) {
+				lua_pushlstring(L, (const char *)jobs[n].blob,
+				    jobs[n].length);
+				lua_rawseti(L, -2, n + 1);
+			}
+			MagickRelinquishMemory(jobs[n].blob);
+		} else if (!failed) {
+			lua_pushnil(L);
+			lua_pushfstring(L, "profile %d: %s", (int)n + 1,
+			    jobs[n].error != NULL ? jobs[n].error :
+			    "memory error");
+			failed = 1;
+		}
+		if (jobs[n].error != NULL)
+			MagickRelinquishMemory(jobs[n].error);
+	}
+	return failed ? 2 : 1;
+}
+
+/*
+ * encodeToSize(format, maxBytes[, options]) returns the highest quality
+ * encoding that fits into maxBytes and its quality.  Options are the
+ * quality range, as {minQ, maxQ} or minQ and maxQ fields, minPSNR to
+ * accept the first fit that reaches that PSNR and an encoder profile as
+ * profile, its quality is ignored.  PNG and MNG are not supported.
+ */
+static int
+encodeToSize(lua_State *L)
+{
+	struct magick_wand *mw;
+	struct encoder_profile *p = NULL;
+	struct size_search s;
+	MagickWand *wand;
+	lua_Integer max;
+	int status;
+
+	memset(&s, 0, sizeof s);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
+	s.format = luaL_checkstring(L, 2);
+	max = luaL_checkinteger(L, 3);
+	luaL_argcheck(L, max > 0, 3, "size must be positive");
+	s.max_bytes = max;
+	s.min_quality = 1;
+	s.max_quality = 100;
+
+	if (!lua_isnoneornil(L, 4)) {
+		luaL_checktype(L, 4, LUA_TTABLE);
+		if (lua_rawgeti(L, 4, 1) != LUA_TNIL)
+			s.min_quality = luaL_checkinteger(L, -1);
+		if (lua_rawgeti(L, 4, 2) != LUA_TNIL)
+			s.max_quality = luaL_checkinteger(L, -1);
+		if (lua_getfield(L, 4, "minQ") != LUA_TNIL)
+			s.min_quality = luaL_checkinteger(L, -1);
+		if (lua_getfield(L, 4, "maxQ") != LUA_TNIL)
+			s.max_quality = luaL_checkinteger(L, -1);
+		if (lua_getfield(L, 4, "minPSNR") != LUA_TNIL)
+			s.min_psnr = luaL_checknumber(L, -1);
+		if (lua_getfield(L, 4, "profile") != LUA_TNIL)
+			p = checkprofile(L, -1);
+	}
+	luaL_argcheck(L, s.min_quality >= 0 && s.max_quality <= 100 &&
+	    s.min_quality <= s.max_quality, 4, "invalid quality range");
+
+	if (p != NULL) {
+		if ((wand = CloneMagickWand(mw->wand)) == NULL)
+			return luaL_error(L, "memory error");
+		applyprofile(wand, p);
+	} else
+		wand = mw->wand;
+	status = encodetosize(mw, wand, &s);
+	if (wand != mw->wand)
+		DestroyMagickWand(wand);
+
+	if (status) {
+		lua_pushnil(L);
+		if (s.error[0] != '\0')
+			lua_pushstring(L, s.error);
+		else
+			lua_pushfstring(L, "no quality from %d to %d fits "
+			    "into %d bytes", (int)s.min_quality,
+			    (int)s.max_quality, (int)max);
+		return 2;
+	}
+	lua_pushlstring(L, (const char *)s.blob, s.length);
+	MagickRelinquishMemory(s.blob);
+	lua_pushinteger(L, s.quality);
+	return 2;
+}
+
 static int
 enhanceImage(lua_State *L)
 {
 	MagickWand **mw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
 
 	lua_pushinteger(L, MagickEnhanceImage(*mw));
 	return 1;
@@ -443,7 +787,7 @@ equalizeImage(lua_State *L)
 {
 	MagickWand **mw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
 
 	lua_pushinteger(L, MagickEqualizeImage(*mw));
 	return 1;
@@ -454,7 +798,7 @@ extentImage(lua_State *L)
 {
 	MagickWand **mw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
 	lua_pushinteger(L, MagickExtentImage(*mw, luaL_checkinteger(L, 2),
 	    luaL_checkinteger(L, 3), luaL_checkinteger(L, 4),
 	    luaL_checkinteger(L, 5)));
@@ -464,12 +808,10 @@ extentImage(lua_State *L)
 static int
 flattenImages(lua_State *L)
 {
-	MagickWand **mw, **mw2;
+	MagickWand **mw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
-	mw2 = lua_newuserdata(L, sizeof(MagickWand *));
-	*mw2 = MagickFlattenImages(*mw);
-	luaL_setmetatable(L, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
+	pushmagickwand(L, MagickFlattenImages(*mw));
 	return 1;
 }
 
@@ -478,7 +820,9 @@ flipImage(lua_State *L)
 {
 	MagickWand **mw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
+	if (deferred(L, FRAME_FLIP))
+		return 1;
 
 	lua_pushinteger(L, MagickFlipImage(*mw));
 	return 1;
@@ -489,7 +833,9 @@ flopImage(lua_State *L)
 {
 	MagickWand **mw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
+	if (deferred(L, FRAME_FLOP))
+		return 1;
 
 	lua_pushinteger(L, MagickFlopImage(*mw));
 	return 1;
@@ -501,8 +847,8 @@ frameImage(lua_State *L)
 	MagickWand **mw;
 	PixelWand **matte_color;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
-	matte_color = luaL_checkudata(L, 2, PIXEL_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
+	matte_color = checkudata(L, 2, PIXEL_WAND_METATABLE);
 
 	lua_pushinteger(L, MagickFrameImage(*mw, *matte_color,
 	    luaL_checkinteger(L, 3), luaL_checkinteger(L, 4),
@@ -513,12 +859,10 @@ frameImage(lua_State *L)
 static int
 fxImage(lua_State *L)
 {
-	MagickWand **mw, **mw2;
+	MagickWand **mw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
-	mw2 = lua_newuserdata(L, sizeof(MagickWand *));
-	*mw2 = MagickFxImage(*mw, luaL_checkstring(L, 2));
-	luaL_setmetatable(L, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
+	pushmagickwand(L, MagickFxImage(*mw, luaL_checkstring(L, 2)));
 	return 1;
 }
 
@@ -527,7 +871,9 @@ gammaImage(lua_State *L)
 {
 	MagickWand **mw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
+	if (deferred(L, FRAME_GAMMA))
+		return 1;
 	lua_pushinteger(L, MagickGammaImage(*mw, luaL_checknumber(L, 2)));
 	return 1;
 }
@@ -553,9 +899,9 @@ gammaImageChannel(lua_State *L)
 {
 	MagickWand **mw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
 	lua_pushinteger(L, MagickGammaImageChannel(*mw,
-	    luaL_checkoption(L, 2, "UndefinedChannel", channels),
+	    checkoption(L, 2, "UndefinedChannel", channels),
 	    luaL_checknumber(L, 3)));
 	return 1;
 }
@@ -565,7 +911,7 @@ getConfigureInfo(lua_State *L)
 {
 	MagickWand **mw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
 	lua_pushstring(L, MagickGetConfigureInfo(*mw, luaL_checkstring(L, 2)));
 	return 1;
 }
@@ -576,7 +922,7 @@ getException(lua_State *L)
 	MagickWand **mw;
 	ExceptionType severity;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
 	lua_pushstring(L, MagickGetException(*mw, &severity));
 	lua_pushinteger(L, severity);
 	return 2;
@@ -587,7 +933,7 @@ getFilename(lua_State *L)
 {
 	MagickWand **mw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
 	lua_pushstring(L, MagickGetFilename(*mw));
 	return 1;
 }
@@ -595,12 +941,10 @@ getFilename(lua_State *L)
 static int
 getImage(lua_State *L)
 {
-	MagickWand **mw, **mw2;
+	MagickWand **mw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
-	mw2 = lua_newuserdata(L, sizeof(MagickWand *));
-	*mw2 = MagickGetImage(*mw);
-	luaL_setmetatable(L, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
+	pushmagickwand(L, MagickGetImage(*mw));
 	return 1;
 }
 
@@ -609,7 +953,7 @@ getImageAttribute(lua_State *L)
 {
 	MagickWand **mw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
 	lua_pushstring(L, MagickGetImageAttribute(*mw, luaL_checkstring(L, 2)));
 	return 1;
 }
@@ -620,8 +964,8 @@ getImageBackgroundColor(lua_State *L)
 	MagickWand **mw;
 	PixelWand **pw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
-	pw = luaL_checkudata(L, 2, PIXEL_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
+	pw = checkudata(L, 2, PIXEL_WAND_METATABLE);
 	lua_pushinteger(L, MagickGetImageBackgroundColor(*mw, *pw));
 	return 1;
 }
@@ -633,8 +977,8 @@ getImageBluePrimary(lua_State *L)
 	PixelWand **pw;
 	double x, y;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
-	pw = luaL_checkudata(L, 2, PIXEL_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
+	pw = checkudata(L, 2, PIXEL_WAND_METATABLE);
 	lua_pushinteger(L, MagickGetImageBluePrimary(*mw, &x, &y));
 	lua_pushnumber(L, x);
 	lua_pushnumber(L, y);
@@ -647,8 +991,8 @@ getImageBorderColor(lua_State *L)
 	MagickWand **mw;
 	PixelWand **pw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
-	pw = luaL_checkudata(L, 2, PIXEL_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
+	pw = checkudata(L, 2, PIXEL_WAND_METATABLE);
 	lua_pushinteger(L, MagickGetImageBorderColor(*mw, *pw));
 	return 1;
 }
@@ -660,7 +1004,7 @@ getImageBoundingBox(lua_State *L)
 	unsigned long width, height;
 	long x, y;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
 	lua_pushinteger(L, MagickGetImageBoundingBox(*mw,
 	    luaL_checknumber(L, 2), &width, &height, &x, &y));
 	lua_pushinteger(L, width);
@@ -675,9 +1019,9 @@ getImageChannelDepth(lua_State *L)
 {
 	MagickWand **mw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
 	lua_pushinteger(L, MagickGetImageChannelDepth(*mw,
-	    luaL_checkoption(L, 2, "UndefinedChannel", channels)));
+	    checkoption(L, 2, "UndefinedChannel", channels)));
 	return 1;
 }
 
@@ -687,9 +1031,9 @@ getImageChannelExtrema(lua_State *L)
 	MagickWand **mw;
 	unsigned long minima, maxima;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
 	lua_pushinteger(L, MagickGetImageChannelExtrema(*mw,
-	    luaL_checkoption(L, 2, "UndefinedChannel", channels), &minima,
+	    checkoption(L, 2, "UndefinedChannel", channels), &minima,
 	    &maxima));
 	lua_pushinteger(L, minima);
 	lua_pushinteger(L, maxima);
@@ -702,9 +1046,9 @@ getImageChannelMean(lua_State *L)
 	MagickWand **mw;
 	double mean, standard_deviation;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
 	lua_pushinteger(L, MagickGetImageChannelMean(*mw,
-	    luaL_checkoption(L, 2, "UndefinedChannel", channels), &mean,
+	    checkoption(L, 2, "UndefinedChannel", channels), &mean,
 	    &standard_deviation));
 	lua_pushnumber(L, mean);
 	lua_pushnumber(L, standard_deviation);
@@ -717,8 +1061,8 @@ getImageColormapColor(lua_State *L)
 	MagickWand **mw;
 	PixelWand **pw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
-	pw = luaL_checkudata(L, 3, PIXEL_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
+	pw = checkudata(L, 3, PIXEL_WAND_METATABLE);
 	lua_pushinteger(L, MagickGetImageColormapColor(*mw,
 	    luaL_checkinteger(L, 2), *pw));
 	return 1;
@@ -729,7 +1073,7 @@ getImageColors(lua_State *L)
 {
 	MagickWand **mw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
 	lua_pushinteger(L, MagickGetImageColors(*mw));
 	return 1;
 }
@@ -763,11 +1107,59 @@ getImageColorspace(lua_State *L)
 {
 	MagickWand **mw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
 	lua_pushstring(L, color_spaces[MagickGetImageColorspace(*mw)]);
 	return 1;
 }
 
+/*
+ * transformColorspace(colorspace) converts the pixels of the current
+ * image to colorspace using the table driven conversions of
+ * GraphicsMagick.  sRGB and linear light are converted by toSRGB() and
+ * toLinear().
+ */
+static int
+transformColorspace(lua_State *L)
+{
+	MagickWand **mw;
+
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
+	lua_pushinteger(L, MagickSetImageColorspace(*mw,
+	    checkoption(L, 2, NULL, color_spaces)));
+	return 1;
+}
+
+/*
+ * toLinear() converts to linear light, which needs 16 bit samples to
+ * avoid banding in the dark tones.  A GraphicsMagick built with a quantum
+ * depth of 8 keeps only 8 bits in memory, whatever the image depth, so
+ * the conversion is refused there.
+ */
+static int
+toLinear(lua_State *L)
+{
+	MagickWand **mw;
+
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
+	if (QuantumDepth < 16) {
+		lua_pushinteger(L, 0);
+		lua_pushliteral(L, "linear light needs a quantum depth of 16");
+		return 2;
+	}
+	lua_pushinteger(L, convertlinear(*mw, 1));
+	return 1;
+}
+
+static int
+toSRGB(lua_State *L)
+{
+	MagickWand **mw;
+
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
+	lua_pushinteger(L, convertlinear(*mw, 0));
+	return 1;
+}
+
 const char *const compressions[] = {
 	"UndefinedCompression",
 	"NoCompression",
@@ -787,7 +1179,7 @@ getImageCompression(lua_State *L)
 {
 	MagickWand **mw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
 	lua_pushstring(L, compressions[MagickGetImageCompression(*mw)]);
 	return 1;
 }
@@ -797,7 +1189,7 @@ getImageDelay(lua_State *L)
 {
 	MagickWand **mw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
 	lua_pushinteger(L, MagickGetImageDelay(*mw));
 	return 1;
 }
@@ -807,7 +1199,7 @@ getImageDepth(lua_State *L)
 {
 	MagickWand **mw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
 	lua_pushinteger(L, MagickGetImageDepth(*mw));
 	return 1;
 }
@@ -818,7 +1210,7 @@ getImageExtrema(lua_State *L)
 	MagickWand **mw;
 	unsigned long minima, maxima;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
 	lua_pushinteger(L, MagickGetImageExtrema(*mw, &minima, &maxima));
 	lua_pushinteger(L, minima);
 	lua_pushinteger(L, maxima);
@@ -830,7 +1222,7 @@ getImageFilename(lua_State *L)
 {
 	MagickWand **mw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
 	lua_pushstring(L, MagickGetImageFilename(*mw));
 	return 1;
 }
@@ -840,7 +1232,7 @@ getImageFormat(lua_State *L)
 {
 	MagickWand **mw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
 	lua_pushstring(L, MagickGetImageFormat(*mw));
 	return 1;
 }
@@ -850,7 +1242,7 @@ getImageFuzz(lua_State *L)
 {
 	MagickWand **mw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
 	lua_pushnumber(L, MagickGetImageFuzz(*mw));
 	return 1;
 }
@@ -860,7 +1252,7 @@ getImageGamma(lua_State *L)
 {
 	MagickWand **mw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
 	lua_pushnumber(L, MagickGetImageGamma(*mw));
 	return 1;
 }
@@ -887,7 +1279,7 @@ getImageGravity(lua_State *L)
 {
 	MagickWand **mw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
 	lua_pushstring(L, gravity[MagickGetImageGravity(*mw)]);
 	return 1;
 }
@@ -900,8 +1292,8 @@ getImageGreenPrimary(lua_State *L)
 	PixelWand **pw;
 	double x, y;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
-	pw = luaL_checkudata(L, 2, PIXEL_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
+	pw = checkudata(L, 2, PIXEL_WAND_METATABLE);
 	lua_pushinteger(L, MagickGetImageGreenPrimary(*mw, &x, &y));
 	lua_pushnumber(L, x);
 	lua_pushnumber(L, y);
@@ -913,7 +1305,7 @@ setImageFormat(lua_State *L)
 {
 	MagickWand **mw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
 	lua_pushinteger(L, MagickSetImageFormat(*mw, luaL_checkstring(L, 2)));
 	return 1;
 }
@@ -923,7 +1315,7 @@ getImageWidth(lua_State *L)
 {
 	MagickWand **mw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
 	lua_pushinteger(L, MagickGetImageWidth(*mw));
 	return 1;
 }
@@ -933,7 +1325,7 @@ getImageHeight(lua_State *L)
 {
 	MagickWand **mw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
 	lua_pushinteger(L, MagickGetImageHeight(*mw));
 	return 1;
 }
@@ -943,7 +1335,7 @@ getImageIndex(lua_State *L)
 {
 	MagickWand **mw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
 	lua_pushinteger(L, MagickGetImageIndex(*mw));
 	return 1;
 }
@@ -962,7 +1354,7 @@ getImageInterlaceScheme(lua_State *L)
 {
 	MagickWand **mw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
 	lua_pushstring(L, interlaces[MagickGetImageInterlaceScheme(*mw)]);
 	return 1;
 }
@@ -972,7 +1364,7 @@ getImageIterations(lua_State *L)
 {
 	MagickWand **mw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
 	lua_pushinteger(L, MagickGetImageIterations(*mw));
 	return 1;
 }
@@ -983,8 +1375,8 @@ getImageMatteColor(lua_State *L)
 	MagickWand **mw;
 	PixelWand **pw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
-	pw = luaL_checkudata(L, 2, PIXEL_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
+	pw = checkudata(L, 2, PIXEL_WAND_METATABLE);
 	lua_pushinteger(L, MagickGetImageMatteColor(*mw, *pw));
 	return 1;
 }
@@ -1008,7 +1400,7 @@ getImageOrientation(lua_State *L)
 {
 	MagickWand **mw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
 	lua_pushstring(L, orientations[MagickGetImageOrientation(*mw)]);
 	return 1;
 }
@@ -1021,7 +1413,7 @@ getImagePage(lua_State *L)
 	unsigned long width, height;
 	long x, y;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
 	lua_pushinteger(L, MagickGetImagePage(*mw, &width, &height, &x, &y));
 	lua_pushinteger(L, width);
 	lua_pushinteger(L, height);
@@ -1037,8 +1429,8 @@ getImageRedPrimary(lua_State *L)
 	PixelWand **pw;
 	double x, y;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
-	pw = luaL_checkudata(L, 2, PIXEL_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
+	pw = checkudata(L, 2, PIXEL_WAND_METATABLE);
 	lua_pushinteger(L, MagickGetImageRedPrimary(*mw, &x, &y));
 	lua_pushnumber(L, x);
 	lua_pushnumber(L, y);
@@ -1059,7 +1451,7 @@ getImageRenderingIntent(lua_State *L)
 {
 	MagickWand **mw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
 	lua_pushstring(L, intents[MagickGetImageRenderingIntent(*mw)]);
 	return 1;
 }
@@ -1070,7 +1462,7 @@ getImageResolution(lua_State *L)
 	MagickWand **mw;
 	double x, y;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
 	lua_pushinteger(L, MagickGetImageResolution(*mw, &x, &y));
 	lua_pushnumber(L, x);
 	lua_pushnumber(L, y);
@@ -1083,67 +1475,626 @@ getImageScene(lua_State *L)
 	MagickWand **mw;
 	double x, y;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
 	lua_pushinteger(L, MagickGetImageScene(*mw));
 	return 1;
 }
 
+static int
+metricserror(lua_State *L, MagickWand *wand)
+{
+	ExceptionType severity;
+	char *description;
+
+	description = MagickGetException(wand, &severity);
+	lua_pushnil(L);
+	if (description != NULL && *description != '\0')
+		lua_pushstring(L, description);
+	else
+		lua_pushliteral(L, "can not measure text");
+	if (description != NULL)
+		MagickRelinquishMemory(description);
+	return 2;
+}
+
+/*
+ * Returns a table with width, height, ascent, descent and advance of text,
+ * or nil and an error message.  With multiline set, text is measured line
+ * by line.
+ */
+static int
+queryFontMetrics(lua_State *L)
+{
+	MagickWand **mw;
+	DrawingWand **dw;
+	const char *text, *nl;
+	double m[NMETRICS], width = 0, height = 0, ascent = 0, descent = 0;
+	double advance = 0;
+	int line;
+
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
+	dw = checkudata(L, 2, DRAWING_WAND_METATABLE);
+	text = luaL_checkstring(L, 3);
+
+	for (line = 0; ; line++) {
+		nl = lua_toboolean(L, 4) ? strchr(text, '\n') : NULL;
+		if (nl != NULL) {
+			lua_pushlstring(L, text, nl - text);
+			if (fontmetrics(*mw, *dw, lua_tostring(L, -1), m))
+				return metricserror(L, *mw);
+			lua_pop(L, 1);
+		} else if (fontmetrics(*mw, *dw, text, m))
+			return metricserror(L, *mw);
+
+		if (line == 0)
+			ascent = m[2];
+		descent = m[3];
+		if (m[4] > width)
+			width = m[4];
+		if (m[6] > advance)
+			advance = m[6];
+		height += m[5];
+		if (nl == NULL)
+			break;
+		text = nl + 1;
+	}
+
+	lua_createtable(L, 0, 7);
+	lua_pushnumber(L, width);
+	lua_setfield(L, -2, "width");
+	lua_pushnumber(L, height);
+	lua_setfield(L, -2, "height");
+	lua_pushnumber(L, ascent);
+	lua_setfield(L, -2, "ascent");
+	lua_pushnumber(L, descent);
+	lua_setfield(L, -2, "descent");
+	lua_pushnumber(L, advance);
+	lua_setfield(L, -2, "advance");
+	lua_pushnumber(L, m[0]);
+	lua_setfield(L, -2, "characterWidth");
+	lua_pushnumber(L, m[1]);
+	lua_setfield(L, -2, "characterHeight");
+	return 1;
+}
+
 static int
 readImage(lua_State *L)
 {
 	MagickWand **mw;
+	struct image_key key;
+	const char *path;
+	unsigned long first;
+	unsigned int status;
+	int cached;
+
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
+	path = luaL_checkstring(L, 2);
+
+	cached = imagecacheenabled() && filekey(*mw, path, &key) == 0;
+	if (cached && imagecacheget(*mw, &key)) {
+		recordformat(*mw, key.length, 0);
+		lua_pushinteger(L, 1);
+		return 1;
+	}
+
+	first = MagickGetNumberImages(*mw);
+	status = MagickReadImage(*mw, path);
+	if (status) {
+		recordformat(*mw, MagickGetImageSize(*mw), 0);
+		if (cached)
+			imagecacheput(*mw, first, &key);
+	}
+	lua_pushinteger(L, status);
+	return 1;
+}
+
+/* Decode a JPEG region into a new image appended to wand */
+static int
+readjpegregion(MagickWand *wand, const unsigned char *blob, size_t len,
+    FILE *fp, struct jpeg_region *r, char *errmsg, size_t errlen)
+{
+	MagickWand *image;
+	PixelWand *pw;
+	int status;
+
+	if ((status = jpegregion(blob, len, fp, r, errmsg, errlen)) != 0)
+		return status;
+
+	status = -1;
+	image = NewMagickWand();
+	pw = NewPixelWand();
+	if (image != NULL && pw != NULL &&
+	    MagickNewImage(image, r->columns, r->rows, pw) &&
+	    MagickSetImagePixels(image, 0, 0, r->columns, r->rows,
+	    r->components == 1 ? "I" : "RGB", CharPixel, r->pixels)) {
+		MagickSetImageFormat(image, "JPEG");
+		if (MagickAddImage(wand, image))
+			status = 0;
+	}
+	if (status)
+		snprintf(errmsg, errlen, "memory error");
+	if (pw != NULL)
+		DestroyPixelWand(pw);
+	if (image != NULL)
+		DestroyMagickWand(image);
+	free(r->pixels);
+	return status;
+}
+
+/*
+ * Read the region of an image given by its path or image specification,
+ * as for readImage, or by the image data, as for readImageBlob.  JPEG
+ * images are decoded only as far as the region needs and scaled in the
+ * DCT domain to the next eighth at or above scale.  All other images,
+ * and JPEG images libjpeg can not crop, are read completely and cropped.
+ * The region is clipped to the image and scaled by scale.
+ */
+static int
+readregion(lua_State *L, int isblob)
+{
+	MagickWand **mw, *image, *frame;
+	struct jpeg_region r;
+	const char *src;
+	unsigned char magic[3];
+	lua_Integer x, y, width, height;
+	unsigned long columns, rows;
+	unsigned int status;
+	size_t len;
+	double scale;
+	char errmsg[128];
+	FILE *fp = NULL;
+	int rv = 1;
+
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
+	src = luaL_checklstring(L, 2, &len);
+	memset(&r, 0, sizeof r);
+	x = luaL_checkinteger(L, 3);
+	y = luaL_checkinteger(L, 4);
+	width = luaL_checkinteger(L, 5);
+	height = luaL_checkinteger(L, 6);
+	scale = luaL_optnumber(L, 7, 1.0);
+	luaL_argcheck(L, x >= 0, 3, "x must not be negative");
+	luaL_argcheck(L, y >= 0, 4, "y must not be negative");
+	luaL_argcheck(L, width > 0, 5, "width must be positive");
+	luaL_argcheck(L, height > 0, 6, "height must be positive");
+	luaL_argcheck(L, scale > 0.0 && scale <= 1.0, 7,
+	    "scale must be in (0, 1]");
+	r.x = x;
+	r.y = y;
+	r.width = width;
+	r.height = height;
+	r.scale = ceil(scale * 8.0);
+
+	if (isblob && isjpeg((const unsigned char *)src, len))
+		rv = readjpegregion(*mw, (const unsigned char *)src, len,
+		    NULL, &r, errmsg, sizeof errmsg);
+	else if (!isblob && (fp = fopen(src, "rb")) != NULL) {
+		if (fread(magic, 1, sizeof magic, fp) == sizeof magic &&
+		    magic[0] == 0xff && magic[1] == 0xd8 && magic[2] == 0xff) {
+			rewind(fp);
+			rv = readjpegregion(*mw, NULL, 0, fp, &r, errmsg,
+			    sizeof errmsg);
+		}
+		fclose(fp);
+	}
+	if (rv == -1) {
+		lua_pushinteger(L, 0);
+		lua_pushstring(L, errmsg);
+		return 2;
+	}
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	if (rv == 1) {
+		if ((image = NewMagickWand()) == NULL)
+			return luaL_error(L, "memory error");
+		status = isblob ? MagickReadImageBlob(image,
+		    (const unsigned char *)src, len) :
+		    MagickReadImage(image, src);
+		if (status) {
+			MagickSetImageIndex(image, 0);
+			status = MagickCropImage(image, r.width, r.height,
+			    r.x, r.y);
+			/* No page offset, as for the JPEG region */
+			MagickSetImagePage(image, 0, 0, 0, 0);
+			r.width = MagickGetImageWidth(image);
+			r.height = MagickGetImageHeight(image);
+		}
+		/* Only the first frame of multi image files */
+		if (status && (frame = MagickGetImage(image)) != NULL) {
+			status = MagickAddImage(*mw, frame);
+			DestroyMagickWand(frame);
+		} else
+			status = 0;
+		DestroyMagickWand(image);
+		if (!status) {
+			lua_pushinteger(L, 0);
+			lua_pushliteral(L, "reading the region failed");
+			return 2;
+		}
+	}
 
-	lua_pushinteger(L, MagickReadImage(*mw, luaL_checkstring(L, 2)));
+	/* Scale the rest of the way, DCT scaling stops at eighths */
+	columns = r.width * scale + 0.5;
+	rows = r.height * scale + 0.5;
+	if (columns == 0)
+		columns = 1;
+	if (rows == 0)
+		rows = 1;
+	MagickSetImageIndex(*mw, MagickGetNumberImages(*mw) - 1);
+	status = 1;
+	if (MagickGetImageWidth(*mw) != columns ||
+	    MagickGetImageHeight(*mw) != rows)
+		status = MagickResizeImage(*mw, columns, rows,
+		    LanczosFilter, 1.0);
+	recordformat(*mw, MagickGetImageSize(*mw), 0);
+	lua_pushinteger(L, status);
 	return 1;
 }
 
+/* readImageRegion(path, x, y, width, height[, scale]) */
+static int
+readImageRegion(lua_State *L)
+{
+	return readregion(L, 0);
+}
+
+/* readImageBlobRegion(blob, x, y, width, height[, scale]) */
+static int
+readImageBlobRegion(lua_State *L)
+{
+	return readregion(L, 1);
+}
+
 static int
 readImageBlob(lua_State *L)
 {
 	MagickWand **mw;
+	struct image_key key;
 	size_t len;
 	const char *blob;
+	unsigned long first;
+	unsigned int status;
+	int cached;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
 	blob = luaL_checklstring(L, 2, &len);
 
-	lua_pushinteger(L, MagickReadImageBlob(*mw, blob, len));
+	cached = imagecacheenabled();
+	if (cached) {
+		blobkey(*mw, blob, len, &key);
+		if (imagecacheget(*mw, &key)) {
+			recordformat(*mw, len, 0);
+			lua_pushinteger(L, 1);
+			return 1;
+		}
+	}
+
+	first = MagickGetNumberImages(*mw);
+	status = MagickReadImageBlob(*mw, blob, len);
+	if (status) {
+		recordformat(*mw, len, 0);
+		if (cached)
+			imagecacheput(*mw, first, &key);
+	}
+	lua_pushinteger(L, status);
 	return 1;
 }
 
-static const char *const filters[] = {
-	"UndefinedFilter",
-	"PointFilter",
-	"BoxFilter",
-	"TriangleFilter",
-	"HermiteFilter",
-	"HanningFilter",
-	"HammingFilter",
-	"BlackmanFilter",
-	"GaussianFilter",
-	"QuadraticFilter",
-	"CubicFilter",
-	"CatromFilter",
-	"MitchellFilter",
-	"LanczosFilter",
-	"BesselFilter",
-	"SincFilter",
-	NULL
-};
-
 static int
 resizeImage(lua_State *L)
 {
 	MagickWand **mw;
+	lua_Integer columns, rows;
+	FilterTypes filter;
+	double blur;
+	int linear = 0, status;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
+	if (deferred(L, FRAME_RESIZE))
+		return 1;
 
-	lua_pushinteger(L, MagickResizeImage(*mw, luaL_checkinteger(L, 2),
-	    luaL_checkinteger(L, 3),
-	    luaL_checkoption(L, 4, "UndefinedFilter", filters),
-	    luaL_checknumber(L, 5)));
+	if (!lua_isnoneornil(L, 6)) {
+		luaL_checktype(L, 6, LUA_TTABLE);
+		lua_getfield(L, 6, "linear");
+		linear = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+	}
+	columns = luaL_checkinteger(L, 2);
+	rows = luaL_checkinteger(L, 3);
+	filter = checkoption(L, 4, "UndefinedFilter", filters);
+	blur = luaL_checknumber(L, 5);
+	status = -1;
+	if (linear) {
+		luaL_argcheck(L, columns > 0, 2, "columns must be positive");
+		luaL_argcheck(L, rows > 0, 3, "rows must be positive");
+		luaL_argcheck(L, blur > 0.0 && blur <= MAXBLUR, 5,
+		    "blur out of range");
+		status = resample(*mw, columns, rows, filter, blur, 1, 1);
+	}
+	if (status == -1)
+		status = MagickResizeImage(*mw, columns, rows, filter, blur);
+	lua_pushinteger(L, status);
+	return 1;
+}
+
+/*
+ * fastResize(columns, rows[, filter[, blur]]) resizes with contribution
+ * tables that are cached across calls with the same geometry.  Images
+ * that are neither RGB nor gray are resized by MagickResizeImage().
+ */
+static int
+fastResize(lua_State *L)
+{
+	MagickWand **mw;
+	lua_Integer columns, rows;
+	FilterTypes filter;
+	double blur;
+	int status;
+
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
+	columns = luaL_checkinteger(L, 2);
+	rows = luaL_checkinteger(L, 3);
+	filter = checkoption(L, 4, "LanczosFilter", filters);
+	blur = luaL_optnumber(L, 5, 1.0);
+	luaL_argcheck(L, columns > 0, 2, "columns must be positive");
+	luaL_argcheck(L, rows > 0, 3, "rows must be positive");
+	luaL_argcheck(L, blur > 0.0 && blur <= MAXBLUR, 5,
+	    "blur out of range");
+
+	status = resample(*mw, columns, rows, filter, blur, 1, 0);
+	if (status == -1)
+		status = MagickResizeImage(*mw, columns, rows, filter, blur);
+	lua_pushinteger(L, status);
+	return 1;
+}
+
+/* autoOrient() turns the image upright according to its EXIF orientation */
+static int
+autoOrient(lua_State *L)
+{
+	MagickWand **mw;
+
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
+	lua_pushinteger(L, orientimage(*mw, exiforientation(*mw)));
+	return 1;
+}
+
+/*
+ * thumbnailFromCamera(columns, rows[, options]) orients, resizes and
+ * strips the image in one resampling pass, the orientation is applied
+ * while the output pixels are stored.  columns and rows are the size of
+ * the upright thumbnail, with options.fit they are a bounding box for
+ * it.  options.filter and options.blur are as for fastResize,
+ * options.linear resizes RGB and gray images in linear light and setting
+ * options.strip to false keeps the profiles.
+ */
+static int
+thumbnailFromCamera(lua_State *L)
+{
+	MagickWand **mw;
+	lua_Integer columns, rows;
+	unsigned long width, height;
+	FilterTypes filter = LanczosFilter;
+	double blur = 1.0, scale;
+	int orient, fit = 0, linear = 0, strip = 1, status;
+
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
+	columns = luaL_checkinteger(L, 2);
+	rows = luaL_checkinteger(L, 3);
+	luaL_argcheck(L, columns > 0, 2, "columns must be positive");
+	luaL_argcheck(L, rows > 0, 3, "rows must be positive");
+	if (!lua_isnoneornil(L, 4)) {
+		luaL_checktype(L, 4, LUA_TTABLE);
+		lua_getfield(L, 4, "filter");
+		filter = frameoption(L, -1, "LanczosFilter", filters);
+		lua_getfield(L, 4, "blur");
+		blur = luaL_optnumber(L, -1, 1.0);
+		lua_getfield(L, 4, "fit");
+		fit = lua_toboolean(L, -1);
+		lua_getfield(L, 4, "linear");
+		linear = lua_toboolean(L, -1);
+		if (lua_getfield(L, 4, "strip") != LUA_TNIL)
+			strip = lua_toboolean(L, -1);
+		lua_pop(L, 5);
+	}
+	luaL_argcheck(L, blur > 0.0 && blur <= MAXBLUR, 4, "blur out of range");
+	if (MagickGetNumberImages(*mw) == 0) {
+		lua_pushinteger(L, 0);
+		return 1;
+	}
+
+	orient = exiforientation(*mw);
+	width = MagickGetImageWidth(*mw);
+	height = MagickGetImageHeight(*mw);
+	if (orient >= 5) {
+		width = height;
+		height = MagickGetImageWidth(*mw);
+	}
+	if (fit) {
+		scale = fmin((double)columns / width, (double)rows / height);
+		columns = fmax(1.0, round(width * scale));
+		rows = fmax(1.0, round(height * scale));
+	}
+
+	status = resample(*mw, columns, rows, filter, blur, orient, linear);
+	/* Other colorspaces are turned upright and resized as they are */
+	if (status == -1 && (status = orientimage(*mw, orient)))
+		status = MagickResizeImage(*mw, columns, rows, filter, blur);
+	if (status) {
+		if (strip)
+			status = MagickStripImage(*mw);
+		else
+			resetorientation(*mw);
+	}
+	lua_pushinteger(L, status);
+	return 1;
+}
+
+/*
+ * processFrames(ops[, options]) applies a list of operations such as
+ * {'resize', 200, 150} or {'threshold', 128} to every frame, with the
+ * frames spread over a pool of threads.  Coalescing, as options.coalesce,
+ * runs before and deconstructing, as options.deconstruct, after the
+ * frame operations, both on the whole list, the frames of the wand are
+ * only replaced when all steps succeed.  Resizing a list that was not
+ * coalesced scales the page offsets of its frames.  options.threads
+ * limits the number of threads, by default one per CPU, or one if
+ * GraphicsMagick uses OpenMP, whose threads would compete with them.
+ */
+static int
+processFrames(lua_State *L)
+{
+	struct magick_wand *mw;
+	struct frame_op *ops;
+	MagickWand *wand, *deconstructed;
+	size_t n, nops;
+	lua_Integer nthreads = 0;
+	int coalesce = 0, deconstruct = 0, t, k;
+	char error[128];
+
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	if (!lua_isnoneornil(L, 3)) {
+		luaL_checktype(L, 3, LUA_TTABLE);
+		lua_getfield(L, 3, "coalesce");
+		coalesce = lua_toboolean(L, -1);
+		lua_getfield(L, 3, "deconstruct");
+		deconstruct = lua_toboolean(L, -1);
+		lua_getfield(L, 3, "threads");
+		nthreads = luaL_optinteger(L, -1, 0);
+		lua_pop(L, 3);
+	}
+
+	nops = lua_rawlen(L, 2);
+	ops = lua_newuserdata(L, (nops ? nops : 1) * sizeof(struct frame_op));
+	for (n = 0; n < nops; n++) {
+		lua_rawgeti(L, 2, n + 1);
+		luaL_argcheck(L, lua_istable(L, -1), 2,
+		    "operations must be tables");
+		t = lua_gettop(L);
+		luaL_checkstack(L, 6, NULL);
+		for (k = 1; k <= 6; k++)
+			lua_rawgeti(L, t, k);
+		memset(&ops[n], 0, sizeof(struct frame_op));
+		ops[n].op = frameoption(L, t + 1, NULL, frameops);
+		checkframeop(L, t + 2, &ops[n], "LanczosFilter");
+		lua_settop(L, t - 1);
+	}
+
+	if (!coalesce)
+		wand = mw->wand;
+	else if ((wand = MagickCoalesceImages(mw->wand)) == NULL)
+		return luaL_error(L, "coalescing failed");
+	if (processframes(mw, wand, ops, nops, nthreads, error,
+	    sizeof error)) {
+		if (wand != mw->wand)
+			DestroyMagickWand(wand);
+		lua_pushinteger(L, 0);
+		lua_pushstring(L, error);
+		return 2;
+	}
+	if (deconstruct) {
+		deconstructed = MagickDeconstructImages(wand);
+		if (deconstructed == NULL) {
+			if (wand != mw->wand)
+				DestroyMagickWand(wand);
+			return luaL_error(L, "deconstructing failed");
+		}
+		if (wand != mw->wand)
+			DestroyMagickWand(wand);
+		wand = deconstructed;
+	}
+	if (wand != mw->wand) {
+		DestroyMagickWand(mw->wand);
+		mw->wand = wand;
+	}
+	lua_pushinteger(L, 1);
+	return 1;
+}
+
+/*
+ * resizeAnimation(columns, rows[, options]) coalesces the frames, resizes
+ * them in parallel and deconstructs them again unless options.optimize
+ * is false.  With options.colors, all frames are finally quantized to one
+ * shared colormap of that many colors, by default the colors the resize
+ * produced are kept.  The frames of the wand are only replaced when all
+ * steps succeed.  Other options are filter, blur, dither and threads, as
+ * for processFrames().
+ */
+static int
+resizeAnimation(lua_State *L)
+{
+	struct magick_wand *mw;
+	struct frame_op op;
+	MagickWand *wand, *deconstructed;
+	lua_Integer columns, rows, colors = 0, nthreads = 0;
+	unsigned long n, nframes;
+	int optimize = 1, dither = 0;
+	char error[128];
+
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
+	columns = luaL_checkinteger(L, 2);
+	rows = luaL_checkinteger(L, 3);
+	luaL_argcheck(L, columns > 0, 2, "columns must be positive");
+	luaL_argcheck(L, rows > 0, 3, "rows must be positive");
+
+	memset(&op, 0, sizeof op);
+	op.op = FRAME_RESIZE;
+	op.arg[0] = columns;
+	op.arg[1] = rows;
+	op.arg[2] = 1.0;
+	op.filter = LanczosFilter;
+	if (!lua_isnoneornil(L, 4)) {
+		luaL_checktype(L, 4, LUA_TTABLE);
+		lua_getfield(L, 4, "filter");
+		op.filter = frameoption(L, -1, "LanczosFilter", filters);
+		lua_getfield(L, 4, "blur");
+		op.arg[2] = luaL_optnumber(L, -1, 1.0);
+		lua_getfield(L, 4, "colors");
+		colors = luaL_optinteger(L, -1, 0);
+		lua_getfield(L, 4, "threads");
+		nthreads = luaL_optinteger(L, -1, 0);
+		if (lua_getfield(L, 4, "optimize") != LUA_TNIL)
+			optimize = lua_toboolean(L, -1);
+		lua_getfield(L, 4, "dither");
+		dither = lua_toboolean(L, -1);
+		lua_pop(L, 6);
+	}
+	luaL_argcheck(L, op.arg[2] > 0.0 && op.arg[2] <= MAXBLUR, 4,
+	    "blur out of range");
+	luaL_argcheck(L, colors >= 0, 4, "colors must not be negative");
+
+	if ((wand = MagickCoalesceImages(mw->wand)) == NULL)
+		return luaL_error(L, "coalescing failed");
+	if (processframes(mw, wand, &op, 1, nthreads, error, sizeof error)) {
+		DestroyMagickWand(wand);
+		lua_pushinteger(L, 0);
+		lua_pushstring(L, error);
+		return 2;
+	}
+
+	/* The scaled pages may be off by rounding, make them the new canvas */
+	nframes = MagickGetNumberImages(wand);
+	for (n = 0; n < nframes; n++) {
+		MagickSetImageIndex(wand, n);
+		MagickSetImagePage(wand, columns, rows, 0, 0);
+	}
+
+	if (optimize && nframes > 1) {
+		deconstructed = MagickDeconstructImages(wand);
+		DestroyMagickWand(wand);
+		if ((wand = deconstructed) == NULL)
+			return luaL_error(L, "deconstructing failed");
+	}
+	if (colors > 0 && !MagickQuantizeImages(wand, colors, RGBColorspace,
+	    0, dither, 0)) {
+		DestroyMagickWand(wand);
+		lua_pushinteger(L, 0);
+		lua_pushstring(L, "quantizing failed");
+		return 2;
+	}
+	DestroyMagickWand(mw->wand);
+	mw->wand = wand;
+	lua_pushinteger(L, 1);
 	return 1;
 }
 
@@ -1153,8 +2104,10 @@ rotateImage(lua_State *L)
 	MagickWand **mw;
 	PixelWand **pw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
-	pw = luaL_checkudata(L, 2, PIXEL_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
+	if (deferred(L, FRAME_ROTATE))
+		return 1;
+	pw = checkudata(L, 2, PIXEL_WAND_METATABLE);
 	lua_pushinteger(L, MagickRotateImage(*mw, *pw, luaL_checknumber(L, 3)));
 	return 1;
 }
@@ -1163,10 +2116,19 @@ static int
 sampleImage(lua_State *L)
 {
 	MagickWand **mw;
+	unsigned long columns, rows;
+	int status;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
-	lua_pushinteger(L, MagickSampleImage(*mw, luaL_checkinteger(L, 2),
-	    luaL_checkinteger(L, 3)));
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
+	if (deferred(L, FRAME_SAMPLE))
+		return 1;
+	columns = luaL_checkinteger(L, 2);
+	rows = luaL_checkinteger(L, 3);
+
+	status = fastsample(*mw, columns, rows);
+	if (status == -1)
+		status = MagickSampleImage(*mw, columns, rows);
+	lua_pushinteger(L, status);
 	return 1;
 }
 
@@ -1174,10 +2136,19 @@ static int
 scaleImage(lua_State *L)
 {
 	MagickWand **mw;
+	unsigned long columns, rows;
+	int status;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
-	lua_pushinteger(L, MagickScaleImage(*mw, luaL_checkinteger(L, 2),
-	    luaL_checkinteger(L, 3)));
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
+	if (deferred(L, FRAME_SCALE))
+		return 1;
+	columns = luaL_checkinteger(L, 2);
+	rows = luaL_checkinteger(L, 3);
+
+	status = fastscale(*mw, columns, rows);
+	if (status == -1)
+		status = MagickScaleImage(*mw, columns, rows);
+	lua_pushinteger(L, status);
 	return 1;
 }
 
@@ -1187,19 +2158,67 @@ setImageBackgroundColor(lua_State *L)
 	MagickWand **mw;
 	PixelWand **pw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
-	pw = luaL_checkudata(L, 2, PIXEL_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
+	pw = checkudata(L, 2, PIXEL_WAND_METATABLE);
 
 	lua_pushinteger(L, MagickSetImageBackgroundColor(*mw, *pw));
 	return 1;
 }
 
+static int
+setDeadline(lua_State *L)
+{
+	struct magick_wand *mw;
+	lua_Number ms;
+
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
+	ms = luaL_optnumber(L, 2, 0);
+	luaL_argcheck(L, ms >= 0 && ms <= UINT64_MAX / 2000000, 2,
+	    "deadline out of range");
+	mw->timeout = ms * 1000000.0;
+	return 0;
+}
+
+/*
+ * setLazy(true) makes transforms record themselves instead of running,
+ * they are optimized and run when a method needs the pixels, see lazy.c.
+ * setLazy(false) runs pending transforms at once.  Recorded transforms
+ * return 1, if one fails later, the method that runs it raises an error.
+ * setLazy{approximate = true} also makes the wand lazy and lets a crop
+ * recorded after a resize move ahead of it, which can shift the resized
+ * pixels by up to one source pixel.  Otherwise the result is exact.
+ */
+static int
+setLazy(lua_State *L)
+{
+	struct magick_wand *mw;
+	int approximate = 0;
+
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
+	luaL_checkany(L, 2);
+	if (lua_istable(L, 2)) {
+		lua_getfield(L, 2, "approximate");
+		approximate = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+	}
+	if (lua_toboolean(L, 2)) {
+		mw->lazy = 1;
+		mw->approximate = approximate;
+		atomic_store(&lazy_used, 1);
+	} else {
+		mw->lazy = mw->approximate = 0;
+		if (mw->npending)
+			flushpending(L, mw);
+	}
+	return 0;
+}
+
 static int
 setSize(lua_State *L)
 {
 	MagickWand **mw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
 	lua_pushinteger(L, MagickSetSize(*mw, luaL_checkinteger(L, 2),
 	    luaL_checkinteger(L, 3)));
 	return 1;
@@ -1210,30 +2229,65 @@ trimImage(lua_State *L)
 {
 	MagickWand **mw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
 	lua_pushinteger(L, MagickTrimImage(*mw, luaL_checknumber(L, 2)));
 	return 1;
 }
 
+/*
+ * An encoder profile is applied to a clone of the wand, so writing with a
+ * profile leaves the format, settings and metadata of the wand untouched.
+ */
+static MagickWand *
+profiledwand(lua_State *L, MagickWand *wand, int idx)
+{
+	const struct encoder_profile *p;
+	MagickWand *clone;
+
+	if (lua_isnoneornil(L, idx))
+		return wand;
+	p = checkprofile(L, idx);
+	if ((clone = CloneMagickWand(wand)) == NULL) {
+		luaL_error(L, "memory error");
+		return NULL;
+	}
+	applyprofile(clone, p);
+	return clone;
+}
+
 static int
 writeImage(lua_State *L)
 {
-	MagickWand **mw;
+	MagickWand **mw, *wand;
+	const char *path;
+	struct stat sb;
+	unsigned int status;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
-	lua_pushinteger(L, MagickWriteImage(*mw, luaL_checkstring(L, 2)));
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
+	path = luaL_checkstring(L, 2);
+	wand = profiledwand(L, *mw, 3);
+	status = MagickWriteImage(wand, path);
+	if (status && stat(path, &sb) == 0)
+		recordformat(wand, 0, sb.st_size);
+	if (wand != *mw)
+		DestroyMagickWand(wand);
+	lua_pushinteger(L, status);
 	return 1;
 }
 
 static int
 writeImageBlob(lua_State *L)
 {
-	MagickWand **mw;
+	MagickWand **mw, *wand;
 	size_t len;
 	const char *blob;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
-	blob = MagickWriteImageBlob(*mw, &len);
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
+	wand = profiledwand(L, *mw, 2);
+	blob = MagickWriteImageBlob(wand, &len);
+	recordformat(wand, 0, len);
+	if (wand != *mw)
+		DestroyMagickWand(wand);
 	lua_pushlstring(L, blob, len);
 	return 1;
 }
@@ -1241,16 +2295,28 @@ writeImageBlob(lua_State *L)
 static int
 destroy(lua_State *L)
 {
-	MagickWand **mw;
+	struct magick_wand *mw;
 
-	mw = luaL_checkudata(L, 1, MAGICK_WAND_METATABLE);
-	if (*mw) {
-		DestroyMagickWand(*mw);
-		*mw = NULL;
+	mw = checkudata(L, 1, MAGICK_WAND_METATABLE);
+	if (running_wand == mw)
+		running_wand = NULL;
+	clearpending(mw);
+	droptoken(mw);
+	if (mw->wand) {
+		DestroyMagickWand(mw->wand);
+		mw->wand = NULL;
 	}
 	return 0;
 }
 
+const char *const *const magick_options[] = {
+	channels,
+	color_spaces,
+	filters,
+	noises,
+	NULL
+};
+
 struct luaL_Reg magick_wand_methods[] = {
 	{ "clone",			clone },
 	{ "adaptiveThresholdImage",	adaptiveThresholdImage },
@@ -1260,10 +2326,13 @@ struct luaL_Reg magick_wand_methods[] = {
 	{ "annotateImage",		annotateImage },
 	{ "animateImages",		animateImages },
 	{ "appendImages",		appendImages },
+	{ "autoOrient",			autoOrient },
 	{ "averageImages",		averageImages },
 	{ "blackThresholdImage",	blackThresholdImage },
 	{ "blurImage",			blurImage },
 	{ "borderImage",		borderImage },
+	{ "cancel",			cancel },
+	{ "cancelToken",		cancelToken },
 	{ "cdlImage",			cdlImage },
 	{ "charcoalImage",		charcoalImage },
 	{ "chopImage",			chopImage },
@@ -1284,9 +2353,12 @@ struct luaL_Reg magick_wand_methods[] = {
 	{ "drawImage",			drawImage },
 	{ "edgeImage",			edgeImage },
 	{ "embossImage",		embossImage },
+	{ "encodeMany",			encodeMany },
+	{ "encodeToSize",		encodeToSize },
 	{ "enhanceImage",		enhanceImage },
 	{ "equalizeImage",		equalizeImage },
 	{ "extentImage",		extentImage },
+	{ "fastResize",		fastResize },
 	{ "flattenImages",		flattenImages },
 	{ "flipImage",			flipImage },
 	{ "flopImage",			flopImage },
@@ -1336,14 +2408,25 @@ struct luaL_Reg magick_wand_methods[] = {
 	{ "getImageRenderingIntent",	getImageRenderingIntent },
 	{ "getImageResolution",		getImageResolution },
 	{ "getImageScene",		getImageScene },
+	{ "processFrames",		processFrames },
+	{ "queryFontMetrics",		queryFontMetrics },
 	{ "readImage",			readImage },
 	{ "readImageBlob",		readImageBlob },
+	{ "readImageBlobRegion",	readImageBlobRegion },
+	{ "readImageRegion",		readImageRegion },
+	{ "resizeAnimation",		resizeAnimation },
 	{ "resizeImage",		resizeImage },
 	{ "rotateImage",		rotateImage },
 	{ "sampleImage",		sampleImage },
 	{ "scaleImage",			scaleImage },
 	{ "setImageBackgroundColor",	setImageBackgroundColor },
+	{ "setDeadline",		setDeadline },
+	{ "setLazy",			setLazy },
 	{ "setSize",			setSize },
+	{ "thumbnailFromCamera",	thumbnailFromCamera },
+	{ "toLinear",			toLinear },
+	{ "toSRGB",			toSRGB },
+	{ "transformColorspace",	transformColorspace },
 	{ "trimImage",			trimImage },
 	{ "writeImage",			writeImage },
 	{ "writeImageBlob",		writeImageBlob },
@@ -0,0 +1,227 @@
+/*
+ * Copyright (c) 2016, 2017 Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of Micro Systems Marc Balmer nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* MVG programs for GraphicsMagick for Lua */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+#include <wand/magick_wand.h>
+
+#include "luagraphicsmagick.h"
+
+/*
+ * MVG primitives and settings that have a drawing template operation,
+ * with the number of MVG arguments they take, -1 for push and pop, whose
+ * only argument must be graphic-context.
+ */
+static const struct {
+	const char	*mvg;
+	const char	*op;
+	int		 nargs;
+} mvgops[] = {
+	{ "arc",		"arc",			6 },
+	{ "circle",		"circle",		4 },
+	{ "ellipse",		"ellipse",		6 },
+	{ "fill",		"setFillColor",		1 },
+	{ "fill-opacity",	"setFillOpacity",	1 },
+	{ "font",		"setFont",		1 },
+	{ "font-family",	"setFontFamily",	1 },
+	{ "font-size",		"setFontSize",		1 },
+	{ "font-weight",	"setFontWeight",	1 },
+	{ "line",		"line",			4 },
+	{ "point",		"point",		2 },
+	{ "pop",		"popGraphicContext",	-1 },
+	{ "push",		"pushGraphicContext",	-1 },
+	{ "rectangle",		"rectangle",		4 },
+	{ "rotate",		"rotate",		1 },
+	{ "roundrectangle",	"roundRectangle",	6 },
+	{ "scale",		"scale",		2 },
+	{ "skewX",		"skewX",		1 },
+	{ "skewY",		"skewY",		1 },
+	{ "stroke",		"setStrokeColor",	1 },
+	{ "stroke-opacity",	"setStrokeOpacity",	1 },
+	{ "stroke-width",	"setStrokeWidth",	1 },
+	{ "text",		"annotation",		3 },
+	{ "translate",		"translate",		2 },
+	{ NULL,			NULL,			0 }
+};
+
+/*
+ * Return the next token of the MVG at *s, NULL at the end.  Tokens are
+ * separated by white space and commas, '#' starts a comment up to the
+ * end of the line and quoted text is one token without the quotes.
+ */
+static const char *
+token(const char **s, size_t *len, int *quoted)
+{
+	const char *p = *s, *start;
+	char close;
+
+	for (;;) {
+		while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n' ||
+		    *p == ',')
+			p++;
+		if (*p != '#')
+			break;
+		while (*p != '\0' && *p != '\n')
+			p++;
+	}
+	if (*p == '\0') {
+		*s = p;
+		return NULL;
+	}
+
+	*quoted = *p == '\'' || *p == '"' || *p == '{';
+	if (*quoted) {
+		close = *p == '{' ? '}' : *p;
+		start = ++p;
+		while (*p != '\0' && *p != close)
+			p++;
+		*len = p - start;
+		*s = *p != '\0' ? p + 1 : p;
+		return start;
+	}
+	start = p;
+	while (*p != '\0' && *p != ' ' && *p != '\t' && *p != '\r' &&
+	    *p != '\n' && *p != ',')
+		p++;
+	*len = p - start;
+	*s = p;
+	return start;
+}
+
+/*
+ * Push an argument as a number if it is one, as a string otherwise.  A
+ * leading '$' is doubled, MVG text is never a template parameter.
+ */
+static void
+pushargument(lua_State *L, const char *tok, size_t len, int quoted)
+{
+	char *end;
+	double v;
+
+	if (!quoted) {
+		lua_pushlstring(L, tok, len);
+		v = strtod(lua_tostring(L, -1), &end);
+		if (len > 0 && *end == '\0') {
+			lua_pop(L, 1);
+			lua_pushnumber(L, v);
+			return;
+		}
+		lua_pop(L, 1);
+	}
+	lua_pushlstring(L, tok, len);
+	if (len > 0 && *tok == '$') {
+		lua_pushliteral(L, "$");
+		lua_insert(L, -2);
+		lua_concat(L, 2);
+	}
+}
+
+/*
+ * Translate MVG into a list of drawing template operations and compile
+ * it, the template is left on the stack.  Primitives and settings that
+ * have no template operation raise an error.
+ */
+static void
+parsemvg(lua_State *L, const char *mvg)
+{
+	const char *tok;
+	size_t len;
+	int n, k, t, nops = 0, quoted;
+
+	lua_newtable(L);
+	t = lua_gettop(L);
+	while ((tok = token(&mvg, &len, &quoted)) != NULL) {
+		for (n = 0; mvgops[n].mvg != NULL; n++)
+			if (!quoted && strlen(mvgops[n].mvg) == len &&
+			    !strncasecmp(mvgops[n].mvg, tok, len))
+				break;
+		if (mvgops[n].mvg == NULL)
+			luaL_error(L, "MVG '%s' is not supported",
+			    lua_pushlstring(L, tok, len));
+
+		lua_createtable(L, mvgops[n].nargs + 1, 0);
+		lua_pushstring(L, mvgops[n].op);
+		lua_rawseti(L, -2, 1);
+		if (mvgops[n].nargs == -1) {
+			tok = token(&mvg, &len, &quoted);
+			if (tok == NULL || len != 15 ||
+			    strncasecmp(tok, "graphic-context", len))
+				luaL_error(L, "MVG '%s' only supports "
+				    "graphic-context", mvgops[n].mvg);
+		}
+		for (k = 0; k < mvgops[n].nargs; k++) {
+			if ((tok = token(&mvg, &len, &quoted)) == NULL)
+				luaL_error(L, "MVG '%s' is missing arguments",
+				    mvgops[n].mvg);
+			pushargument(L, tok, len, quoted);
+			lua_rawseti(L, -2, k + 2);
+		}
+		lua_rawseti(L, t, ++nops);
+	}
+	compiletemplate(L, t);
+	lua_remove(L, t);
+}
+
+/*
+ * drawingWand:loadMVG(mvg) adds MVG to the drawing wand, translated into
+ * DrawingWand calls.  The primitives and settings supported are those of
+ * drawing templates.
+ */
+void
+loadmvg(lua_State *L, DrawingWand *dw, const char *mvg)
+{
+	parsemvg(L, mvg);
+	replaytemplate(L, lua_gettop(L), 0, dw);
+	lua_pop(L, 1);
+}
+
+/*
+ * graphicsmagick.compileMVG(mvg) parses MVG once into a drawing template
+ * that can be drawn any number of times with wand:drawImage(template).
+ * Like every DrawingWand, the template is rendered by GraphicsMagick from
+ * MVG it generates when drawn, the Wand API has no way to draw without
+ * that step.
+ */
+static int
+compileMVG(lua_State *L)
+{
+	parsemvg(L, luaL_checkstring(L, 1));
+	return 1;
+}
+
+struct luaL_Reg mvg_functions[] = {
+	{ "compileMVG",		compileMVG },
+	{ NULL, NULL }
+};
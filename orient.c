@@ -0,0 +1,226 @@
+/*
+ * Copyright (c) 2016, 2017 Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of Micro Systems Marc Balmer nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* EXIF orientation for GraphicsMagick for Lua */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+#include <magick/api.h>
+#include <wand/magick_wand.h>
+
+#include "luagraphicsmagick.h"
+
+#define TAG_ORIENTATION	0x0112
+#define TYPE_SHORT	3
+
+/*
+ * Destination index of source pixel x, y of a width x height image when
+ * it is displayed with EXIF orientation orient.  Orientations 5 to 8
+ * swap the dimensions of the result.
+ */
+size_t
+orientpixel(int orient, unsigned long x, unsigned long y,
+    unsigned long width, unsigned long height)
+{
+	switch (orient) {
+	case 2:
+		return (size_t)y * width + width - 1 - x;
+	case 3:
+		return (size_t)(height - 1 - y) * width + width - 1 - x;
+	case 4:
+		return (size_t)(height - 1 - y) * width + x;
+	case 5:
+		return (size_t)x * height + y;
+	case 6:
+		return (size_t)x * height + height - 1 - y;
+	case 7:
+		return (size_t)(width - 1 - x) * height + height - 1 - y;
+	case 8:
+		return (size_t)(width - 1 - x) * height + y;
+	default:
+		return (size_t)y * width + x;
+	}
+}
+
+static unsigned int
+get16(const unsigned char *p, int le)
+{
+	return le ? p[0] | p[1] << 8 : p[0] << 8 | p[1];
+}
+
+static unsigned long
+get32(const unsigned char *p, int le)
+{
+	return le ? p[0] | p[1] << 8 | p[2] << 16 | (unsigned long)p[3] << 24 :
+	    (unsigned long)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+/*
+ * Find the orientation entry in IFD0 of an EXIF profile, with or without
+ * the "Exif\0\0" header of the APP1 marker.  Returns a pointer to its
+ * value or NULL.
+ */
+static unsigned char *
+findorientation(unsigned char *p, size_t len, int *le)
+{
+	unsigned long ifd;
+	unsigned int n, nentries;
+	unsigned char *e;
+
+	if (len >= 6 && !memcmp(p, "Exif\0\0", 6)) {
+		p += 6;
+		len -= 6;
+	}
+	if (len < 8)
+		return NULL;
+	if (!memcmp(p, "II*\0", 4))
+		*le = 1;
+	else if (!memcmp(p, "MM\0*", 4))
+		*le = 0;
+	else
+		return NULL;
+
+	ifd = get32(p + 4, *le);
+	if (ifd > len - 2)
+		return NULL;
+	nentries = get16(p + ifd, *le);
+	for (n = 0; n < nentries; n++) {
+		if (ifd + 2 + (n + 1) * 12 > len)
+			return NULL;
+		e = p + ifd + 2 + n * 12;
+		if (get16(e, *le) == TAG_ORIENTATION &&
+		    get16(e + 2, *le) == TYPE_SHORT)
+			return e + 8;
+	}
+	return NULL;
+}
+
+/* Returns the EXIF orientation of the current image, 1 if there is none */
+int
+exiforientation(MagickWand *wand)
+{
+	unsigned char *profile, *p;
+	unsigned long len;
+	int le, orient = 1;
+
+	profile = MagickGetImageProfile(wand, "EXIF", &len);
+	if (profile == NULL)
+		return 1;
+	if ((p = findorientation(profile, len, &le)) != NULL)
+		orient = get16(p, le);
+	MagickRelinquishMemory(profile);
+	return orient >= 1 && orient <= 8 ? orient : 1;
+}
+
+/*
+ * Set the orientation in an EXIF profile to upright.  Returns 1 if the
+ * profile was changed.
+ */
+int
+uprightexif(unsigned char *profile, size_t len)
+{
+	unsigned char *p;
+	int le;
+
+	if ((p = findorientation(profile, len, &le)) == NULL ||
+	    get16(p, le) == 1)
+		return 0;
+	p[0] = le ? 1 : 0;
+	p[1] = le ? 0 : 1;
+	return 1;
+}
+
+/* Mark the current image as upright, if it has an orientation tag */
+void
+resetorientation(MagickWand *wand)
+{
+	unsigned char *profile;
+	unsigned long len;
+
+	profile = MagickGetImageProfile(wand, "EXIF", &len);
+	if (profile == NULL)
+		return;
+	if (uprightexif(profile, len))
+		MagickSetImageProfile(wand, "EXIF", profile, len);
+	MagickRelinquishMemory(profile);
+}
+
+/*
+ * Rotate and mirror the current image to its EXIF orientation in a
+ * single pass over the pixels.  Returns 1 on success.
+ */
+int
+orientimage(MagickWand *wand, int orient)
+{
+	unsigned long width, height, x, y;
+	unsigned char *in = NULL, *out = NULL;
+	size_t n, psize;
+	StorageType storage;
+	const char *map;
+	int status = 0;
+
+	if (MagickGetNumberImages(wand) == 0)
+		return 0;
+	if (orient <= 1 || orient > 8)
+		return 1;
+	width = MagickGetImageWidth(wand);
+	height = MagickGetImageHeight(wand);
+	storage = MagickGetImageDepth(wand) > 8 ? ShortPixel : CharPixel;
+	map = MagickGetImageMatte(wand) ? "RGBA" : "RGB";
+	psize = strlen(map) * (storage == ShortPixel ? 2 : 1);
+
+	n = (size_t)width * height * psize;
+	in = malloc(n);
+	out = malloc(n);
+	if (in == NULL || out == NULL)
+		goto done;
+	if (!MagickGetImagePixels(wand, 0, 0, width, height, map, storage, in))
+		goto done;
+
+	for (y = 0; y < height; y++)
+		for (x = 0; x < width; x++)
+			memcpy(&out[orientpixel(orient, x, y, width, height) *
+			    psize], &in[((size_t)y * width + x) * psize], psize);
+
+	/* Sampling is the cheapest way to get an image of the new size */
+	if (orient >= 5 && !MagickSampleImage(wand, height, width))
+		goto done;
+	status = orient >= 5 ?
+	    MagickSetImagePixels(wand, 0, 0, height, width, map, storage, out) :
+	    MagickSetImagePixels(wand, 0, 0, width, height, map, storage, out);
+	if (status)
+		resetorientation(wand);
+done:
+	free(in);
+	free(out);
+	return status;
+}
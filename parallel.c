@@ -0,0 +1,445 @@
+/*
+ * Copyright (c) 2016, 2017 Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of Micro Systems Marc Balmer nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Parallel encoding for GraphicsMagick for Lua */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+#include <magick/api.h>
+#include <wand/magick_wand.h>
+
+#include "luagraphicsmagick.h"
+
+#define MINPROBES	2
+#define MAXPROBES	8
+
+/* Frames are handed out one at a time, the results keep their slots */
+struct frame_pool {
+	struct magick_wand	*owner;
+	MagickWand		**frames;
+	size_t			 nframes;
+	const struct frame_op	*ops;
+	size_t			 nops;
+	atomic_size_t		 next;
+	atomic_int		 failed;
+	char			*error;
+	size_t			 errlen;
+};
+
+struct worker {
+	pthread_t		 thread;
+	struct magick_wand	*owner;
+	struct encode_job	*job;
+	int			 started;
+};
+
+static void
+encode(struct encode_job *job)
+{
+	ExceptionType severity;
+
+	applyprofile(job->wand, job->profile);
+	job->blob = MagickWriteImageBlob(job->wand, &job->length);
+	if (job->blob == NULL || job->length == 0) {
+		if (job->blob != NULL) {
+			MagickRelinquishMemory(job->blob);
+			job->blob = NULL;
+		}
+		job->error = MagickGetException(job->wand, &severity);
+	} else
+		recordformat(job->wand, 0, job->length);
+	DestroyMagickWand(job->wand);
+	job->wand = NULL;
+}
+
+static void *
+work(void *arg)
+{
+	struct worker *w = arg;
+
+	running_wand = w->owner;
+	encode(w->job);
+	return NULL;
+}
+
+/*
+ * Encode the images of wand once per job.  Every job gets its own clone
+ * of the wand, GraphicsMagick shares the pixel caches of cloned images,
+ * so the encoders read the same pixels without copying them.  The first
+ * job runs on the calling thread, as do jobs no thread could be created
+ * for.  Workers answer to cancel() and the timeout of mw.
+ */
+void
+encodemany(struct magick_wand *mw, MagickWand *wand, struct encode_job *jobs,
+    size_t njobs)
+{
+	struct worker *workers;
+	size_t n;
+
+	for (n = 0; n < njobs; n++)
+		jobs[n].wand = CloneMagickWand(wand);
+
+	workers = calloc(njobs, sizeof(struct worker));
+	for (n = 1; workers != NULL && n < njobs; n++) {
+		if (jobs[n].wand == NULL)
+			continue;
+		workers[n].owner = mw;
+		workers[n].job = &jobs[n];
+		workers[n].started = !pthread_create(&workers[n].thread, NULL,
+		    work, &workers[n]);
+	}
+
+	for (n = 0; n < njobs; n++) {
+		if (workers != NULL && workers[n].started)
+			continue;
+		if (jobs[n].wand != NULL)
+			encode(&jobs[n]);
+	}
+	for (n = 1; workers != NULL && n < njobs; n++)
+		if (workers[n].started)
+			pthread_join(workers[n].thread, NULL);
+	free(workers);
+}
+
+static double
+psnr(MagickWand *wand, const unsigned char *blob, size_t len)
+{
+	MagickWand *decoded, *diff;
+	double distortion = 0.0;
+
+	decoded = NewMagickWand();
+	if (decoded == NULL)
+		return 0.0;
+	if (MagickReadImageBlob(decoded, blob, len)) {
+		diff = MagickCompareImages(decoded, wand,
+		    PeakSignalToNoiseRatioMetric, &distortion);
+		if (diff != NULL)
+			DestroyMagickWand(diff);
+	}
+	DestroyMagickWand(decoded);
+	return distortion;
+}
+
+/*
+ * Search the highest quality whose encoding fits into s->max_bytes.
+ * Every round encodes one probe per CPU, spread over the qualities not
+ * yet known to fit or to exceed the budget, the highest untested quality
+ * always among them.  The search ends when no quality is left between
+ * the best fit and the lowest quality that was too large, or early, when
+ * s->min_psnr is set and the best fit reaches it.  Probes that fail to
+ * encode are ignored, unless no probe of a round made progress.  PNG and
+ * MNG are refused, their quality selects zlib level and filter and does
+ * not order the encodings by size.  Returns 0 if a blob was found.
+ */
+int
+encodetosize(struct magick_wand *mw, MagickWand *wand,
+    struct size_search *s)
+{
+	struct encoder_profile profiles[MAXPROBES];
+	struct encode_job jobs[MAXPROBES];
+	long nprobes, fit, toolarge, lo, hi, range, n;
+	int improved, narrowed;
+
+	nprobes = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nprobes < MINPROBES)
+		nprobes = MINPROBES;
+	else if (nprobes > MAXPROBES)
+		nprobes = MAXPROBES;
+
+	s->blob = NULL;
+	s->length = 0;
+	s->quality = -1;
+	s->psnr = 0.0;
+	s->error[0] = '\0';
+	if (strlen(s->format) >= sizeof profiles[0].format) {
+		snprintf(s->error, sizeof s->error, "format name too long");
+		return -1;
+	}
+	if (!strncasecmp(s->format, "PNG", 3) ||
+	    !strncasecmp(s->format, "MNG", 3)) {
+		snprintf(s->error, sizeof s->error,
+		    "quality does not control the size of %s", s->format);
+		return -1;
+	}
+	fit = s->min_quality - 1;
+	toolarge = s->max_quality + 1;
+
+	while ((range = toolarge - fit - 1) > 0) {
+		lo = fit + 1;
+		hi = toolarge - 1;
+		if (range > nprobes)
+			range = nprobes;
+		memset(jobs, 0, sizeof jobs);
+		for (n = 0; n < range; n++) {
+			memset(&profiles[n], 0, sizeof(struct encoder_profile));
+			strcpy(profiles[n].format, s->format);
+			profiles[n].quality = hi - n * (hi - lo) /
+			    (range > 1 ? range - 1 : 1);
+			profiles[n].pngquality = profiles[n].interlace = -1;
+			jobs[n].profile = &profiles[n];
+		}
+
+		encodemany(mw, wand, jobs, range);
+
+		improved = narrowed = 0;
+		for (n = 0; n < range; n++) {
+			if (jobs[n].blob == NULL) {
+				if (s->error[0] == '\0')
+					snprintf(s->error, sizeof s->error,
+					    "quality %ld: %s",
+					    profiles[n].quality,
+					    jobs[n].error != NULL ?
+					    jobs[n].error : "memory error");
+			} else if (jobs[n].length <= s->max_bytes) {
+				if (profiles[n].quality > fit) {
+					fit = profiles[n].quality;
+					if (s->blob != NULL)
+						MagickRelinquishMemory(s->blob);
+					s->blob = jobs[n].blob;
+					s->length = jobs[n].length;
+					s->quality = fit;
+					jobs[n].blob = NULL;
+					improved = 1;
+				}
+			} else if (profiles[n].quality < toolarge) {
+				toolarge = profiles[n].quality;
+				narrowed = 1;
+			}
+			if (jobs[n].blob != NULL)
+				MagickRelinquishMemory(jobs[n].blob);
+			if (jobs[n].error != NULL)
+				MagickRelinquishMemory(jobs[n].error);
+		}
+
+		if (improved && s->min_psnr > 0.0) {
+			s->psnr = psnr(wand, s->blob, s->length);
+			if (s->psnr >= s->min_psnr)
+				break;
+		}
+		if (!improved && !narrowed)
+			break;
+	}
+	return s->blob != NULL ? 0 : -1;
+}
+
+/*
+ * Scale the page of a resized frame along with it, so the frames of a
+ * list that was not coalesced keep their places on the canvas.
+ */
+static void
+scalepage(MagickWand *wand, unsigned long columns, unsigned long rows)
+{
+	unsigned long width, height;
+	long x, y;
+	double sx, sy;
+
+	if (!MagickGetImagePage(wand, &width, &height, &x, &y))
+		return;
+	sx = (double)MagickGetImageWidth(wand) / columns;
+	sy = (double)MagickGetImageHeight(wand) / rows;
+	MagickSetImagePage(wand, lround(width * sx), lround(height * sy),
+	    lround(x * sx), lround(y * sy));
+}
+
+static unsigned int
+resizeframe(MagickWand *wand, const struct frame_op *op)
+{
+	unsigned long columns, rows;
+	int status;
+
+	columns = MagickGetImageWidth(wand);
+	rows = MagickGetImageHeight(wand);
+	switch (op->op) {
+	case FRAME_RESIZE:
+		status = op->arg[3] ? resample(wand, op->arg[0],
+		    op->arg[1], op->filter, op->arg[2], 1, 1) : -1;
+		if (status == -1)
+			status = MagickResizeImage(wand, op->arg[0],
+			    op->arg[1], op->filter, op->arg[2]);
+		break;
+	case FRAME_SAMPLE:
+		status = MagickSampleImage(wand, op->arg[0], op->arg[1]);
+		break;
+	default:
+		status = MagickScaleImage(wand, op->arg[0], op->arg[1]);
+		break;
+	}
+	if (status && columns > 0 && rows > 0)
+		scalepage(wand, columns, rows);
+	return status;
+}
+
+/* Apply one operation to the current image of wand */
+unsigned int
+applyframeop(MagickWand *wand, const struct frame_op *op)
+{
+	switch (op->op) {
+	case FRAME_BLUR:
+		return MagickBlurImage(wand, op->arg[0], op->arg[1]);
+	case FRAME_COLORIZE:
+		return MagickColorizeImage(wand, op->color[0], op->color[1]);
+	case FRAME_CROP:
+		return MagickCropImage(wand, op->arg[0], op->arg[1],
+		    op->arg[2], op->arg[3]);
+	case FRAME_FLIP:
+		return MagickFlipImage(wand);
+	case FRAME_FLOP:
+		return MagickFlopImage(wand);
+	case FRAME_GAMMA:
+		return MagickGammaImage(wand, op->arg[0]);
+	case FRAME_MODULATE:
+		return MagickModulateImage(wand, op->arg[0], op->arg[1],
+		    op->arg[2]);
+	case FRAME_RESIZE:
+	case FRAME_SAMPLE:
+	case FRAME_SCALE:
+		return resizeframe(wand, op);
+	case FRAME_ROTATE:
+		return MagickRotateImage(wand, op->color[0], op->arg[0]);
+	case FRAME_SHARPEN:
+		return MagickSharpenImage(wand, op->arg[0], op->arg[1]);
+	case FRAME_THRESHOLD:
+		return MagickThresholdImage(wand, op->arg[0]);
+	}
+	return 0;
+}
+
+static void *
+workframes(void *arg)
+{
+	struct frame_pool *pool = arg;
+	ExceptionType severity;
+	char *error;
+	size_t n, op;
+	int none;
+
+	running_wand = pool->owner;
+	while ((n = atomic_fetch_add(&pool->next, 1)) < pool->nframes) {
+		if (atomic_load(&pool->failed))
+			break;
+		for (op = 0; op < pool->nops; op++)
+			if (!applyframeop(pool->frames[n], &pool->ops[op]))
+				break;
+		if (op == pool->nops)
+			continue;
+		none = 0;
+		if (!atomic_compare_exchange_strong(&pool->failed, &none, 1))
+			continue;
+		error = MagickGetException(pool->frames[n], &severity);
+		snprintf(pool->error, pool->errlen, "frame %lu: %s",
+		    (unsigned long)n, error != NULL ? error : "failed");
+		if (error != NULL)
+			MagickRelinquishMemory(error);
+	}
+	return NULL;
+}
+
+/*
+ * Apply ops to every frame of wand, on behalf of mw.  Each frame is taken
+ * out of the list into a wand of its own, the frames are then processed
+ * by up to nthreads threads, the calling thread being one of them, and
+ * put back in their original places.  If any frame fails, the list is
+ * left unchanged.  nthreads 0 means one thread per CPU, or just one when
+ * GraphicsMagick runs its own OpenMP threads.  Returns 0 on success.
+ */
+int
+processframes(struct magick_wand *mw, MagickWand *wand,
+    const struct frame_op *ops, size_t nops, long nthreads, char *error,
+    size_t errlen)
+{
+	struct frame_pool pool;
+	pthread_t *threads;
+	unsigned char *started;
+	size_t n;
+	long index, t;
+
+	memset(&pool, 0, sizeof pool);
+	pool.owner = mw;
+	pool.ops = ops;
+	pool.nops = nops;
+	pool.error = error;
+	pool.errlen = errlen;
+	pool.nframes = MagickGetNumberImages(wand);
+	if (pool.nframes == 0)
+		return 0;
+
+	pool.frames = calloc(pool.nframes, sizeof(MagickWand *));
+	if (pool.frames == NULL) {
+		snprintf(error, errlen, "memory error");
+		return -1;
+	}
+	index = MagickGetImageIndex(wand);
+	for (n = 0; n < pool.nframes; n++) {
+		MagickSetImageIndex(wand, n);
+		if ((pool.frames[n] = MagickGetImage(wand)) == NULL) {
+			snprintf(error, errlen, "memory error");
+			atomic_store(&pool.failed, 1);
+			break;
+		}
+	}
+
+	if (nthreads <= 0)
+		nthreads = GetMagickResourceLimit(ThreadsResource) > 1 ? 1 :
+		    sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads > (long)pool.nframes)
+		nthreads = pool.nframes;
+	if (atomic_load(&pool.failed))
+		nthreads = 0;
+	threads = calloc(nthreads > 1 ? nthreads : 1, sizeof(pthread_t));
+	started = calloc(nthreads > 1 ? nthreads : 1, 1);
+	for (t = 1; threads != NULL && started != NULL && t < nthreads; t++)
+		started[t] = !pthread_create(&threads[t], NULL, workframes,
+		    &pool);
+	if (nthreads > 0)
+		workframes(&pool);
+	for (t = 1; threads != NULL && started != NULL && t < nthreads; t++)
+		if (started[t])
+			pthread_join(threads[t], NULL);
+	free(threads);
+	free(started);
+
+	for (n = 0; n < pool.nframes && pool.frames[n] != NULL; n++) {
+		if (!atomic_load(&pool.failed)) {
+			MagickSetImageIndex(wand, n);
+			MagickSetImage(wand, pool.frames[n]);
+		}
+		DestroyMagickWand(pool.frames[n]);
+	}
+	free(pool.frames);
+	MagickSetImageIndex(wand, index);
+	return atomic_load(&pool.failed) ? -1 : 0;
+}
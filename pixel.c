@@ -40,7 +40,7 @@ clone(lua_State *L)
 {
 	PixelWand **pw, **pw2;
 
-	pw = luaL_checkudata(L, 1, PIXEL_WAND_METATABLE);
+	pw = checkudata(L, 1, PIXEL_WAND_METATABLE);
 	pw2 = lua_newuserdata(L, sizeof(PixelWand *));
 	*pw2 = ClonePixelWand(*pw);
 	luaL_setmetatable(L, PIXEL_WAND_METATABLE);
@@ -52,7 +52,7 @@ destroy(lua_State *L)
 {
 	PixelWand **pw;
 
-	pw = luaL_checkudata(L, 1, PIXEL_WAND_METATABLE);
+	pw = checkudata(L, 1, PIXEL_WAND_METATABLE);
 	if (*pw) {
 		DestroyPixelWand(*pw);
 		*pw = NULL;
@@ -65,7 +65,7 @@ getBlack(lua_State *L)
 {
 	PixelWand **pw;
 
-	pw = luaL_checkudata(L, 1, PIXEL_WAND_METATABLE);
+	pw = checkudata(L, 1, PIXEL_WAND_METATABLE);
 	lua_pushnumber(L, PixelGetBlack(*pw));
 	return 1;
 }
@@ -75,7 +75,7 @@ getBlackQuantum(lua_State *L)
 {
 	PixelWand **pw;
 
-	pw = luaL_checkudata(L, 1, PIXEL_WAND_METATABLE);
+	pw = checkudata(L, 1, PIXEL_WAND_METATABLE);
 	lua_pushinteger(L, PixelGetBlackQuantum(*pw));
 	return 1;
 }
@@ -85,7 +85,7 @@ getBlue(lua_State *L)
 {
 	PixelWand **pw;
 
-	pw = luaL_checkudata(L, 1, PIXEL_WAND_METATABLE);
+	pw = checkudata(L, 1, PIXEL_WAND_METATABLE);
 	lua_pushnumber(L, PixelGetBlue(*pw));
 	return 1;
 }
@@ -95,7 +95,7 @@ getBlueQuantum(lua_State *L)
 {
 	PixelWand **pw;
 
-	pw = luaL_checkudata(L, 1, PIXEL_WAND_METATABLE);
+	pw = checkudata(L, 1, PIXEL_WAND_METATABLE);
 	lua_pushinteger(L, PixelGetBlueQuantum(*pw));
 	return 1;
 }
@@ -105,7 +105,7 @@ getColorAsString(lua_State *L)
 {
 	PixelWand **pw;
 
-	pw = luaL_checkudata(L, 1, PIXEL_WAND_METATABLE);
+	pw = checkudata(L, 1, PIXEL_WAND_METATABLE);
 	lua_pushstring(L, PixelGetColorAsString(*pw));
 	return 1;
 }
@@ -115,7 +115,7 @@ getColorCount(lua_State *L)
 {
 	PixelWand **pw;
 
-	pw = luaL_checkudata(L, 1, PIXEL_WAND_METATABLE);
+	pw = checkudata(L, 1, PIXEL_WAND_METATABLE);
 	lua_pushinteger(L, PixelGetColorCount(*pw));
 	return 1;
 }
@@ -125,7 +125,7 @@ getCyan(lua_State *L)
 {
 	PixelWand **pw;
 
-	pw = luaL_checkudata(L, 1, PIXEL_WAND_METATABLE);
+	pw = checkudata(L, 1, PIXEL_WAND_METATABLE);
 	lua_pushnumber(L, PixelGetCyan(*pw));
 	return 1;
 }
@@ -135,7 +135,7 @@ getCyanQuantum(lua_State *L)
 {
 	PixelWand **pw;
 
-	pw = luaL_checkudata(L, 1, PIXEL_WAND_METATABLE);
+	pw = checkudata(L, 1, PIXEL_WAND_METATABLE);
 	lua_pushinteger(L, PixelGetCyanQuantum(*pw));
 	return 1;
 }
@@ -145,7 +145,7 @@ getGreen(lua_State *L)
 {
 	PixelWand **pw;
 
-	pw = luaL_checkudata(L, 1, PIXEL_WAND_METATABLE);
+	pw = checkudata(L, 1, PIXEL_WAND_METATABLE);
 	lua_pushnumber(L, PixelGetGreen(*pw));
 	return 1;
 }
@@ -155,7 +155,7 @@ getGreenQuantum(lua_State *L)
 {
 	PixelWand **pw;
 
-	pw = luaL_checkudata(L, 1, PIXEL_WAND_METATABLE);
+	pw = checkudata(L, 1, PIXEL_WAND_METATABLE);
 	lua_pushinteger(L, PixelGetGreenQuantum(*pw));
 	return 1;
 }
@@ -165,7 +165,7 @@ getMagenta(lua_State *L)
 {
 	PixelWand **pw;
 
-	pw = luaL_checkudata(L, 1, PIXEL_WAND_METATABLE);
+	pw = checkudata(L, 1, PIXEL_WAND_METATABLE);
 	lua_pushnumber(L, PixelGetMagenta(*pw));
 	return 1;
 }
@@ -175,7 +175,7 @@ getMagentaQuantum(lua_State *L)
 {
 	PixelWand **pw;
 
-	pw = luaL_checkudata(L, 1, PIXEL_WAND_METATABLE);
+	pw = checkudata(L, 1, PIXEL_WAND_METATABLE);
 	lua_pushinteger(L, PixelGetMagentaQuantum(*pw));
 	return 1;
 }
@@ -185,7 +185,7 @@ getOpacity(lua_State *L)
 {
 	PixelWand **pw;
 
-	pw = luaL_checkudata(L, 1, PIXEL_WAND_METATABLE);
+	pw = checkudata(L, 1, PIXEL_WAND_METATABLE);
 	lua_pushnumber(L, PixelGetOpacity(*pw));
 	return 1;
 }
@@ -195,7 +195,7 @@ getOpacityQuantum(lua_State *L)
 {
 	PixelWand **pw;
 
-	pw = luaL_checkudata(L, 1, PIXEL_WAND_METATABLE);
+	pw = checkudata(L, 1, PIXEL_WAND_METATABLE);
 	lua_pushinteger(L, PixelGetOpacityQuantum(*pw));
 	return 1;
 }
@@ -205,7 +205,7 @@ getRed(lua_State *L)
 {
 	PixelWand **pw;
 
-	pw = luaL_checkudata(L, 1, PIXEL_WAND_METATABLE);
+	pw = checkudata(L, 1, PIXEL_WAND_METATABLE);
 	lua_pushnumber(L, PixelGetRed(*pw));
 	return 1;
 }
@@ -215,7 +215,7 @@ getRedQuantum(lua_State *L)
 {
 	PixelWand **pw;
 
-	pw = luaL_checkudata(L, 1, PIXEL_WAND_METATABLE);
+	pw = checkudata(L, 1, PIXEL_WAND_METATABLE);
 	lua_pushinteger(L, PixelGetRedQuantum(*pw));
 	return 1;
 }
@@ -225,7 +225,7 @@ getYellow(lua_State *L)
 {
 	PixelWand **pw;
 
-	pw = luaL_checkudata(L, 1, PIXEL_WAND_METATABLE);
+	pw = checkudata(L, 1, PIXEL_WAND_METATABLE);
 	lua_pushnumber(L, PixelGetYellow(*pw));
 	return 1;
 }
@@ -235,7 +235,7 @@ getYellowQuantum(lua_State *L)
 {
 	PixelWand **pw;
 
-	pw = luaL_checkudata(L, 1, PIXEL_WAND_METATABLE);
+	pw = checkudata(L, 1, PIXEL_WAND_METATABLE);
 	lua_pushinteger(L, PixelGetYellowQuantum(*pw));
 	return 1;
 }
@@ -245,7 +245,7 @@ setBlack(lua_State *L)
 {
 	PixelWand **pw;
 
-	pw = luaL_checkudata(L, 1, PIXEL_WAND_METATABLE);
+	pw = checkudata(L, 1, PIXEL_WAND_METATABLE);
 	PixelSetBlack(*pw, luaL_checknumber(L, 2));
 	return 0;
 }
@@ -255,7 +255,7 @@ setBlackQuantum(lua_State *L)
 {
 	PixelWand **pw;
 
-	pw = luaL_checkudata(L, 1, PIXEL_WAND_METATABLE);
+	pw = checkudata(L, 1, PIXEL_WAND_METATABLE);
 	PixelSetBlackQuantum(*pw, luaL_checkinteger(L, 2));
 	return 0;
 }
@@ -265,7 +265,7 @@ setBlue(lua_State *L)
 {
 	PixelWand **pw;
 
-	pw = luaL_checkudata(L, 1, PIXEL_WAND_METATABLE);
+	pw = checkudata(L, 1, PIXEL_WAND_METATABLE);
 	PixelSetBlue(*pw, luaL_checknumber(L, 2));
 	return 0;
 }
@@ -275,7 +275,7 @@ setBlueQuantum(lua_State *L)
 {
 	PixelWand **pw;
 
-	pw = luaL_checkudata(L, 1, PIXEL_WAND_METATABLE);
+	pw = checkudata(L, 1, PIXEL_WAND_METATABLE);
 	PixelSetBlueQuantum(*pw, luaL_checkinteger(L, 2));
 	return 0;
 }
@@ -286,7 +286,7 @@ setColor(lua_State *L)
 {
 	PixelWand **pw;
 
-	pw = luaL_checkudata(L, 1, PIXEL_WAND_METATABLE);
+	pw = checkudata(L, 1, PIXEL_WAND_METATABLE);
 	lua_pushinteger(L, PixelSetColor(*pw, luaL_checkstring(L, 2)));
 	return 1;
 }
@@ -296,7 +296,7 @@ setColorCount(lua_State *L)
 {
 	PixelWand **pw;
 
-	pw = luaL_checkudata(L, 1, PIXEL_WAND_METATABLE);
+	pw = checkudata(L, 1, PIXEL_WAND_METATABLE);
 	PixelSetColorCount(*pw, luaL_checkinteger(L, 2));
 	return 0;
 }
@@ -306,7 +306,7 @@ setCyan(lua_State *L)
 {
 	PixelWand **pw;
 
-	pw = luaL_checkudata(L, 1, PIXEL_WAND_METATABLE);
+	pw = checkudata(L, 1, PIXEL_WAND_METATABLE);
 	PixelSetCyan(*pw, luaL_checknumber(L, 2));
 	return 0;
 }
@@ -316,7 +316,7 @@ setCyanQuantum(lua_State *L)
 {
 	PixelWand **pw;
 
-	pw = luaL_checkudata(L, 1, PIXEL_WAND_METATABLE);
+	pw = checkudata(L, 1, PIXEL_WAND_METATABLE);
 	PixelSetCyanQuantum(*pw, luaL_checkinteger(L, 2));
 	return 0;
 }
@@ -326,7 +326,7 @@ setGreen(lua_State *L)
 {
 	PixelWand **pw;
 
-	pw = luaL_checkudata(L, 1, PIXEL_WAND_METATABLE);
+	pw = checkudata(L, 1, PIXEL_WAND_METATABLE);
 	PixelSetGreen(*pw, luaL_checknumber(L, 2));
 	return 0;
 }
@@ -336,7 +336,7 @@ setGreenQuantum(lua_State *L)
 {
 	PixelWand **pw;
 
-	pw = luaL_checkudata(L, 1, PIXEL_WAND_METATABLE);
+	pw = checkudata(L, 1, PIXEL_WAND_METATABLE);
 	PixelSetGreenQuantum(*pw, luaL_checkinteger(L, 2));
 	return 0;
 }
@@ -346,7 +346,7 @@ setMagenta(lua_State *L)
 {
 	PixelWand **pw;
 
-	pw = luaL_checkudata(L, 1, PIXEL_WAND_METATABLE);
+	pw = checkudata(L, 1, PIXEL_WAND_METATABLE);
 	PixelSetMagenta(*pw, luaL_checknumber(L, 2));
 	return 0;
 }
@@ -356,7 +356,7 @@ setMagentaQuantum(lua_State *L)
 {
 	PixelWand **pw;
 
-	pw = luaL_checkudata(L, 1, PIXEL_WAND_METATABLE);
+	pw = checkudata(L, 1, PIXEL_WAND_METATABLE);
 	PixelSetMagentaQuantum(*pw, luaL_checkinteger(L, 2));
 	return 0;
 }
@@ -366,7 +366,7 @@ setOpacity(lua_State *L)
 {
 	PixelWand **pw;
 
-	pw = luaL_checkudata(L, 1, PIXEL_WAND_METATABLE);
+	pw = checkudata(L, 1, PIXEL_WAND_METATABLE);
 	PixelSetOpacity(*pw, luaL_checknumber(L, 2));
 	return 0;
 }
@@ -376,7 +376,7 @@ setOpacityQuantum(lua_State *L)
 {
 	PixelWand **pw;
 
-	pw = luaL_checkudata(L, 1, PIXEL_WAND_METATABLE);
+	pw = checkudata(L, 1, PIXEL_WAND_METATABLE);
 	PixelSetOpacityQuantum(*pw, luaL_checkinteger(L, 2));
 	return 0;
 }
@@ -386,7 +386,7 @@ setRed(lua_State *L)
 {
 	PixelWand **pw;
 
-	pw = luaL_checkudata(L, 1, PIXEL_WAND_METATABLE);
+	pw = checkudata(L, 1, PIXEL_WAND_METATABLE);
 	PixelSetRed(*pw, luaL_checknumber(L, 2));
 	return 0;
 }
@@ -396,7 +396,7 @@ setRedQuantum(lua_State *L)
 {
 	PixelWand **pw;
 
-	pw = luaL_checkudata(L, 1, PIXEL_WAND_METATABLE);
+	pw = checkudata(L, 1, PIXEL_WAND_METATABLE);
 	PixelSetRedQuantum(*pw, luaL_checkinteger(L, 2));
 	return 0;
 }
@@ -406,7 +406,7 @@ setYellow(lua_State *L)
 {
 	PixelWand **pw;
 
-	pw = luaL_checkudata(L, 1, PIXEL_WAND_METATABLE);
+	pw = checkudata(L, 1, PIXEL_WAND_METATABLE);
 	PixelSetYellow(*pw, luaL_checknumber(L, 2));
 	return 0;
 }
@@ -416,7 +416,7 @@ setYellowQuantum(lua_State *L)
 {
 	PixelWand **pw;
 
-	pw = luaL_checkudata(L, 1, PIXEL_WAND_METATABLE);
+	pw = checkudata(L, 1, PIXEL_WAND_METATABLE);
 	PixelSetYellowQuantum(*pw, luaL_checkinteger(L, 2));
 	return 0;
 }
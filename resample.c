@@ -0,0 +1,716 @@
+/*
+ * Copyright (c) 2016, 2017 Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of Micro Systems Marc Balmer nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/* Separable resampling with cached contribution tables */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+#include <magick/api.h>
+#include <wand/magick_wand.h>
+
+#include "luagraphicsmagick.h"
+
+#define MAXTABLES	64
+
+/*
+ * The weights used to compute one dimension of the output.  Output pixel
+ * i is the weighted sum of count[i] input pixels starting at start[i],
+ * its weights are at weights[i * maxcount].  Tables are immutable and
+ * shared, they are freed when they have been evicted and the last user
+ * releases them.
+ */
+struct contrib_table {
+	unsigned long		 src;
+	unsigned long		 dst;
+	FilterTypes		 filter;
+	double			 blur;
+	int			 refcnt;
+	long			*start;
+	int			*count;
+	int			 maxcount;
+	float			*weights;
+	struct contrib_table	*next;
+};
+
+static pthread_mutex_t tables_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct contrib_table *tables;
+static int ntables;
+static uint64_t table_hits, table_misses;
+
+static double
+sinc(double x)
+{
+	if (x == 0.0)
+		return 1.0;
+	return sin(M_PI * x) / (M_PI * x);
+}
+
+/* Mitchell-Netravali family of cubic filters */
+static double
+bcspline(double x, double b, double c)
+{
+	if (x < 1.0)
+		return ((12.0 - 9.0 * b - 6.0 * c) * x * x * x +
+		    (-18.0 + 12.0 * b + 6.0 * c) * x * x +
+		    (6.0 - 2.0 * b)) / 6.0;
+	if (x < 2.0)
+		return ((-b - 6.0 * c) * x * x * x +
+		    (6.0 * b + 30.0 * c) * x * x +
+		    (-12.0 * b - 48.0 * c) * x + (8.0 * b + 24.0 * c)) / 6.0;
+	return 0.0;
+}
+
+static double
+filtersupport(FilterTypes filter)
+{
+	switch (filter) {
+	case PointFilter:
+	case BoxFilter:
+		return 0.5;
+	case GaussianFilter:
+		return 1.25;
+	case QuadraticFilter:
+		return 1.5;
+	case CubicFilter:
+	case CatromFilter:
+	case MitchellFilter:
+		return 2.0;
+	case BesselFilter:
+		return 3.2383;
+	case SincFilter:
+		return 4.0;
+	case TriangleFilter:
+	case HermiteFilter:
+	case HanningFilter:
+	case HammingFilter:
+	case BlackmanFilter:
+		return 1.0;
+	case LanczosFilter:
+	default:
+		return 3.0;
+	}
+}
+
+/* Evaluate filter at distance x >= 0 */
+static double
+filterweight(FilterTypes filter, double x)
+{
+	switch (filter) {
+	case PointFilter:
+	case BoxFilter:
+		return x < 0.5;
+	case TriangleFilter:
+		return x < 1.0 ? 1.0 - x : 0.0;
+	case HermiteFilter:
+		return x < 1.0 ? (2.0 * x - 3.0) * x * x + 1.0 : 0.0;
+	case HanningFilter:
+		return 0.5 + 0.5 * cos(M_PI * x);
+	case HammingFilter:
+		return 0.54 + 0.46 * cos(M_PI * x);
+	case BlackmanFilter:
+		return 0.42 + 0.5 * cos(M_PI * x) + 0.08 * cos(2.0 * M_PI * x);
+	case GaussianFilter:
+		return exp(-2.0 * x * x) * sqrt(2.0 / M_PI);
+	case QuadraticFilter:
+		if (x < 0.5)
+			return 0.75 - x * x;
+		if (x < 1.5)
+			return 0.5 * (x - 1.5) * (x - 1.5);
+		return 0.0;
+	case CubicFilter:
+		return bcspline(x, 1.0, 0.0);
+	case CatromFilter:
+		return bcspline(x, 0.0, 0.5);
+	case MitchellFilter:
+		return bcspline(x, 1.0 / 3.0, 1.0 / 3.0);
+	case BesselFilter:
+		return x == 0.0 ? M_PI / 4.0 : j1(M_PI * x) / (2.0 * x);
+	case SincFilter:
+		return sinc(x);
+	case LanczosFilter:
+	default:
+		return x < 3.0 ? sinc(x) * sinc(x / 3.0) : 0.0;
+	}
+}
+
+static void
+freetable(struct contrib_table *t)
+{
+	free(t->start);
+	free(t->count);
+	free(t->weights);
+	free(t);
+}
+
+static struct contrib_table *
+buildtable(unsigned long src, unsigned long dst, FilterTypes filter,
+    double blur)
+{
+	struct contrib_table *t;
+	float *w;
+	double scale, support, center, density;
+	unsigned long i;
+	long j, start, stop;
+
+	if ((t = calloc(1, sizeof(struct contrib_table))) == NULL)
+		return NULL;
+	t->src = src;
+	t->dst = dst;
+	t->filter = filter;
+	t->blur = blur;
+
+	/* When reducing, the filter is stretched over the source pixels */
+	scale = blur * ((double)src / dst > 1.0 ? (double)src / dst : 1.0);
+	support = scale * filtersupport(filter);
+	if (support < 0.5) {
+		support = 0.5;
+		scale = 1.0;
+	}
+	t->maxcount = (int)(2.0 * support) + 3;
+
+	t->start = calloc(dst, sizeof(long));
+	t->count = calloc(dst, sizeof(int));
+	t->weights = calloc(dst * t->maxcount, sizeof(float));
+	if (t->start == NULL || t->count == NULL || t->weights == NULL) {
+		freetable(t);
+		return NULL;
+	}
+
+	for (i = 0; i < dst; i++) {
+		center = (i + 0.5) * src / dst;
+		start = center - support + 0.5;
+		stop = center + support + 0.5;
+		if (start < 0)
+			start = 0;
+		if (stop > (long)src)
+			stop = src;
+		if (stop - start > t->maxcount)
+			stop = start + t->maxcount;
+		if (stop <= start)
+			stop = start + 1;
+
+		w = &t->weights[i * t->maxcount];
+		density = 0.0;
+		for (j = start; j < stop; j++) {
+			w[j - start] = filterweight(filter,
+			    fabs((j + 0.5 - center) / scale));
+			density += w[j - start];
+		}
+		if (density == 0.0) {
+			/* Degenerate weights, fall back to the nearest pixel */
+			memset(w, 0, (stop - start) * sizeof(float));
+			w[(stop - start) / 2] = density = 1.0;
+		}
+		if (density != 1.0)
+			for (j = start; j < stop; j++)
+				w[j - start] /= density;
+		t->start[i] = start;
+		t->count[i] = stop - start;
+	}
+	return t;
+}
+
+static struct contrib_table *
+gettable(unsigned long src, unsigned long dst, FilterTypes filter,
+    double blur)
+{
+	struct contrib_table *t, **p, *nt;
+
+	pthread_mutex_lock(&tables_mtx);
+	for (p = &tables; (t = *p) != NULL; p = &t->next)
+		if (t->src == src && t->dst == dst && t->filter == filter &&
+		    t->blur == blur) {
+			/* Move to the front, the list is kept in LRU order */
+			*p = t->next;
+			t->next = tables;
+			tables = t;
+			t->refcnt++;
+			table_hits++;
+			pthread_mutex_unlock(&tables_mtx);
+			return t;
+		}
+	table_misses++;
+	pthread_mutex_unlock(&tables_mtx);
+
+	if ((nt = buildtable(src, dst, filter, blur)) == NULL)
+		return NULL;
+	/* One reference for the cache, one for the caller */
+	nt->refcnt = 2;
+
+	pthread_mutex_lock(&tables_mtx);
+	nt->next = tables;
+	tables = nt;
+	if (++ntables > MAXTABLES) {
+		for (p = &tables; (*p)->next != NULL; p = &(*p)->next)
+			;
+		t = *p;
+		*p = NULL;
+		ntables--;
+		if (--t->refcnt == 0)
+			freetable(t);
+	}
+	pthread_mutex_unlock(&tables_mtx);
+	return nt;
+}
+
+static void
+releasetable(struct contrib_table *t)
+{
+	int refcnt;
+
+	pthread_mutex_lock(&tables_mtx);
+	refcnt = --t->refcnt;
+	pthread_mutex_unlock(&tables_mtx);
+	if (refcnt == 0)
+		freetable(t);
+}
+
+/* Filter one row of RGBA floats horizontally */
+static void
+hpass(const struct contrib_table *t, const float *in, float *out)
+{
+	const float *w, *p;
+	float r, g, b, a;
+	unsigned long i;
+	int k;
+
+	for (i = 0; i < t->dst; i++) {
+		w = &t->weights[i * t->maxcount];
+		p = &in[t->start[i] * 4];
+		r = g = b = a = 0.0f;
+		for (k = 0; k < t->count[i]; k++, p += 4) {
+			r += w[k] * p[0];
+			g += w[k] * p[1];
+			b += w[k] * p[2];
+			a += w[k] * p[3];
+		}
+		out[i * 4] = r;
+		out[i * 4 + 1] = g;
+		out[i * 4 + 2] = b;
+		out[i * 4 + 3] = a;
+	}
+}
+
+/*
+ * Accumulate whole rows for the vertical pass.  Walking the rows keeps
+ * all memory accesses sequential and lets the compiler vectorize the
+ * inner loop.
+ */
+static void
+vpass(const struct contrib_table *t, unsigned long i, const float *in,
+    size_t rowlen, float *out)
+{
+	const float *w, *p;
+	size_t n;
+	int k;
+
+	w = &t->weights[i * t->maxcount];
+	memset(out, 0, rowlen * sizeof(float));
+	for (k = 0; k < t->count[i]; k++) {
+		p = &in[(t->start[i] + k) * rowlen];
+		for (n = 0; n < rowlen; n++)
+			out[n] += w[k] * p[n];
+	}
+}
+
+/*
+ * Filtering RGBA without weighting the colors by alpha bleeds the color
+ * of transparent pixels into the edges of opaque ones.
+ */
+static void
+premultiply(float *p, size_t npixels, float maxval)
+{
+	size_t n;
+	float f;
+
+	for (n = 0; n < npixels; n++, p += 4) {
+		f = p[3] / maxval;
+		p[0] *= f;
+		p[1] *= f;
+		p[2] *= f;
+	}
+}
+
+static void
+unpremultiply(float *p, size_t npixels, float maxval)
+{
+	size_t n;
+	float f;
+
+	for (n = 0; n < npixels; n++, p += 4) {
+		f = p[3] > 0.0f ? maxval / p[3] : 0.0f;
+		p[0] *= f;
+		p[1] *= f;
+		p[2] *= f;
+	}
+}
+
+/*
+ * Store RGBA pixels into the current image.  The alpha channel is dropped
+ * in place for images without matte, so that they do not gain one.
+ */
+static int
+storepixels(MagickWand *wand, unsigned long columns, unsigned long rows,
+    unsigned char *pixels, int wide, int matte)
+{
+	size_t n, npixels = (size_t)columns * rows;
+	unsigned short *sp = (unsigned short *)pixels;
+
+	if (matte)
+		return MagickSetImagePixels(wand, 0, 0, columns, rows, "RGBA",
+		    wide ? ShortPixel : CharPixel, pixels);
+	for (n = 0; n < npixels; n++)
+		if (wide) {
+			sp[n * 3] = sp[n * 4];
+			sp[n * 3 + 1] = sp[n * 4 + 1];
+			sp[n * 3 + 2] = sp[n * 4 + 2];
+		} else {
+			pixels[n * 3] = pixels[n * 4];
+			pixels[n * 3 + 1] = pixels[n * 4 + 1];
+			pixels[n * 3 + 2] = pixels[n * 4 + 2];
+		}
+	return MagickSetImagePixels(wand, 0, 0, columns, rows, "RGB",
+	    wide ? ShortPixel : CharPixel, pixels);
+}
+
+/*
+ * The pixels are exported as RGBA, which only holds all channels of RGB
+ * and gray images.  CMYK keeps black in the opacity channel.
+ */
+static int
+rgbimage(MagickWand *wand)
+{
+	switch (MagickGetImageColorspace(wand)) {
+	case RGBColorspace:
+	case sRGBColorspace:
+	case GRAYColorspace:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Resize the current image of wand to columns x rows.  8-bit images are
+ * processed as chars, deeper images as shorts.  The result is stored with
+ * EXIF orientation orient applied, columns and rows are the dimensions of
+ * the oriented image.  With linear set the samples are converted to linear
+ * light as they are loaded and back to sRGB as they are stored, so the
+ * filters work on linear values at no extra pass over the pixels.
+ * The source is read one row at a time; besides the output pixels only
+ * the horizontally filtered rows, columns x height, are held in memory.
+ * Returns -1, leaving the image unchanged, for colorspaces other than RGB
+ * and gray, the caller falls back to MagickResizeImage().
+ */
+int
+resample(MagickWand *wand, unsigned long columns, unsigned long rows,
+    FilterTypes filter, double blur, int orient, int linear)
+{
+	struct contrib_table *ht = NULL, *vt = NULL;
+	unsigned long width, height, x, y, c, ocolumns, orows;
+	unsigned char *pixels = NULL, *src = NULL, *line = NULL;
+	float *row = NULL, *tmp = NULL, *acc = NULL;
+	StorageType storage;
+	size_t n, rowlen, dst, psize;
+	float v, maxval;
+	int status = 0, wide, matte;
+
+	if (MagickGetNumberImages(wand) == 0 || columns == 0 || rows == 0 ||
+	    !(blur > 0.0 && blur <= MAXBLUR))
+		return 0;
+	if (!rgbimage(wand))
+		return -1;
+	ocolumns = columns;
+	orows = rows;
+	if (orient >= 5 && orient <= 8) {
+		columns = orows;
+		rows = ocolumns;
+	}
+	width = MagickGetImageWidth(wand);
+	height = MagickGetImageHeight(wand);
+	wide = MagickGetImageDepth(wand) > 8;
+	matte = MagickGetImageMatte(wand);
+	storage = wide ? ShortPixel : CharPixel;
+	maxval = wide ? 65535.0f : 255.0f;
+	psize = wide ? 8 : 4;
+	if (linear)
+		lineartables();
+
+	pixels = malloc((size_t)columns * rows * psize);
+	src = malloc(width * psize);
+	row = malloc(width * 4 * sizeof(float));
+	tmp = malloc(columns * height * 4 * sizeof(float));
+	acc = malloc(columns * 4 * sizeof(float));
+	line = malloc(columns * psize);
+	ht = gettable(width, columns, filter, blur);
+	vt = gettable(height, rows, filter, blur);
+	if (pixels == NULL || src == NULL || row == NULL || tmp == NULL ||
+	    acc == NULL || line == NULL || ht == NULL || vt == NULL)
+		goto done;
+
+	/* Neither pass reports progress, deadlines are checked per row */
+	for (y = 0; y < height; y++) {
+		if (interrupted() || !MagickGetImagePixels(wand, 0, y, width,
+		    1, "RGBA", storage, src))
+			goto done;
+		if (linear)
+			decodelinear(row, src, width, wide, 1);
+		else
+			for (n = 0; n < width * 4; n++)
+				row[n] = wide ?
+				    ((unsigned short *)src)[n] : src[n];
+		if (matte)
+			premultiply(row, width, maxval);
+		hpass(ht, row, &tmp[y * columns * 4]);
+	}
+
+	rowlen = columns * 4;
+	for (y = 0; y < rows; y++) {
+		if (interrupted())
+			goto done;
+		vpass(vt, y, tmp, rowlen, acc);
+		if (matte)
+			unpremultiply(acc, columns, maxval);
+		if (linear) {
+			encodelinear(line, acc, columns, wide, 1);
+			for (x = 0; x < columns; x++)
+				memcpy(&pixels[orientpixel(orient, x, y, columns,
+				    rows) * psize], &line[x * psize], psize);
+			continue;
+		}
+		for (x = 0; x < columns; x++) {
+			dst = orientpixel(orient, x, y, columns, rows) * 4;
+			for (c = 0; c < 4; c++) {
+				v = acc[x * 4 + c];
+				v = v < 0.0f ? 0.0f : v > maxval ? maxval : v;
+				if (wide)
+					((unsigned short *)pixels)[dst + c] =
+					    v + 0.5f;
+				else
+					pixels[dst + c] = v + 0.5f;
+			}
+		}
+	}
+
+	/* Sampling is the cheapest way to get an image of the new size */
+	if (MagickSampleImage(wand, ocolumns, orows))
+		status = storepixels(wand, ocolumns, orows, pixels, wide,
+		    matte);
+done:
+	if (ht != NULL)
+		releasetable(ht);
+	if (vt != NULL)
+		releasetable(vt);
+	free(pixels);
+	free(src);
+	free(row);
+	free(tmp);
+	free(acc);
+	free(line);
+	return status;
+}
+
+SIMD_CLONES static void
+gather(uint32_t *out, const uint32_t *in, const int32_t *xoff,
+    unsigned long n)
+{
+	unsigned long x;
+
+	for (x = 0; x < n; x++)
+		out[x] = in[xoff[x]];
+}
+
+/* Add each run of kx RGBA pixels of in to one pixel of acc */
+SIMD_CLONES static void
+boxrow(uint32_t *acc, const unsigned char *in, unsigned long n, int kx)
+{
+	unsigned long x;
+	int k;
+
+	for (x = 0; x < n; x++, in += kx * 4)
+		for (k = 0; k < kx; k++) {
+			acc[x * 4] += in[k * 4];
+			acc[x * 4 + 1] += in[k * 4 + 1];
+			acc[x * 4 + 2] += in[k * 4 + 2];
+			acc[x * 4 + 3] += in[k * 4 + 3];
+		}
+}
+
+/*
+ * Divide with rounding by multiplying with a 32 bit reciprocal, which is
+ * exact for sums of up to 4095 8-bit samples.
+ */
+SIMD_CLONES static void
+average(unsigned char *out, const uint32_t *acc, size_t n, uint32_t count)
+{
+	uint64_t m = ((uint64_t)1 << 32) / count + 1;
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		out[i] = ((acc[i] + count / 2) * m) >> 32;
+}
+
+/*
+ * Nearest neighbour sampling of RGB and gray images, picking the same
+ * source pixels as SampleImage().  Only Q8 builds take this path, at
+ * other quantum depths 8-bit pixels would not reproduce SampleImage().
+ * Returns -1 when the fast path does not apply or fails before the image
+ * is changed.
+ */
+int
+fastsample(MagickWand *wand, unsigned long columns, unsigned long rows)
+{
+	unsigned long width, height, x, y;
+	uint32_t *row = NULL, *out = NULL;
+	int32_t *xoff = NULL;
+	long yoff, last = -1;
+	int status = -1;
+
+	if (QuantumDepth != 8 || MagickGetNumberImages(wand) == 0 ||
+	    columns == 0 || rows == 0 || !rgbimage(wand))
+		return -1;
+	width = MagickGetImageWidth(wand);
+	height = MagickGetImageHeight(wand);
+	/* Cropping supplies the output image, so only reductions apply */
+	if (columns > width || rows > height || width > INT32_MAX)
+		return -1;
+
+	row = malloc(width * sizeof(uint32_t));
+	out = malloc(columns * rows * sizeof(uint32_t));
+	xoff = malloc(columns * sizeof(int32_t));
+	if (row == NULL || out == NULL || xoff == NULL)
+		goto done;
+
+	for (x = 0; x < columns; x++)
+		xoff[x] = ((double)x + 0.5) * width / columns;
+	for (y = 0; y < rows; y++) {
+		yoff = ((double)y + 0.5) * height / rows;
+		if (yoff != last && !MagickGetImagePixels(wand, 0, yoff, width,
+		    1, "RGBA", CharPixel, (unsigned char *)row))
+			goto done;
+		last = yoff;
+		gather(&out[y * columns], row, xoff, columns);
+	}
+
+	/* Once cropped, the image can not be handed to the fallback */
+	if (MagickCropImage(wand, columns, rows, 0, 0))
+		status = storepixels(wand, columns, rows,
+		    (unsigned char *)out, 0, MagickGetImageMatte(wand));
+done:
+	free(row);
+	free(out);
+	free(xoff);
+	return status;
+}
+
+/*
+ * Box averaging of RGB and gray images reduced by integer factors, where
+ * the area averaging of ScaleImage() is a plain box filter.  As with
+ * fastsample(), only Q8 builds take this path.  Returns -1 when the fast
+ * path does not apply or fails before the image is changed.
+ */
+int
+fastscale(MagickWand *wand, unsigned long columns, unsigned long rows)
+{
+	unsigned long width, height, y;
+	unsigned char *row = NULL, *out = NULL;
+	uint32_t *acc = NULL;
+	int kx, ky, k, status = -1;
+
+	if (QuantumDepth != 8 || MagickGetNumberImages(wand) == 0 ||
+	    columns == 0 || rows == 0 || !rgbimage(wand))
+		return -1;
+	width = MagickGetImageWidth(wand);
+	height = MagickGetImageHeight(wand);
+	if (columns > width || rows > height || width % columns ||
+	    height % rows)
+		return -1;
+	kx = width / columns;
+	ky = height / rows;
+	if ((long)kx * ky >= 4096)
+		return -1;
+
+	row = malloc(width * 4);
+	out = malloc(columns * rows * 4);
+	acc = malloc(columns * 4 * sizeof(uint32_t));
+	if (row == NULL || out == NULL || acc == NULL)
+		goto done;
+
+	for (y = 0; y < rows; y++) {
+		memset(acc, 0, columns * 4 * sizeof(uint32_t));
+		for (k = 0; k < ky; k++) {
+			if (!MagickGetImagePixels(wand, 0, y * ky + k, width, 1,
+			    "RGBA", CharPixel, row))
+				goto done;
+			boxrow(acc, row, columns, kx);
+		}
+		average(&out[y * columns * 4], acc, columns * 4, kx * ky);
+	}
+
+	if (MagickCropImage(wand, columns, rows, 0, 0))
+		status = storepixels(wand, columns, rows, out, 0,
+		    MagickGetImageMatte(wand));
+done:
+	free(row);
+	free(out);
+	free(acc);
+	return status;
+}
+
+static int
+resizeCacheStats(lua_State *L)
+{
+	lua_Integer entries, hits, misses;
+
+	pthread_mutex_lock(&tables_mtx);
+	entries = ntables;
+	hits = table_hits;
+	misses = table_misses;
+	pthread_mutex_unlock(&tables_mtx);
+
+	lua_createtable(L, 0, 3);
+	lua_pushinteger(L, entries);
+	lua_setfield(L, -2, "entries");
+	lua_pushinteger(L, hits);
+	lua_setfield(L, -2, "hits");
+	lua_pushinteger(L, misses);
+	lua_setfield(L, -2, "misses");
+	return 1;
+}
+
+struct luaL_Reg resample_functions[] = {
+	{ "resizeCacheStats",	resizeCacheStats },
+	{ NULL, NULL }
+};
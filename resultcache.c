@@ -0,0 +1,907 @@
+/*
+ * Copyright (c) 2016, 2017 Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of Micro Systems Marc Balmer nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Rendered result cache for GraphicsMagick for Lua */
+
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <dirent.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+#include <wand/magick_wand.h>
+
+#include "luagraphicsmagick.h"
+
+#define NBUCKETS		1024
+
+struct result_entry {
+	char			*key;
+	size_t			 keylen;
+	char			*blob;
+	size_t			 len;
+	struct result_entry	*hnext;
+	struct result_entry	*prev;
+	struct result_entry	*next;
+};
+
+/* A result that is being computed, concurrent fetches wait for it */
+struct flight {
+	char			*key;
+	size_t			 keylen;
+	pthread_t		 owner;		/* thread calling fn */
+	int			 done;
+	int			 waiters;
+	char			*blob;
+	size_t			 len;
+	pthread_cond_t		 cond;
+	struct flight		*next;
+};
+
+struct result_cache {
+	char			*name;
+	int			 refcnt;
+	pthread_mutex_t		 mtx;
+	struct result_entry	*buckets[NBUCKETS];
+	struct result_entry	*head;
+	struct result_entry	*tail;
+	size_t			 size;
+	size_t			 limit;
+	char			*dir;
+	size_t			 disk_size;
+	size_t			 disk_limit;
+	size_t			 disk_added;	/* bytes written */
+	int			 trimming;
+	struct flight		*flights;
+	uint64_t		 hits;
+	uint64_t		 disk_hits;
+	uint64_t		 misses;
+	uint64_t		 coalesced;
+	struct result_cache	*next;
+};
+
+/* Named caches are shared by all Lua states of the process */
+static pthread_mutex_t caches_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct result_cache *caches;
+
+static unsigned int
+bucket(const char *key, size_t keylen)
+{
+	uint64_t h[2] = { 0, 0 };
+
+	hashbytes((const unsigned char *)key, keylen, h);
+	return h[0] % NBUCKETS;
+}
+
+static struct result_entry *
+lookup(struct result_cache *rc, const char *key, size_t keylen)
+{
+	struct result_entry *e;
+
+	for (e = rc->buckets[bucket(key, keylen)]; e != NULL; e = e->hnext)
+		if (e->keylen == keylen && !memcmp(e->key, key, keylen))
+			break;
+	return e;
+}
+
+static void
+unlink_lru(struct result_cache *rc, struct result_entry *e)
+{
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		rc->head = e->next;
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		rc->tail = e->prev;
+	e->prev = e->next = NULL;
+}
+
+static void
+push_lru(struct result_cache *rc, struct result_entry *e)
+{
+	e->prev = NULL;
+	e->next = rc->head;
+	if (rc->head)
+		rc->head->prev = e;
+	rc->head = e;
+	if (rc->tail == NULL)
+		rc->tail = e;
+}
+
+static void
+evict(struct result_cache *rc, struct result_entry *e)
+{
+	struct result_entry **p;
+
+	for (p = &rc->buckets[bucket(e->key, e->keylen)]; *p != e;
+	    p = &(*p)->hnext)
+		;
+	*p = e->hnext;
+	unlink_lru(rc, e);
+	rc->size -= e->len;
+	free(e->key);
+	free(e->blob);
+	free(e);
+}
+
+static void
+memput(struct result_cache *rc, const char *key, size_t keylen,
+    const char *blob, size_t len)
+{
+	struct result_entry *e;
+	unsigned int b;
+
+	if (len > rc->limit)
+		return;
+	if ((e = lookup(rc, key, keylen)) != NULL)
+		evict(rc, e);
+
+	e = calloc(1, sizeof(struct result_entry));
+	if (e == NULL)
+		return;
+	e->key = malloc(keylen);
+	e->blob = malloc(len ? len : 1);
+	if (e->key == NULL || e->blob == NULL) {
+		free(e->key);
+		free(e->blob);
+		free(e);
+		return;
+	}
+	memcpy(e->key, key, keylen);
+	e->keylen = keylen;
+	memcpy(e->blob, blob, len);
+	e->len = len;
+
+	b = bucket(key, keylen);
+	e->hnext = rc->buckets[b];
+	rc->buckets[b] = e;
+	push_lru(rc, e);
+	rc->size += len;
+	while (rc->tail != NULL && rc->size > rc->limit)
+		evict(rc, rc->tail);
+}
+
+static void
+diskpath(struct result_cache *rc, const char *key, size_t keylen,
+    char *path, size_t pathlen)
+{
+	uint64_t h[2] = { 0, 0 };
+
+	hashbytes((const unsigned char *)key, keylen, h);
+	snprintf(path, pathlen, "%s/%016llx%016llx", rc->dir,
+	    (unsigned long long)h[0], (unsigned long long)h[1]);
+}
+
+static size_t
+diskusage(struct result_cache *rc)
+{
+	DIR *dir;
+	struct dirent *de;
+	struct stat sb;
+	char path[1024];
+	size_t total = 0;
+
+	if ((dir = opendir(rc->dir)) == NULL)
+		return 0;
+	while ((de = readdir(dir)) != NULL) {
+		if (de->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof path, "%s/%s", rc->dir, de->d_name);
+		if (stat(path, &sb) == 0 && S_ISREG(sb.st_mode))
+			total += sb.st_size;
+	}
+	closedir(dir);
+	return total;
+}
+
+struct diskfile {
+	time_t	mtime;
+	off_t	size;
+	char	name[40];
+};
+
+static int
+oldestfirst(const void *a, const void *b)
+{
+	const struct diskfile *fa = a, *fb = b;
+
+	return (fa->mtime > fb->mtime) - (fa->mtime < fb->mtime);
+}
+
+/*
+ * Remove least recently used files until the disk tier is a tenth below
+ * its limit, so that the directory is not scanned on every put once the
+ * tier is full.  Runs without the lock, added is the value of disk_added
+ * when the trim was started.
+ */
+static void
+disktrim(struct result_cache *rc, size_t added)
+{
+	DIR *dir;
+	struct dirent *de;
+	struct stat sb;
+	struct diskfile *files = NULL, *nfiles;
+	size_t n = 0, nalloc = 0, i, total = 0, target;
+	char path[1024];
+
+	if ((dir = opendir(rc->dir)) == NULL) {
+		pthread_mutex_lock(&rc->mtx);
+		rc->trimming = 0;
+		pthread_mutex_unlock(&rc->mtx);
+		return;
+	}
+	while ((de = readdir(dir)) != NULL) {
+		if (de->d_name[0] == '.' ||
+		    strlen(de->d_name) >= sizeof files->name)
+			continue;
+		snprintf(path, sizeof path, "%s/%s", rc->dir, de->d_name);
+		if (stat(path, &sb) == -1 || !S_ISREG(sb.st_mode))
+			continue;
+		if (n == nalloc) {
+			nalloc = nalloc ? nalloc * 2 : 256;
+			nfiles = realloc(files, nalloc * sizeof *files);
+			if (nfiles == NULL)
+				break;
+			files = nfiles;
+		}
+		files[n].mtime = sb.st_mtime;
+		files[n].size = sb.st_size;
+		strcpy(files[n].name, de->d_name);
+		total += sb.st_size;
+		n++;
+	}
+	closedir(dir);
+
+	target = rc->disk_limit - rc->disk_limit / 10;
+	qsort(files, n, sizeof *files, oldestfirst);
+	for (i = 0; i < n && total > target; i++) {
+		snprintf(path, sizeof path, "%s/%s", rc->dir, files[i].name);
+		if (unlink(path) == 0)
+			total -= files[i].size;
+	}
+	free(files);
+
+	pthread_mutex_lock(&rc->mtx);
+	rc->disk_size = total + (rc->disk_added - added);
+	rc->trimming = 0;
+	pthread_mutex_unlock(&rc->mtx);
+}
+
+/*
+ * Disk entries start with the length of the key and the key itself so
+ * that hash collisions are detected on read.  Files are written under a
+ * temporary name and renamed into place, readers never see a partial
+ * entry.
+ */
+static void
+diskput(struct result_cache *rc, const char *key, size_t keylen,
+    const char *blob, size_t len)
+{
+	FILE *fp;
+	char path[1024], tmp[1024];
+	uint64_t klen = keylen;
+	size_t added;
+	int fd, trim;
+
+	if (rc->dir == NULL || len > rc->disk_limit)
+		return;
+
+	diskpath(rc, key, keylen, path, sizeof path);
+	snprintf(tmp, sizeof tmp, "%s/.tmp.XXXXXX", rc->dir);
+	if ((fd = mkstemp(tmp)) == -1)
+		return;
+	if ((fp = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+	if (fwrite(&klen, sizeof klen, 1, fp) != 1 ||
+	    fwrite(key, 1, keylen, fp) != keylen ||
+	    fwrite(blob, 1, len, fp) != len) {
+		fclose(fp);
+		unlink(tmp);
+		return;
+	}
+	if (fclose(fp) || rename(tmp, path)) {
+		unlink(tmp);
+		return;
+	}
+
+	pthread_mutex_lock(&rc->mtx);
+	rc->disk_size += sizeof klen + keylen + len;
+	rc->disk_added += sizeof klen + keylen + len;
+	trim = rc->disk_size > rc->disk_limit && !rc->trimming;
+	if (trim)
+		rc->trimming = 1;
+	added = rc->disk_added;
+	pthread_mutex_unlock(&rc->mtx);
+
+	if (trim)
+		disktrim(rc, added);
+}
+
+static char *
+diskget(struct result_cache *rc, const char *key, size_t keylen,
+    size_t *len)
+{
+	FILE *fp;
+	struct stat sb;
+	char path[1024], *k, *blob;
+	uint64_t klen;
+
+	if (rc->dir == NULL)
+		return NULL;
+
+	diskpath(rc, key, keylen, path, sizeof path);
+	if ((fp = fopen(path, "r")) == NULL)
+		return NULL;
+	if (fstat(fileno(fp), &sb) == -1 ||
+	    fread(&klen, sizeof klen, 1, fp) != 1 || klen != keylen ||
+	    (uint64_t)sb.st_size < sizeof klen + klen) {
+		fclose(fp);
+		return NULL;
+	}
+	*len = sb.st_size - sizeof klen - klen;
+	k = malloc(keylen ? keylen : 1);
+	blob = malloc(*len ? *len : 1);
+	if (k == NULL || blob == NULL ||
+	    fread(k, 1, keylen, fp) != keylen || memcmp(k, key, keylen) ||
+	    fread(blob, 1, *len, fp) != *len) {
+		free(k);
+		free(blob);
+		fclose(fp);
+		return NULL;
+	}
+	free(k);
+	fclose(fp);
+	utimes(path, NULL);
+	return blob;
+}
+
+static struct result_cache **
+checkcache(lua_State *L, int index)
+{
+	struct result_cache **rc;
+
+	rc = checkudata(L, index, RESULT_CACHE_METATABLE);
+	if (*rc == NULL)
+		luaL_argerror(L, index, "destroyed result cache");
+	return rc;
+}
+
+static int
+pushlstring(lua_State *L)
+{
+	lua_pushlstring(L, lua_touserdata(L, 1), lua_tointeger(L, 2));
+	return 1;
+}
+
+/* Push blob and free it, also when pushing it raises an error */
+static void
+pushblob(lua_State *L, char *blob, size_t len)
+{
+	int status;
+
+	lua_pushcfunction(L, pushlstring);
+	lua_pushlightuserdata(L, blob);
+	lua_pushinteger(L, len);
+	status = lua_pcall(L, 2, 1, 0);
+	free(blob);
+	if (status != LUA_OK)
+		lua_error(L);
+}
+
+/* Look up key in memory, then on disk, the caller holds the lock */
+static char *
+cacheget(struct result_cache *rc, const char *key, size_t keylen,
+    size_t *len)
+{
+	struct result_entry *e;
+	char *blob;
+
+	if ((e = lookup(rc, key, keylen)) != NULL) {
+		unlink_lru(rc, e);
+		push_lru(rc, e);
+		if ((blob = malloc(e->len ? e->len : 1)) == NULL)
+			return NULL;
+		memcpy(blob, e->blob, e->len);
+		*len = e->len;
+		rc->hits++;
+		return blob;
+	}
+
+	pthread_mutex_unlock(&rc->mtx);
+	blob = diskget(rc, key, keylen, len);
+	pthread_mutex_lock(&rc->mtx);
+	if (blob != NULL) {
+		memput(rc, key, keylen, blob, *len);
+		rc->disk_hits++;
+	}
+	return blob;
+}
+
+static int
+get(lua_State *L)
+{
+	struct result_cache *rc;
+	const char *key;
+	char *blob;
+	size_t keylen, len;
+
+	rc = *checkcache(L, 1);
+	key = luaL_checklstring(L, 2, &keylen);
+
+	pthread_mutex_lock(&rc->mtx);
+	blob = cacheget(rc, key, keylen, &len);
+	if (blob == NULL)
+		rc->misses++;
+	pthread_mutex_unlock(&rc->mtx);
+
+	if (blob == NULL)
+		lua_pushnil(L);
+	else
+		pushblob(L, blob, len);
+	return 1;
+}
+
+static int
+put(lua_State *L)
+{
+	struct result_cache *rc;
+	const char *key, *blob;
+	size_t keylen, len;
+
+	rc = *checkcache(L, 1);
+	key = luaL_checklstring(L, 2, &keylen);
+	blob = luaL_checklstring(L, 3, &len);
+
+	pthread_mutex_lock(&rc->mtx);
+	memput(rc, key, keylen, blob, len);
+	pthread_mutex_unlock(&rc->mtx);
+	diskput(rc, key, keylen, blob, len);
+	return 0;
+}
+
+static void
+releaseflight(struct result_cache *rc, struct flight *f)
+{
+	struct flight **p;
+
+	if (--f->waiters > 0)
+		return;
+	for (p = &rc->flights; *p != NULL; p = &(*p)->next)
+		if (*p == f) {
+			*p = f->next;
+			break;
+		}
+	pthread_cond_destroy(&f->cond);
+	free(f->key);
+	free(f->blob);
+	free(f);
+}
+
+/*
+ * cache:fetch(key, fn, ...) returns the cached result for key or calls
+ * fn(...) to compute it.  When several threads fetch the same key at the
+ * same time, only one of them calls fn, the others wait for its result.
+ * fn fetching its own key on the same thread would wait for itself, that
+ * raises an error instead.
+ */
+static int
+fetch(lua_State *L)
+{
+	struct result_cache *rc;
+	struct flight *f;
+	const char *key, *result;
+	char *blob;
+	size_t keylen, len;
+	int status;
+
+	rc = *checkcache(L, 1);
+	key = luaL_checklstring(L, 2, &keylen);
+	luaL_checktype(L, 3, LUA_TFUNCTION);
+
+	pthread_mutex_lock(&rc->mtx);
+	for (;;) {
+		if ((blob = cacheget(rc, key, keylen, &len)) != NULL) {
+			pthread_mutex_unlock(&rc->mtx);
+			pushblob(L, blob, len);
+			return 1;
+		}
+		for (f = rc->flights; f != NULL; f = f->next)
+			if (f->keylen == keylen && !memcmp(f->key, key, keylen))
+				break;
+		if (f == NULL)
+			break;
+		if (pthread_equal(f->owner, pthread_self())) {
+			pthread_mutex_unlock(&rc->mtx);
+			return luaL_error(L, "recursive fetch of a key that "
+			    "is being computed");
+		}
+
+		f->waiters++;
+		rc->coalesced++;
+		while (!f->done)
+			pthread_cond_wait(&f->cond, &rc->mtx);
+		if (f->blob != NULL) {
+			blob = malloc(f->len ? f->len : 1);
+			len = f->len;
+			if (blob != NULL)
+				memcpy(blob, f->blob, len);
+			releaseflight(rc, f);
+			pthread_mutex_unlock(&rc->mtx);
+			if (blob == NULL)
+				return luaL_error(L, "memory error");
+			pushblob(L, blob, len);
+			return 1;
+		}
+		/* The computing thread failed, try ourselves */
+		releaseflight(rc, f);
+	}
+
+	rc->misses++;
+	f = calloc(1, sizeof(struct flight));
+	if (f == NULL || (f->key = malloc(keylen ? keylen : 1)) == NULL) {
+		free(f);
+		pthread_mutex_unlock(&rc->mtx);
+		return luaL_error(L, "memory error");
+	}
+	memcpy(f->key, key, keylen);
+	f->keylen = keylen;
+	f->owner = pthread_self();
+	f->waiters = 1;
+	pthread_cond_init(&f->cond, NULL);
+	f->next = rc->flights;
+	rc->flights = f;
+	pthread_mutex_unlock(&rc->mtx);
+
+	status = lua_pcall(L, lua_gettop(L) - 3, 1, 0);
+	result = NULL;
+	if (status == LUA_OK && lua_type(L, -1) == LUA_TSTRING)
+		result = lua_tolstring(L, -1, &len);
+
+	if (result != NULL)
+		diskput(rc, key, keylen, result, len);
+
+	pthread_mutex_lock(&rc->mtx);
+	if (result != NULL) {
+		memput(rc, key, keylen, result, len);
+		if ((f->blob = malloc(len ? len : 1)) != NULL) {
+			memcpy(f->blob, result, len);
+			f->len = len;
+		}
+	}
+	f->done = 1;
+	pthread_cond_broadcast(&f->cond);
+	releaseflight(rc, f);
+	pthread_mutex_unlock(&rc->mtx);
+
+	if (status != LUA_OK)
+		return lua_error(L);
+	return 1;
+}
+
+static int
+remove_(lua_State *L)
+{
+	struct result_cache *rc;
+	struct result_entry *e;
+	const char *key;
+	char path[1024];
+	size_t keylen;
+
+	rc = *checkcache(L, 1);
+	key = luaL_checklstring(L, 2, &keylen);
+
+	pthread_mutex_lock(&rc->mtx);
+	if ((e = lookup(rc, key, keylen)) != NULL)
+		evict(rc, e);
+	pthread_mutex_unlock(&rc->mtx);
+	if (rc->dir != NULL) {
+		diskpath(rc, key, keylen, path, sizeof path);
+		unlink(path);
+	}
+	return 0;
+}
+
+static int
+cacheStats(lua_State *L)
+{
+	struct result_cache *rc;
+	struct result_entry *e;
+	lua_Integer entries = 0, size, disk_size, hits, disk_hits, misses;
+	lua_Integer coalesced;
+
+	rc = *checkcache(L, 1);
+
+	pthread_mutex_lock(&rc->mtx);
+	for (e = rc->head; e != NULL; e = e->next)
+		entries++;
+	size = rc->size;
+	disk_size = rc->disk_size;
+	hits = rc->hits;
+	disk_hits = rc->disk_hits;
+	misses = rc->misses;
+	coalesced = rc->coalesced;
+	pthread_mutex_unlock(&rc->mtx);
+
+	lua_createtable(L, 0, 7);
+	lua_pushinteger(L, entries);
+	lua_setfield(L, -2, "entries");
+	lua_pushinteger(L, size);
+	lua_setfield(L, -2, "size");
+	lua_pushinteger(L, disk_size);
+	lua_setfield(L, -2, "diskSize");
+	lua_pushinteger(L, hits);
+	lua_setfield(L, -2, "hits");
+	lua_pushinteger(L, disk_hits);
+	lua_setfield(L, -2, "diskHits");
+	lua_pushinteger(L, misses);
+	lua_setfield(L, -2, "misses");
+	lua_pushinteger(L, coalesced);
+	lua_setfield(L, -2, "coalesced");
+	return 1;
+}
+
+static void
+freecache(struct result_cache *rc)
+{
+	while (rc->tail != NULL)
+		evict(rc, rc->tail);
+	pthread_mutex_destroy(&rc->mtx);
+	free(rc->name);
+	free(rc->dir);
+	free(rc);
+}
+
+static int
+destroy(lua_State *L)
+{
+	struct result_cache **rc, **p;
+
+	rc = checkudata(L, 1, RESULT_CACHE_METATABLE);
+	if (*rc == NULL)
+		return 0;
+
+	pthread_mutex_lock(&caches_mtx);
+	if (--(*rc)->refcnt == 0) {
+		for (p = &caches; *p != NULL; p = &(*p)->next)
+			if (*p == *rc) {
+				*p = (*rc)->next;
+				break;
+			}
+		freecache(*rc);
+	}
+	pthread_mutex_unlock(&caches_mtx);
+	*rc = NULL;
+	return 0;
+}
+
+static size_t
+optsize(lua_State *L, const char *field, size_t def)
+{
+	lua_Integer size;
+	int isnum;
+
+	lua_getfield(L, 1, field);
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		return def;
+	}
+	size = lua_tointegerx(L, -1, &isnum);
+	if (!isnum || size < 0)
+		luaL_argerror(L, 1, "sizes must be non-negative integers");
+	lua_pop(L, 1);
+	return size;
+}
+
+/* Options left out, SIZE_MAX or NULL, match any cache */
+static int
+sameoptions(struct result_cache *rc, size_t memory, size_t disk,
+    const char *dir)
+{
+	if (memory != SIZE_MAX && memory != rc->limit)
+		return 0;
+	if (disk != SIZE_MAX && disk != rc->disk_limit)
+		return 0;
+	if (dir != NULL && (rc->dir == NULL || strcmp(dir, rc->dir)))
+		return 0;
+	return 1;
+}
+
+/*
+ * graphicsmagick.newResultCache{ name = 'thumbs', memory = bytes,
+ *     directory = path, disk = bytes }
+ *
+ * A name that is already in use returns the existing cache, options that
+ * differ from the ones it was created with raise an error.
+ */
+static int
+newResultCache(lua_State *L)
+{
+	struct result_cache *rc, **rcp;
+	const char *name = NULL, *dir = NULL;
+	size_t memory, disk;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+
+	if (lua_getfield(L, 1, "name") == LUA_TSTRING)
+		name = lua_tostring(L, -1);
+	if (lua_getfield(L, 1, "directory") == LUA_TSTRING)
+		dir = lua_tostring(L, -1);
+	memory = optsize(L, "memory", SIZE_MAX);
+	disk = optsize(L, "disk", SIZE_MAX);
+
+	rcp = lua_newuserdata(L, sizeof(struct result_cache *));
+	*rcp = NULL;
+	luaL_setmetatable(L, RESULT_CACHE_METATABLE);
+
+	pthread_mutex_lock(&caches_mtx);
+	if (name != NULL)
+		for (rc = caches; rc != NULL; rc = rc->next)
+			if (rc->name != NULL && !strcmp(rc->name, name)) {
+				if (!sameoptions(rc, memory, disk, dir)) {
+					pthread_mutex_unlock(&caches_mtx);
+					return luaL_error(L, "result cache "
+					    "'%s' exists with different "
+					    "options", name);
+				}
+				rc->refcnt++;
+				*rcp = rc;
+				pthread_mutex_unlock(&caches_mtx);
+				return 1;
+			}
+	pthread_mutex_unlock(&caches_mtx);
+
+	if ((rc = calloc(1, sizeof(struct result_cache))) == NULL)
+		return luaL_error(L, "memory error");
+	rc->limit = memory != SIZE_MAX ? memory : 64 * 1024 * 1024;
+	rc->disk_limit = disk != SIZE_MAX ? disk : 1024 * 1024 * 1024;
+	if ((name != NULL && (rc->name = strdup(name)) == NULL) ||
+	    (dir != NULL && (rc->dir = strdup(dir)) == NULL)) {
+		free(rc->name);
+		free(rc);
+		return luaL_error(L, "memory error");
+	}
+	if (rc->dir != NULL) {
+		mkdir(rc->dir, 0700);
+		rc->disk_size = diskusage(rc);
+	}
+	pthread_mutex_init(&rc->mtx, NULL);
+	rc->refcnt = 1;
+
+	pthread_mutex_lock(&caches_mtx);
+	rc->next = caches;
+	caches = rc;
+	pthread_mutex_unlock(&caches_mtx);
+	*rcp = rc;
+	return 1;
+}
+
+/*
+ * The pieces of a key are collected in the table at index t, the stack
+ * can not be used while a luaL_Buffer is active.
+ */
+static void
+addkey(lua_State *L, int t, int *n, int index, int depth)
+{
+	size_t len;
+	int i;
+
+	if (depth > 16)
+		luaL_error(L, "key description nested too deeply");
+
+	index = lua_absindex(L, index);
+	switch (lua_type(L, index)) {
+	case LUA_TNIL:
+		lua_pushliteral(L, "n");
+		lua_rawseti(L, t, ++*n);
+		break;
+	case LUA_TBOOLEAN:
+		lua_pushstring(L, lua_toboolean(L, index) ? "t" : "f");
+		lua_rawseti(L, t, ++*n);
+		break;
+	case LUA_TNUMBER:
+	case LUA_TSTRING:
+		lua_pushvalue(L, index);
+		lua_tolstring(L, -1, &len);
+		lua_pushfstring(L, "%c%d:",
+		    lua_type(L, index) == LUA_TNUMBER ? '#' : '$', (int)len);
+		lua_rawseti(L, t, ++*n);
+		lua_rawseti(L, t, ++*n);
+		break;
+	case LUA_TTABLE:
+		/* Only the array part, pipeline descriptions are lists */
+		lua_pushliteral(L, "[");
+		lua_rawseti(L, t, ++*n);
+		for (i = 1; lua_rawgeti(L, index, i) != LUA_TNIL; i++) {
+			addkey(L, t, n, -1, depth + 1);
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 1);
+		lua_pushliteral(L, "]");
+		lua_rawseti(L, t, ++*n);
+		break;
+	default:
+		luaL_error(L, "%s can not be part of a key",
+		    luaL_typename(L, index));
+	}
+}
+
+/*
+ * graphicsmagick.pipelineKey(source, ops, format, ...) turns a pipeline
+ * description made of strings, numbers, booleans and nested lists into a
+ * cache key.  The key is the canonical description itself, not a hash of
+ * it, so different pipelines can never share a cached result.
+ */
+static int
+pipelineKey(lua_State *L)
+{
+	luaL_Buffer b;
+	int i, n = 0, t, top;
+
+	top = lua_gettop(L);
+	lua_newtable(L);
+	t = lua_gettop(L);
+	for (i = 1; i <= top; i++)
+		addkey(L, t, &n, i, 0);
+
+	luaL_buffinit(L, &b);
+	for (i = 1; i <= n; i++) {
+		lua_rawgeti(L, t, i);
+		luaL_addvalue(&b);
+	}
+	luaL_pushresult(&b);
+	return 1;
+}
+
+struct luaL_Reg result_cache_methods[] = {
+	{ "get",		get },
+	{ "put",		put },
+	{ "fetch",		fetch },
+	{ "remove",		remove_ },
+	{ "stats",		cacheStats },
+	{ "destroy",		destroy },
+	{ "__gc",		destroy },
+	{ NULL, NULL }
+};
+
+struct luaL_Reg resultcache_functions[] = {
+	{ "newResultCache",	newResultCache },
+	{ "pipelineKey",	pipelineKey },
+	{ NULL, NULL }
+};
@@ -0,0 +1,290 @@
+/*
+ * Copyright (c) 2016, 2017 Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of Micro Systems Marc Balmer nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Per-operation statistics for GraphicsMagick for Lua */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+#include <wand/magick_wand.h>
+
+#include "luagraphicsmagick.h"
+
+#define MAXFORMATS	64
+
+/*
+ * All counters are process wide and only ever updated with atomic
+ * operations, so any number of Lua states may record into them
+ * concurrently.  Recording is off until enableStats(true) is called.
+ */
+struct format_stats {
+	atomic_int		state;	/* 0 free, 1 claimed, 2 ready */
+	char			name[16];
+	atomic_uint_fast64_t	decodes;
+	atomic_uint_fast64_t	decoded;
+	atomic_uint_fast64_t	encodes;
+	atomic_uint_fast64_t	encoded;
+};
+
+atomic_int stats_enabled;
+
+static struct method_stats *magick_stats;
+static size_t nmagick_stats;
+static pthread_once_t magick_stats_once = PTHREAD_ONCE_INIT;
+
+static struct format_stats formats[MAXFORMATS];
+
+static void
+allocstats(void)
+{
+	struct method_stats *st;
+	size_t n;
+
+	for (n = 0; magick_wand_methods[n].name != NULL; n++)
+		;
+	magick_stats = calloc(n, sizeof(struct method_stats));
+	if (magick_stats == NULL)
+		return;
+	for (nmagick_stats = 0; nmagick_stats < n; nmagick_stats++) {
+		st = &magick_stats[nmagick_stats];
+		st->name = magick_wand_methods[nmagick_stats].name;
+		if (!strncmp(st->name, "read", 4) ||
+		    !strncmp(st->name, "write", 5))
+			st->category = "coder";
+		else
+			st->category = "MagickWand";
+	}
+}
+
+struct method_stats *
+magickstats(const char *name)
+{
+	size_t n;
+
+	pthread_once(&magick_stats_once, allocstats);
+	for (n = 0; n < nmagick_stats; n++)
+		if (!strcmp(magick_stats[n].name, name))
+			return &magick_stats[n];
+	return NULL;
+}
+
+uint64_t
+imagepixels(MagickWand *wand)
+{
+	if (wand == NULL || MagickGetNumberImages(wand) == 0)
+		return 0;
+	return (uint64_t)MagickGetImageWidth(wand) *
+	    MagickGetImageHeight(wand);
+}
+
+static void
+atomicmax(atomic_uint_fast64_t *p, uint64_t val)
+{
+	uint_fast64_t cur;
+
+	cur = atomic_load_explicit(p, memory_order_relaxed);
+	while (cur < val && !atomic_compare_exchange_weak_explicit(p, &cur,
+	    val, memory_order_relaxed, memory_order_relaxed))
+		;
+}
+
+void
+recordcall(struct method_stats *st, uint64_t nsec, uint64_t pixels_in,
+    uint64_t pixels_out)
+{
+	atomic_fetch_add_explicit(&st->calls, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&st->nsec, nsec, memory_order_relaxed);
+	atomic_fetch_add_explicit(&st->pixels_in, pixels_in,
+	    memory_order_relaxed);
+	atomic_fetch_add_explicit(&st->pixels_out, pixels_out,
+	    memory_order_relaxed);
+	atomicmax(&st->max_nsec, nsec);
+}
+
+static struct format_stats *
+formatstats(const char *name)
+{
+	struct format_stats *fs;
+	int n, state;
+
+	for (n = 0; n < MAXFORMATS; n++) {
+		fs = &formats[n];
+		state = atomic_load(&fs->state);
+		if (state == 0 && atomic_compare_exchange_strong(&fs->state,
+		    &state, 1)) {
+			snprintf(fs->name, sizeof fs->name, "%s", name);
+			atomic_store(&fs->state, 2);
+			return fs;
+		}
+
+		/* Wait for a slot being claimed, it may be for this format */
+		while (state == 1)
+			state = atomic_load(&fs->state);
+		if (!strncmp(fs->name, name, sizeof fs->name - 1))
+			return fs;
+	}
+	return NULL;
+}
+
+void
+recordformat(MagickWand *wand, uint64_t decoded, uint64_t encoded)
+{
+	struct format_stats *fs;
+	char *format;
+
+	if (!atomic_load_explicit(&stats_enabled, memory_order_relaxed) ||
+	    wand == NULL || MagickGetNumberImages(wand) == 0)
+		return;
+
+	format = MagickGetImageFormat(wand);
+	if (format == NULL)
+		return;
+	fs = formatstats(format);
+	free(format);
+	if (fs == NULL)
+		return;
+
+	if (decoded) {
+		atomic_fetch_add_explicit(&fs->decodes, 1,
+		    memory_order_relaxed);
+		atomic_fetch_add_explicit(&fs->decoded, decoded,
+		    memory_order_relaxed);
+	}
+	if (encoded) {
+		atomic_fetch_add_explicit(&fs->encodes, 1,
+		    memory_order_relaxed);
+		atomic_fetch_add_explicit(&fs->encoded, encoded,
+		    memory_order_relaxed);
+	}
+}
+
+static void
+setcounter(lua_State *L, const char *name, atomic_uint_fast64_t *counter)
+{
+	lua_pushinteger(L, atomic_load_explicit(counter,
+	    memory_order_relaxed));
+	lua_setfield(L, -2, name);
+}
+
+static void
+settime(lua_State *L, const char *name, atomic_uint_fast64_t *counter)
+{
+	lua_pushnumber(L, atomic_load_explicit(counter,
+	    memory_order_relaxed) / 1e9);
+	lua_setfield(L, -2, name);
+}
+
+static int
+stats(lua_State *L)
+{
+	struct method_stats *st;
+	struct format_stats *fs;
+	size_t n;
+
+	pthread_once(&magick_stats_once, allocstats);
+
+	lua_newtable(L);
+
+	lua_newtable(L);
+	for (n = 0; n < nmagick_stats; n++) {
+		st = &magick_stats[n];
+		lua_newtable(L);
+		setcounter(L, "calls", &st->calls);
+		settime(L, "time", &st->nsec);
+		settime(L, "maxTime", &st->max_nsec);
+		setcounter(L, "pixelsIn", &st->pixels_in);
+		setcounter(L, "pixelsOut", &st->pixels_out);
+		lua_setfield(L, -2, st->name);
+	}
+	lua_setfield(L, -2, "methods");
+
+	lua_newtable(L);
+	for (n = 0; n < MAXFORMATS; n++) {
+		fs = &formats[n];
+		if (atomic_load(&fs->state) != 2)
+			continue;
+		lua_newtable(L);
+		setcounter(L, "decodes", &fs->decodes);
+		setcounter(L, "bytesDecoded", &fs->decoded);
+		setcounter(L, "encodes", &fs->encodes);
+		setcounter(L, "bytesEncoded", &fs->encoded);
+		lua_setfield(L, -2, fs->name);
+	}
+	lua_setfield(L, -2, "formats");
+
+	lua_pushboolean(L, atomic_load(&stats_enabled));
+	lua_setfield(L, -2, "enabled");
+	return 1;
+}
+
+static int
+resetStats(lua_State *L)
+{
+	struct method_stats *st;
+	struct format_stats *fs;
+	size_t n;
+
+	pthread_once(&magick_stats_once, allocstats);
+
+	for (n = 0; n < nmagick_stats; n++) {
+		st = &magick_stats[n];
+		atomic_store(&st->calls, 0);
+		atomic_store(&st->nsec, 0);
+		atomic_store(&st->max_nsec, 0);
+		atomic_store(&st->pixels_in, 0);
+		atomic_store(&st->pixels_out, 0);
+	}
+	for (n = 0; n < MAXFORMATS; n++) {
+		fs = &formats[n];
+		atomic_store(&fs->decodes, 0);
+		atomic_store(&fs->decoded, 0);
+		atomic_store(&fs->encodes, 0);
+		atomic_store(&fs->encoded, 0);
+	}
+	return 0;
+}
+
+static int
+enableStats(lua_State *L)
+{
+	luaL_checkany(L, 1);
+	atomic_store(&stats_enabled, lua_toboolean(L, 1));
+	return 0;
+}
+
+struct luaL_Reg stats_functions[] = {
+	{ "stats",		stats },
+	{ "resetStats",		resetStats },
+	{ "enableStats",	enableStats },
+	{ NULL, NULL }
+};
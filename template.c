@@ -0,0 +1,564 @@
+/*
+ * Copyright (c) 2016, 2017 Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of Micro Systems Marc Balmer nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/* Drawing templates for GraphicsMagick for Lua */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+#include <wand/magick_wand.h>
+
+#include "luagraphicsmagick.h"
+
+#define MAXARGS		6
+#define MAXPARAMS	64
+
+enum {
+	OP_ANNOTATION,
+	OP_ARC,
+	OP_CIRCLE,
+	OP_ELLIPSE,
+	OP_LINE,
+	OP_POINT,
+	OP_RECTANGLE,
+	OP_ROUNDRECTANGLE,
+	OP_POPGRAPHICCONTEXT,
+	OP_PUSHGRAPHICCONTEXT,
+	OP_ROTATE,
+	OP_SCALE,
+	OP_SKEWX,
+	OP_SKEWY,
+	OP_TRANSLATE,
+	OP_SETFILLCOLOR,
+	OP_SETFILLOPACITY,
+	OP_SETFONT,
+	OP_SETFONTFAMILY,
+	OP_SETFONTSIZE,
+	OP_SETFONTWEIGHT,
+	OP_SETSTROKECOLOR,
+	OP_SETSTROKEOPACITY,
+	OP_SETSTROKEWIDTH
+};
+
+/*
+ * Argument signatures use 'n' for numbers, 's' for strings and 'c' for
+ * color names.  The order must match the enum above.
+ */
+static const struct {
+	const char	*name;
+	const char	*sig;
+} opinfo[] = {
+	{ "annotation",		"nns" },
+	{ "arc",		"nnnnnn" },
+	{ "circle",		"nnnn" },
+	{ "ellipse",		"nnnnnn" },
+	{ "line",		"nnnn" },
+	{ "point",		"nn" },
+	{ "rectangle",		"nnnn" },
+	{ "roundRectangle",	"nnnnnn" },
+	{ "popGraphicContext",	"" },
+	{ "pushGraphicContext",	"" },
+	{ "rotate",		"n" },
+	{ "scale",		"nn" },
+	{ "skewX",		"n" },
+	{ "skewY",		"n" },
+	{ "translate",		"nn" },
+	{ "setFillColor",	"c" },
+	{ "setFillOpacity",	"n" },
+	{ "setFont",		"s" },
+	{ "setFontFamily",	"s" },
+	{ "setFontSize",	"n" },
+	{ "setFontWeight",	"n" },
+	{ "setStrokeColor",	"c" },
+	{ "setStrokeOpacity",	"n" },
+	{ "setStrokeWidth",	"n" },
+	{ NULL,			NULL }
+};
+
+/* An argument is either a literal or the index of a named parameter */
+struct template_arg {
+	int	 param;
+	double	 num;
+	char	*str;
+};
+
+struct template_op {
+	int			code;
+	struct template_arg	args[MAXARGS];
+};
+
+/*
+ * Templates are immutable once compiled and can be used by any number of
+ * threads at the same time.  Named templates are kept in a process wide
+ * list so that other Lua states can look them up.
+ */
+struct drawing_template {
+	atomic_int		 refcnt;
+	char			*name;
+	size_t			 nops;
+	struct template_op	*ops;
+	int			 ncolors;	/* color operations */
+	int			 nparams;
+	char			*params[MAXPARAMS];
+	char			 ptype[MAXPARAMS];
+	char			 pcolor[MAXPARAMS];	/* colors */
+	struct drawing_template	*next;
+};
+
+static pthread_mutex_t templates_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct drawing_template *templates;
+
+static void
+release(struct drawing_template *t)
+{
+	size_t n;
+	int i;
+
+	if (t == NULL || atomic_fetch_sub(&t->refcnt, 1) != 1)
+		return;
+	for (n = 0; n < t->nops; n++)
+		for (i = 0; i < MAXARGS; i++)
+			free(t->ops[n].args[i].str);
+	for (i = 0; i < t->nparams; i++)
+		free(t->params[i]);
+	free(t->ops);
+	free(t->name);
+	free(t);
+}
+
+static int
+findparam(lua_State *L, struct drawing_template *t, const char *name,
+    char type)
+{
+	int i;
+
+	for (i = 0; i < t->nparams; i++)
+		if (!strcmp(t->params[i], name)) {
+			if (t->ptype[i] != type)
+				return luaL_error(L, "parameter '%s' is used "
+				    "as number and as string", name);
+			return i;
+		}
+	if (t->nparams == MAXPARAMS)
+		return luaL_error(L, "too many template parameters");
+	if ((t->params[i] = strdup(name)) == NULL)
+		return luaL_error(L, "memory error");
+	t->ptype[i] = type;
+	t->nparams++;
+	return i;
+}
+
+static int
+validcolor(const char *color)
+{
+	PixelWand *pw;
+	unsigned int status;
+
+	if ((pw = NewPixelWand()) == NULL)
+		return 0;
+	status = PixelSetColor(pw, color);
+	DestroyPixelWand(pw);
+	return status;
+}
+
+static void
+compileop(lua_State *L, struct drawing_template *t, struct template_op *op,
+    size_t opno)
+{
+	struct template_arg *arg;
+	const char *name, *sig, *s;
+	char type;
+	int n;
+
+	if (lua_rawgeti(L, -1, 1) != LUA_TSTRING)
+		luaL_error(L, "operation %d: name expected", (int)opno);
+	name = lua_tostring(L, -1);
+	for (n = 0; opinfo[n].name != NULL; n++)
+		if (!strcmp(opinfo[n].name, name))
+			break;
+	if (opinfo[n].name == NULL)
+		luaL_error(L, "operation %d: '%s' can not be used in a "
+		    "template", (int)opno, name);
+	lua_pop(L, 1);
+	op->code = n;
+	if (n == OP_SETFILLCOLOR || n == OP_SETSTROKECOLOR)
+		t->ncolors++;
+
+	for (sig = opinfo[n].sig, n = 0; sig[n] != '\0'; n++) {
+		arg = &op->args[n];
+		arg->param = -1;
+		type = sig[n] == 'n' ? 'n' : 's';
+		switch (lua_rawgeti(L, -1, n + 2)) {
+		case LUA_TNUMBER:
+			if (type != 'n')
+				luaL_error(L, "operation %d: argument %d must "
+				    "be a string", (int)opno, n + 1);
+			arg->num = lua_tonumber(L, -1);
+			break;
+		case LUA_TSTRING:
+			s = lua_tostring(L, -1);
+			if (s[0] == '$' && s[1] != '$') {
+				arg->param = findparam(L, t, s + 1, type);
+				if (sig[n] == 'c')
+					t->pcolor[arg->param] = 1;
+				break;
+			}
+			/* '$$' escapes a literal '$' */
+			if (s[0] == '$')
+				s++;
+			if (type != 's')
+				luaL_error(L, "operation %d: argument %d must "
+				    "be a number", (int)opno, n + 1);
+			if (sig[n] == 'c' && !validcolor(s))
+				luaL_error(L, "operation %d: invalid color "
+				    "'%s'", (int)opno, s);
+			if ((arg->str = strdup(s)) == NULL)
+				luaL_error(L, "memory error");
+			break;
+		default:
+			luaL_error(L, "operation %d: argument %d missing",
+			    (int)opno, n + 1);
+		}
+		lua_pop(L, 1);
+	}
+}
+
+static struct drawing_template **
+pushtemplate(lua_State *L, struct drawing_template *t)
+{
+	struct drawing_template **tp;
+
+	tp = lua_newuserdata(L, sizeof(struct drawing_template *));
+	*tp = t;
+	luaL_setmetatable(L, DRAWING_TEMPLATE_METATABLE);
+	return tp;
+}
+
+/*
+ * Compile the list of operations at index into a template and push it,
+ * returns the template.
+ */
+struct drawing_template *
+compiletemplate(lua_State *L, int index)
+{
+	struct drawing_template *t, **tp;
+	size_t n, len;
+
+	index = lua_absindex(L, index);
+	tp = pushtemplate(L, NULL);
+	if ((t = calloc(1, sizeof(struct drawing_template))) == NULL)
+		luaL_error(L, "memory error");
+	atomic_init(&t->refcnt, 1);
+	*tp = t;
+
+	len = lua_rawlen(L, index);
+	if ((t->ops = calloc(len + 1, sizeof(struct template_op))) == NULL)
+		luaL_error(L, "memory error");
+	for (n = 0; n < len; n++) {
+		if (lua_rawgeti(L, index, n + 1) != LUA_TTABLE)
+			luaL_error(L, "operation %d: table expected",
+			    (int)n + 1);
+		t->nops = n + 1;
+		compileop(L, t, &t->ops[n], n + 1);
+		lua_pop(L, 1);
+	}
+	return t;
+}
+
+/*
+ * graphicsmagick.newDrawingTemplate(ops[, name]) compiles a list of
+ * DrawingWand operations like { 'rectangle', 0, 0, '$width', 20 }.
+ * Strings starting with '$' name a parameter supplied at replay time,
+ * a leading '$$' stands for a literal '$'.  Invalid colors raise an error,
+ * color parameters are checked at replay time before anything is drawn.
+ */
+static int
+newDrawingTemplate(lua_State *L)
+{
+	struct drawing_template *t, *old, **p;
+	const char *name;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	name = luaL_optstring(L, 2, NULL);
+	t = compiletemplate(L, 1);
+
+	if (name != NULL) {
+		if ((t->name = strdup(name)) == NULL)
+			return luaL_error(L, "memory error");
+		atomic_fetch_add(&t->refcnt, 1);
+		pthread_mutex_lock(&templates_mtx);
+		for (p = &templates; *p != NULL; p = &(*p)->next)
+			if (!strcmp((*p)->name, name)) {
+				old = *p;
+				*p = old->next;
+				release(old);
+				break;
+			}
+		t->next = templates;
+		templates = t;
+		pthread_mutex_unlock(&templates_mtx);
+	}
+	return 1;
+}
+
+/* graphicsmagick.drawingTemplate(name) returns a shared template */
+static int
+drawingTemplate(lua_State *L)
+{
+	struct drawing_template *t;
+	const char *name;
+
+	name = luaL_checkstring(L, 1);
+
+	pthread_mutex_lock(&templates_mtx);
+	for (t = templates; t != NULL; t = t->next)
+		if (!strcmp(t->name, name)) {
+			atomic_fetch_add(&t->refcnt, 1);
+			break;
+		}
+	pthread_mutex_unlock(&templates_mtx);
+
+	if (t == NULL)
+		lua_pushnil(L);
+	else
+		pushtemplate(L, t);
+	return 1;
+}
+
+struct param_value {
+	double		 num;
+	const char	*str;
+};
+
+static double
+num(struct template_arg *arg, struct param_value *values)
+{
+	return arg->param == -1 ? arg->num : values[arg->param].num;
+}
+
+static const char *
+str(struct template_arg *arg, struct param_value *values)
+{
+	return arg->param == -1 ? arg->str : values[arg->param].str;
+}
+
+/*
+ * Replay the template at index onto dw, taking parameters from the table
+ * at pindex.  All parameters are resolved before anything is drawn.
+ */
+void
+replaytemplate(lua_State *L, int index, int pindex, DrawingWand *dw)
+{
+	struct drawing_template *t;
+	struct template_op *op;
+	struct template_arg *a;
+	struct param_value values[MAXPARAMS];
+	PixelWand **pw = NULL;
+	size_t n;
+	int i, isnum;
+
+	t = *(struct drawing_template **)checkudata(L, index,
+	    DRAWING_TEMPLATE_METATABLE);
+	if (t == NULL)
+		luaL_argerror(L, index, "template has been destroyed");
+	if (t->nparams > 0)
+		luaL_checktype(L, pindex, LUA_TTABLE);
+
+	/* A PixelWand userdata, so that errors do not leak it */
+	if (t->ncolors > 0) {
+		pw = lua_newuserdata(L, sizeof(PixelWand *));
+		*pw = NULL;
+		luaL_setmetatable(L, PIXEL_WAND_METATABLE);
+		if ((*pw = NewPixelWand()) == NULL)
+			luaL_error(L, "memory error");
+	}
+
+	for (i = 0; i < t->nparams; i++) {
+		lua_getfield(L, pindex, t->params[i]);
+		if (t->ptype[i] == 'n') {
+			values[i].num = lua_tonumberx(L, -1, &isnum);
+			if (!isnum)
+				luaL_error(L, "parameter '%s' must be a number",
+				    t->params[i]);
+		} else {
+			if (lua_type(L, -1) != LUA_TSTRING)
+				luaL_error(L, "parameter '%s' must be a string",
+				    t->params[i]);
+			/* The string stays referenced by the parameter table */
+			values[i].str = lua_tostring(L, -1);
+			if (t->pcolor[i] && !PixelSetColor(*pw, values[i].str))
+				luaL_error(L, "parameter '%s' is not a valid "
+				    "color", t->params[i]);
+		}
+		lua_pop(L, 1);
+	}
+
+	for (n = 0; n < t->nops; n++) {
+		op = &t->ops[n];
+		a = op->args;
+		switch (op->code) {
+		case OP_ANNOTATION:
+			DrawAnnotation(dw, num(&a[0], values),
+			    num(&a[1], values),
+			    (const unsigned char *)str(&a[2], values));
+			break;
+		case OP_ARC:
+			DrawArc(dw, num(&a[0], values), num(&a[1], values),
+			    num(&a[2], values), num(&a[3], values),
+			    num(&a[4], values), num(&a[5], values));
+			break;
+		case OP_CIRCLE:
+			DrawCircle(dw, num(&a[0], values), num(&a[1], values),
+			    num(&a[2], values), num(&a[3], values));
+			break;
+		case OP_ELLIPSE:
+			DrawEllipse(dw, num(&a[0], values), num(&a[1], values),
+			    num(&a[2], values), num(&a[3], values),
+			    num(&a[4], values), num(&a[5], values));
+			break;
+		case OP_LINE:
+			DrawLine(dw, num(&a[0], values), num(&a[1], values),
+			    num(&a[2], values), num(&a[3], values));
+			break;
+		case OP_POINT:
+			DrawPoint(dw, num(&a[0], values), num(&a[1], values));
+			break;
+		case OP_RECTANGLE:
+			DrawRectangle(dw, num(&a[0], values),
+			    num(&a[1], values), num(&a[2], values),
+			    num(&a[3], values));
+			break;
+		case OP_ROUNDRECTANGLE:
+			DrawRoundRectangle(dw, num(&a[0], values),
+			    num(&a[1], values), num(&a[2], values),
+			    num(&a[3], values), num(&a[4], values),
+			    num(&a[5], values));
+			break;
+		case OP_POPGRAPHICCONTEXT:
+			DrawPopGraphicContext(dw);
+			break;
+		case OP_PUSHGRAPHICCONTEXT:
+			DrawPushGraphicContext(dw);
+			break;
+		case OP_ROTATE:
+			DrawRotate(dw, num(&a[0], values));
+			break;
+		case OP_SCALE:
+			DrawScale(dw, num(&a[0], values), num(&a[1], values));
+			break;
+		case OP_SKEWX:
+			DrawSkewX(dw, num(&a[0], values));
+			break;
+		case OP_SKEWY:
+			DrawSkewY(dw, num(&a[0], values));
+			break;
+		case OP_TRANSLATE:
+			DrawTranslate(dw, num(&a[0], values),
+			    num(&a[1], values));
+			break;
+		case OP_SETFILLCOLOR:
+		case OP_SETSTROKECOLOR:
+			/* Colors were checked before drawing started */
+			PixelSetColor(*pw, str(&a[0], values));
+			if (op->code == OP_SETFILLCOLOR)
+				DrawSetFillColor(dw, *pw);
+			else
+				DrawSetStrokeColor(dw, *pw);
+			break;
+		case OP_SETFILLOPACITY:
+			DrawSetFillOpacity(dw, num(&a[0], values));
+			break;
+		case OP_SETFONT:
+			DrawSetFont(dw, str(&a[0], values));
+			break;
+		case OP_SETFONTFAMILY:
+			DrawSetFontFamily(dw, str(&a[0], values));
+			break;
+		case OP_SETFONTSIZE:
+			DrawSetFontSize(dw, num(&a[0], values));
+			break;
+		case OP_SETFONTWEIGHT:
+			DrawSetFontWeight(dw, num(&a[0], values));
+			break;
+		case OP_SETSTROKEOPACITY:
+			DrawSetStrokeOpacity(dw, num(&a[0], values));
+			break;
+		case OP_SETSTROKEWIDTH:
+			DrawSetStrokeWidth(dw, num(&a[0], values));
+			break;
+		}
+	}
+	if (pw != NULL)
+		lua_pop(L, 1);
+}
+
+static int
+parameters(lua_State *L)
+{
+	struct drawing_template **t;
+	int i;
+
+	t = checkudata(L, 1, DRAWING_TEMPLATE_METATABLE);
+	if (*t == NULL)
+		return 0;
+	lua_createtable(L, 0, (*t)->nparams);
+	for (i = 0; i < (*t)->nparams; i++) {
+		lua_pushstring(L, (*t)->ptype[i] == 'n' ? "number" : "string");
+		lua_setfield(L, -2, (*t)->params[i]);
+	}
+	return 1;
+}
+
+static int
+destroy(lua_State *L)
+{
+	struct drawing_template **t;
+
+	t = checkudata(L, 1, DRAWING_TEMPLATE_METATABLE);
+	release(*t);
+	*t = NULL;
+	return 0;
+}
+
+struct luaL_Reg drawing_template_methods[] = {
+	{ "parameters",		parameters },
+	{ "destroy",		destroy },
+	{ "__gc",		destroy },
+	{ NULL, NULL }
+};
+
+struct luaL_Reg template_functions[] = {
+	{ "newDrawingTemplate",	newDrawingTemplate },
+	{ "drawingTemplate",	drawingTemplate },
+	{ NULL, NULL }
+};
@@ -0,0 +1,240 @@
+/*
+ * Copyright (c) 2016, 2017 Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of Micro Systems Marc Balmer nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Chrome trace event export for GraphicsMagick for Lua */
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+#include <wand/magick_wand.h>
+
+#include "luagraphicsmagick.h"
+
+#define DEFAULT_SPANS	65536
+
+/*
+ * seq is 0 while a span is written and its index in the ring plus one
+ * once it is complete, flushTrace() skips spans that change under it.
+ */
+struct span {
+	atomic_size_t	 seq;
+	const char	*category;
+	const char	*name;
+	uint64_t	 start;
+	uint64_t	 duration;
+	uint64_t	 tid;
+	unsigned long	 width;
+	unsigned long	 height;
+	char		 format[16];
+};
+
+atomic_int tracing;
+
+/*
+ * The ring buffer is allocated once, on the first startTrace() call, and
+ * never released, so that threads still recording a span while tracing
+ * is stopped can not write to freed memory.  For the same reason its
+ * capacity can not be changed later.
+ */
+static pthread_mutex_t trace_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct span *spans;
+static atomic_size_t nspans;	/* published after spans, 0 before */
+static atomic_size_t next_span;
+
+static uint64_t
+threadid(void)
+{
+#ifdef __linux__
+	return syscall(SYS_gettid);
+#else
+	return (uint64_t)(uintptr_t)pthread_self();
+#endif
+}
+
+void
+tracespan(const char *category, const char *name, uint64_t start,
+    uint64_t end, MagickWand *wand)
+{
+	struct span *sp;
+	char *format;
+	size_t n, size;
+
+	size = atomic_load_explicit(&nspans, memory_order_acquire);
+	if (size == 0)
+		return;
+
+	n = atomic_fetch_add(&next_span, 1);
+	sp = &spans[n % size];
+	atomic_store_explicit(&sp->seq, 0, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	sp->category = category;
+	sp->name = name;
+	sp->start = start;
+	sp->duration = end - start;
+	sp->tid = threadid();
+	sp->width = sp->height = 0;
+	sp->format[0] = '\0';
+
+	if (wand != NULL && MagickGetNumberImages(wand) > 0) {
+		sp->width = MagickGetImageWidth(wand);
+		sp->height = MagickGetImageHeight(wand);
+		format = MagickGetImageFormat(wand);
+		if (format != NULL) {
+			snprintf(sp->format, sizeof sp->format, "%s", format);
+			free(format);
+		}
+	}
+	atomic_store_explicit(&sp->seq, n + 1, memory_order_release);
+}
+
+static int
+startTrace(lua_State *L)
+{
+	lua_Integer capacity;
+	size_t size;
+
+	size = atomic_load(&nspans);
+	capacity = luaL_optinteger(L, 1, size ? size : DEFAULT_SPANS);
+	luaL_argcheck(L, capacity > 0, 1, "capacity must be positive");
+
+	pthread_mutex_lock(&trace_mtx);
+	size = atomic_load(&nspans);
+	if (size != 0 && (size_t)capacity != size) {
+		pthread_mutex_unlock(&trace_mtx);
+		return luaL_error(L, "the trace buffer already holds %d spans",
+		    (int)size);
+	}
+	if (spans == NULL) {
+		spans = calloc(capacity, sizeof(struct span));
+		if (spans == NULL) {
+			pthread_mutex_unlock(&trace_mtx);
+			return luaL_error(L, "memory error");
+		}
+		atomic_store_explicit(&nspans, capacity,
+		    memory_order_release);
+	}
+	atomic_store(&next_span, 0);
+	atomic_store(&tracing, 1);
+	pthread_mutex_unlock(&trace_mtx);
+	return 0;
+}
+
+static int
+stopTrace(lua_State *L)
+{
+	atomic_store(&tracing, 0);
+	return 0;
+}
+
+static int
+flushTrace(lua_State *L)
+{
+	FILE *fp;
+	struct span *sp, span;
+	const char *path;
+	size_t first, last, n, size, count = 0;
+	pid_t pid;
+
+	path = luaL_checkstring(L, 1);
+
+	pthread_mutex_lock(&trace_mtx);
+	fp = fopen(path, "w");
+	if (fp == NULL) {
+		pthread_mutex_unlock(&trace_mtx);
+		lua_pushnil(L);
+		lua_pushfstring(L, "%s: cannot open", path);
+		return 2;
+	}
+
+	pid = getpid();
+	size = atomic_load(&nspans);
+	last = atomic_load(&next_span);
+	first = last > size ? last - size : 0;
+
+	fprintf(fp, "{\"traceEvents\":[\n");
+	for (n = first; size != 0 && n < last; n++) {
+		sp = &spans[n % size];
+		if (atomic_load_explicit(&sp->seq, memory_order_acquire) !=
+		    n + 1)
+			continue;
+		span.category = sp->category;
+		span.name = sp->name;
+		span.start = sp->start;
+		span.duration = sp->duration;
+		span.tid = sp->tid;
+		span.width = sp->width;
+		span.height = sp->height;
+		memcpy(span.format, sp->format, sizeof span.format);
+		span.format[sizeof span.format - 1] = '\0';
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit(&sp->seq, memory_order_relaxed) !=
+		    n + 1)
+			continue;
+
+		fprintf(fp, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+		    "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%llu",
+		    count ? ",\n" : "", span.name, span.category,
+		    span.start / 1e3, span.duration / 1e3, (int)pid,
+		    (unsigned long long)span.tid);
+		if (span.width)
+			fprintf(fp, ",\"args\":{\"width\":%lu,\"height\":%lu,"
+			    "\"format\":\"%s\"}", span.width, span.height,
+			    span.format);
+		fprintf(fp, "}");
+		count++;
+	}
+	fprintf(fp, "\n],\"displayTimeUnit\":\"ms\"}\n");
+
+	atomic_store(&next_span, 0);
+	pthread_mutex_unlock(&trace_mtx);
+
+	if (fclose(fp)) {
+		lua_pushnil(L);
+		lua_pushfstring(L, "%s: write error", path);
+		return 2;
+	}
+	lua_pushinteger(L, count);
+	return 1;
+}
+
+struct luaL_Reg trace_functions[] = {
+	{ "startTrace",		startTrace },
+	{ "stopTrace",		stopTrace },
+	{ "flushTrace",		flushTrace },
+	{ NULL, NULL }
+};